@@ -0,0 +1,129 @@
+#!/bin/bash
+#
+# Monitoring-overhead benchmark for the intel_cqm PMU.
+#
+# For the baseline ("none") and every event in EVENTS, and for every
+# thread count in THREADS, run cqmload with the event open on each
+# thread and record:
+#
+#   mbps                 stream throughput
+#   ns_per_switch        context switch cost (pipe ping-pong)
+#   read_avg_ns/p99_ns   read() latency of the event
+#   timer_irqs/call_ipis local timer interrupts and function call IPIs
+#                        taken system wide while idle with the event open
+#   cqm_*                the driver's own stats, when it has them
+#
+# One CSV row per run goes to OUT (stdout by default).
+#
+# -b hw uses the intel_cqm PMU. -b generic opens a cpu-clock task event
+# in place of every event instead; it exercises no CQM code at all, but
+# runs on any Linux machine and gives the generic perf cost to compare
+# hw numbers against.
+#
+#   ./cqm-bench.sh [-b hw|generic] [-e "llc_occupancy total_bw"] [-t "1 4"]
+#                  [-s secs] [-n reads] [-r repeats] [-m MB] [-o out.csv]
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CQMLOAD=$BENCH_DIR/cqmload
+PMU=/sys/bus/event_source/devices/intel_cqm
+
+BACKEND=
+EVENTS="llc_occupancy total_bw local_bw avg_total_bw avg_local_bw"
+THREADS="1 2 4"
+SECS=5
+READS=100000
+REPEAT=3
+MB=64
+OUT=/dev/stdout
+
+while getopts "b:e:t:s:n:r:m:o:" opt; do
+  case $opt in
+    b) BACKEND=$OPTARG ;;
+    e) EVENTS=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    s) SECS=$OPTARG ;;
+    n) READS=$OPTARG ;;
+    r) REPEAT=$OPTARG ;;
+    m) MB=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '/^#   \.\/cqm-bench.sh/,/^#$/s/^#   //p' "$0" >&2; exit 2 ;;
+  esac
+done
+
+if [ -z "$BACKEND" ]; then
+  if [ -d $PMU ]; then BACKEND=hw; else BACKEND=generic; fi
+fi
+
+if [ $BACKEND = hw ] && [ ! -d $PMU ]; then
+  echo "no intel_cqm PMU, try -b generic" >&2
+  exit 1
+fi
+
+if [ ! -x "$CQMLOAD" ] || [ "$CQMLOAD" -ot "$CQMLOAD.c" ]; then
+  ${CC:-cc} -O2 -pthread -o "$CQMLOAD" "$CQMLOAD.c"
+fi
+
+#
+# type:config for cqmload -e, empty for the baseline.
+#
+event_spec() {
+  local cfg
+
+  [ "$1" = none ] && return
+  if [ $BACKEND = generic ]; then
+    echo 1:0
+    return
+  fi
+
+  cfg=$(sed -n 's/^event=\(0x[0-9a-fA-F]*\).*/\1/p' $PMU/events/$1)
+  [ -n "$cfg" ] || { echo "unknown event $1" >&2; exit 1; }
+  echo $(cat $PMU/type):$cfg
+}
+
+# sum of one row of /proc/interrupts over all cpus
+irqs() {
+  awk -v row="$1:" '$1 == row { for (i = 2; i <= NF; i++) if ($i ~ /^[0-9]+$/) s += $i } END { print s + 0 }' /proc/interrupts
+}
+
+cqm_stat() {
+  if [ -r $PMU/stats/$1 ]; then cat $PMU/stats/$1; else echo 0; fi
+}
+
+kv() {
+  sed -n "s/.*\\b$1=\\([^ ]*\\).*/\\1/p"
+}
+
+echo "backend,event,threads,rep,mbps,ns_per_switch,read_avg_ns,read_p99_ns,timer_irqs,call_ipis,cqm_ipi_sweeps,cqm_hrtimer_fires,cqm_msr_reads" > "$OUT"
+
+for ev in none $EVENTS; do
+  spec=$(event_spec $ev)
+  earg=${spec:+-e $spec}
+
+  for t in $THREADS; do
+    for rep in $(seq 1 $REPEAT); do
+      mbps=$("$CQMLOAD" stream -t $t -m $MB -s $SECS $earg | kv mbps)
+      nsw=$("$CQMLOAD" pingpong -s $SECS $earg | kv ns_per_switch)
+
+      ravg=; rp99=
+      if [ -n "$spec" ]; then
+        r=$("$CQMLOAD" read -n $READS $earg)
+        ravg=$(echo "$r" | kv avg_ns)
+        rp99=$(echo "$r" | kv p99_ns)
+      fi
+
+      loc0=$(irqs LOC); cal0=$(irqs CAL)
+      ipi0=$(cqm_stat ipi_sweeps); hrt0=$(cqm_stat hrtimer_fires)
+      msr0=$(cqm_stat msr_reads)
+      "$CQMLOAD" idle -s $SECS $earg > /dev/null
+      loc=$(( $(irqs LOC) - loc0 )); cal=$(( $(irqs CAL) - cal0 ))
+      ipi=$(( $(cqm_stat ipi_sweeps) - ipi0 ))
+      hrt=$(( $(cqm_stat hrtimer_fires) - hrt0 ))
+      msr=$(( $(cqm_stat msr_reads) - msr0 ))
+
+      echo "$BACKEND,$ev,$t,$rep,$mbps,$nsw,$ravg,$rp99,$loc,$cal,$ipi,$hrt,$msr" >> "$OUT"
+    done
+  done
+done
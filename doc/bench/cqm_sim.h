@@ -0,0 +1,237 @@
+/*
+ * cqm_sim.h - the driver's MBM sampling code on a simulated MSR backend.
+ *
+ * Provides just enough of the kernel for mbm_gen.h (see mbm-extract.sh)
+ * to build in userspace, with time and the MBM counters simulated:
+ *
+ *   sim_setup(pkgs, rmids)		allocate samples and counters
+ *   sim_set_rate(pkg, rmid, local, r)	counter r increments per second
+ *   sim_advance(ns)			move the clock forward
+ *   sim_cur_pkg			package rmid_read_mbm() runs on
+ *
+ * or, to replay recorded counters (see mbmtrace.c):
+ *
+ *   sim_set_time(ns)			set the clock
+ *   sim_set_raw(pkg, rmid, local, v)	what the counter reads next
+ *
+ * llc_occupancy, for bw_per_occupancy, is whatever was last given to
+ *
+ *   sim_set_occ(pkg, rmid, v)		occupancy in counter units
+ *
+ * Counters are 24 bits wide and wrap like the hardware's.
+ */
+#ifndef _CQM_SIM_H
+#define _CQM_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define MSEC_PER_SEC	1000L
+#define NSEC_PER_MSEC	1000000L
+#define NSEC_PER_SEC	1000000000ULL
+#define U64_MAX		UINT64_MAX
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max_t(type, a, b)	((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define div_u64(a, b)		((u64)(a) / (b))
+#define div64_u64(a, b)		((u64)(a) / (b))
+
+#define SIM_MAX_PKGS	64
+#define SIM_CNTR_MASK	0xffffffULL
+
+enum cqm_stat_item {
+	CQM_STAT_MBM_OVERFLOW,
+	CQM_STAT_MBM_THROTTLED,
+	CQM_STAT_MBM_LATE,
+	NR_CQM_STATS,
+};
+
+static unsigned long sim_stat[NR_CQM_STATS];
+
+static inline void cqm_stat_inc(enum cqm_stat_item item)
+{
+	sim_stat[item]++;
+}
+
+#define trace_mbm_overflow(rmid, evt_type, prev, cur)	do { } while (0)
+#define trace_mbm_sample(rmid, evt_type, dt, bw, avg, acc) do { (void)(acc); } while (0)
+
+static u64 sim_now;
+
+static inline u64 ktime_get_ns(void)
+{
+	return sim_now;
+}
+
+/*
+ * One MBM counter: @acc counts since the start, @rem carries the
+ * fraction of a count over to the next update.
+ */
+struct sim_ctr {
+	u64	acc;
+	u64	rem;
+	u64	rate;
+	u64	t;
+	u64	flags;		/* RMID_VAL_* */
+};
+
+struct mbm_pkg;
+
+static struct mbm_pkg *sim_pkg[SIM_MAX_PKGS];
+static struct sim_ctr *sim_ctr[SIM_MAX_PKGS][2];
+static u64 *sim_occ[SIM_MAX_PKGS];
+static unsigned int sim_nr_pkgs, sim_nr_rmids;
+static int sim_cur_pkg;
+
+static inline struct mbm_pkg *this_mbm_pkg(void)
+{
+	return sim_pkg[sim_cur_pkg];
+}
+
+static void sim_ctr_update(struct sim_ctr *c)
+{
+	u64 n = c->rate * (sim_now - c->t) + c->rem;
+
+	c->acc += n / NSEC_PER_SEC;
+	c->rem = n % NSEC_PER_SEC;
+	c->t = sim_now;
+}
+
+static u64 sim_ctr_read(int pkg, u32 rmid, bool local)
+{
+	struct sim_ctr *c = &sim_ctr[pkg][local][rmid];
+
+	sim_ctr_update(c);
+	return (c->acc & SIM_CNTR_MASK) | c->flags;
+}
+
+static u64 cqm_read_counter(u32 eventid, u32 rmid);
+static u64 __rmid_read(u32 rmid);
+
+/* Not every tool uses all of the driver's code. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "mbm_gen.h"
+#pragma GCC diagnostic pop
+
+static u64 cqm_read_counter(u32 eventid, u32 rmid)
+{
+	return sim_ctr_read(sim_cur_pkg, rmid,
+			    eventid == QOS_MBM_LOCAL_EVENT_ID);
+}
+
+static u64 __rmid_read(u32 rmid)
+{
+	return sim_occ[sim_cur_pkg][rmid];
+}
+
+static void *sim_zalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void sim_teardown(void)
+{
+	struct mbm_pkg *pkg;
+	unsigned int i;
+
+	for (i = 0; i < sim_nr_pkgs; i++) {
+		pkg = sim_pkg[i];
+		free(pkg->local);
+		free(pkg->total);
+		free(pkg);
+		free(sim_ctr[i][0]);
+		free(sim_ctr[i][1]);
+		free(sim_occ[i]);
+	}
+	sim_nr_pkgs = 0;
+}
+
+/*
+ * Fresh samples and counters, every counter at zero and stopped. The
+ * clock starts well away from zero like a real ktime would, so the
+ * first sample of every RMID takes the first-sample path.
+ */
+static void sim_setup(unsigned int nr_pkgs, unsigned int nr_rmids)
+{
+	struct mbm_pkg *pkg;
+	unsigned int i;
+
+	if (nr_pkgs > SIM_MAX_PKGS) {
+		fprintf(stderr, "at most %d packages\n", SIM_MAX_PKGS);
+		exit(1);
+	}
+
+	sim_teardown();
+	memset(sim_stat, 0, sizeof(sim_stat));
+	sim_now = 3600 * NSEC_PER_SEC;
+
+	for (i = 0; i < nr_pkgs; i++) {
+		pkg = sim_zalloc(sizeof(*pkg));
+		pkg->local = sim_zalloc(nr_rmids * sizeof(struct sample));
+		pkg->total = sim_zalloc(nr_rmids * sizeof(struct sample));
+		sim_pkg[i] = pkg;
+		sim_ctr[i][0] = sim_zalloc(nr_rmids * sizeof(struct sim_ctr));
+		sim_ctr[i][1] = sim_zalloc(nr_rmids * sizeof(struct sim_ctr));
+		sim_occ[i] = sim_zalloc(nr_rmids * sizeof(u64));
+	}
+
+	sim_nr_pkgs = nr_pkgs;
+	sim_nr_rmids = nr_rmids;
+	sim_cur_pkg = 0;
+}
+
+static inline void sim_set_rate(int pkg, u32 rmid, bool local, u64 rate)
+{
+	struct sim_ctr *c = &sim_ctr[pkg][local][rmid];
+
+	sim_ctr_update(c);
+	c->rate = rate;
+}
+
+static inline void sim_advance(u64 ns)
+{
+	sim_now += ns;
+}
+
+static inline void sim_set_time(u64 ns)
+{
+	sim_now = ns;
+}
+
+/*
+ * Stop the counter at @val; @val may carry RMID_VAL_UNAVAIL.
+ */
+static inline void sim_set_raw(int pkg, u32 rmid, bool local, u64 val)
+{
+	struct sim_ctr *c = &sim_ctr[pkg][local][rmid];
+
+	c->acc = val & SIM_CNTR_MASK;
+	c->flags = val & ~SIM_CNTR_MASK;
+	c->rem = 0;
+	c->rate = 0;
+	c->t = sim_now;
+}
+
+/*
+ * @val may carry RMID_VAL_UNAVAIL like the hardware's.
+ */
+static inline void sim_set_occ(int pkg, u32 rmid, u64 val)
+{
+	sim_occ[pkg][rmid] = val;
+}
+
+#endif /* _CQM_SIM_H */
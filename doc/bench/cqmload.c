@@ -0,0 +1,493 @@
+/*
+ * cqmload - workloads and probes for the intel_cqm monitoring-overhead
+ * benchmark, see cqm-bench.sh.
+ *
+ *   gcc -O2 -pthread -o cqmload cqmload.c
+ *
+ *   cqmload stream   [-t threads] [-m MB] [-s secs] [-r] [-e event]
+ *   cqmload pingpong [-s secs] [-e event]
+ *   cqmload read     [-n reads] [-e event]
+ *   cqmload idle     [-s secs] [-e event]
+ *   cqmload paced    -S MBps:secs[,MBps:secs...] [-t threads] [-m MB] [-e event]
+ *
+ * stream walks a buffer per thread (randomly with -r, like "cqm thrash")
+ * and replaces cpumem64/mgen. pingpong bounces a byte between two
+ * threads over pipes, so every round trip is two context switches.
+ * read times read() on the event. idle just keeps the event open.
+ *
+ * paced is the calibrated generator for mbmcheck-hw.sh: one load per
+ * cache line, no stores, so with buffers well beyond the LLC every
+ * byte read is a byte of memory traffic. It holds the total rate to
+ * the schedule, e.g. -S 1000:10,4000:10,1000:10 for a step, and prints
+ * the rate it achieved every second. MB here are 10^6 bytes, as in the
+ * driver's MB/sec.
+ *
+ * -e type:config[:config1] opens a task event on every thread, e.g.
+ * the intel_cqm PMU type from sysfs, or 1:0 (cpu-clock) to run the same
+ * thing on a machine without it.
+ *
+ * Results go to stdout as one line of key=value pairs, per second for
+ * paced.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+static struct perf_event_attr ev_attr;
+static int ev_set;
+
+static unsigned int nr_threads = 1;
+static unsigned long buf_mb = 64;
+static unsigned int secs = 5;
+static unsigned long nr_reads = 100000;
+static int random_walk;
+
+static volatile int stop;
+static volatile uint64_t sink;
+
+#define MAX_SEGS	64
+
+struct seg {
+	double		mbps;
+	unsigned int	secs;
+};
+
+static struct seg sched[MAX_SEGS];
+static unsigned int nr_segs;
+static uint64_t paced_start;
+static uint64_t paced_bytes;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int parse_event(const char *s)
+{
+	unsigned long long type, config, config1 = 0;
+
+	if (sscanf(s, "%llu:%lli:%lli", &type, (long long *)&config,
+		   (long long *)&config1) < 2)
+		return -1;
+
+	memset(&ev_attr, 0, sizeof(ev_attr));
+	ev_attr.size = sizeof(ev_attr);
+	ev_attr.type = type;
+	ev_attr.config = config;
+	ev_attr.config1 = config1;
+	ev_set = 1;
+
+	return 0;
+}
+
+/*
+ * Open the event on the calling thread, -1 if none was asked for.
+ */
+static int open_event(void)
+{
+	int fd;
+
+	if (!ev_set)
+		return -1;
+
+	fd = syscall(__NR_perf_event_open, &ev_attr, 0, -1, -1, 0);
+	if (fd < 0)
+		die("perf_event_open");
+
+	return fd;
+}
+
+struct stream_arg {
+	uint64_t	bytes;
+};
+
+static void *stream_thread(void *arg)
+{
+	struct stream_arg *sa = arg;
+	size_t len = buf_mb << 20;
+	size_t nr = len / sizeof(uint64_t);
+	uint64_t *buf, sum = 0, x = 88172645463325252ULL;
+	size_t i;
+	int fd;
+
+	fd = open_event();
+
+	buf = malloc(len);
+	if (!buf)
+		die("malloc");
+	memset(buf, 1, len);
+
+	while (!stop) {
+		if (random_walk) {
+			for (i = 0; i < nr; i++) {
+				/* xorshift64 */
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				sum += buf[x % nr]++;
+			}
+		} else {
+			for (i = 0; i < nr; i += 8)
+				sum += buf[i]++;
+		}
+		sa->bytes += len;
+	}
+
+	sink = sum;
+
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static int do_stream(void)
+{
+	struct stream_arg *sa;
+	pthread_t *tid;
+	uint64_t t0, t1, bytes = 0;
+	unsigned int i;
+
+	sa = calloc(nr_threads, sizeof(*sa));
+	tid = calloc(nr_threads, sizeof(*tid));
+	if (!sa || !tid)
+		die("calloc");
+
+	t0 = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&tid[i], NULL, stream_thread, &sa[i]))
+			die("pthread_create");
+
+	sleep(secs);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(tid[i], NULL);
+		bytes += sa[i].bytes;
+	}
+	t1 = now_ns();
+
+	printf("mode=stream threads=%u mb=%lu random=%d secs=%.3f mbps=%.1f\n",
+	       nr_threads, buf_mb, random_walk, (t1 - t0) / 1e9,
+	       bytes / 1048576.0 / ((t1 - t0) / 1e9));
+	return 0;
+}
+
+static int parse_sched(const char *s)
+{
+	char *end;
+
+	for (nr_segs = 0; *s && nr_segs < MAX_SEGS; nr_segs++) {
+		sched[nr_segs].mbps = strtod(s, &end);
+		if (*end != ':')
+			return -1;
+		sched[nr_segs].secs = strtoul(end + 1, &end, 0);
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		s = end;
+	}
+
+	return nr_segs ? 0 : -1;
+}
+
+/*
+ * Bytes the schedule allows @ns into the run, and the target rate then.
+ */
+static double sched_bytes(uint64_t ns, double *mbps)
+{
+	double t = ns / 1e9, start = 0, bytes = 0, d;
+	unsigned int i;
+
+	*mbps = 0;
+	for (i = 0; i < nr_segs && start < t; i++) {
+		d = t - start < sched[i].secs ? t - start : sched[i].secs;
+		bytes += d * sched[i].mbps * 1000000;
+		start += sched[i].secs;
+		*mbps = sched[i].mbps;
+	}
+
+	return bytes;
+}
+
+static void *paced_thread(void *arg)
+{
+	size_t len = buf_mb << 20, chunk = 1 << 20, off = 0, i;
+	struct timespec nap = { 0, 100000 };
+	uint64_t sum = 0;
+	double mbps;
+	char *buf;
+	int fd;
+
+	fd = open_event();
+
+	buf = malloc(len);
+	if (!buf)
+		die("malloc");
+	memset(buf, 1, len);
+
+	while (!stop) {
+		if (__atomic_load_n(&paced_bytes, __ATOMIC_RELAXED) >=
+		    sched_bytes(now_ns() - paced_start, &mbps)) {
+			nanosleep(&nap, NULL);
+			continue;
+		}
+
+		for (i = 0; i < chunk; i += 64)
+			sum += *(volatile char *)(buf + off + i);
+		__atomic_add_fetch(&paced_bytes, chunk, __ATOMIC_RELAXED);
+
+		off += chunk;
+		if (off + chunk > len)
+			off = 0;
+	}
+
+	sink = sum;
+
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static int do_paced(void)
+{
+	uint64_t prev = 0, bytes, total = 0;
+	unsigned int i, t;
+	pthread_t *tid;
+	double mbps;
+
+	if (!nr_segs) {
+		fprintf(stderr, "paced needs -S\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_segs; i++)
+		total += sched[i].secs;
+
+	tid = calloc(nr_threads, sizeof(*tid));
+	if (!tid)
+		die("calloc");
+
+	paced_start = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&tid[i], NULL, paced_thread, NULL))
+			die("pthread_create");
+
+	for (t = 1; t <= total; t++) {
+		struct timespec ts = {
+			.tv_sec  = (paced_start + t * 1000000000ULL) / 1000000000ULL,
+			.tv_nsec = (paced_start + t * 1000000000ULL) % 1000000000ULL,
+		};
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		bytes = __atomic_load_n(&paced_bytes, __ATOMIC_RELAXED);
+		sched_bytes(t * 1000000000ULL - 1, &mbps);
+		printf("mode=paced t=%u target_mbps=%.1f mbps=%.1f\n", t, mbps,
+		       (bytes - prev) / 1e6);
+		fflush(stdout);
+		prev = bytes;
+	}
+
+	stop = 1;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(tid[i], NULL);
+
+	return 0;
+}
+
+static int ping[2], pong[2];
+
+static void *pong_thread(void *arg)
+{
+	char c;
+	int fd;
+
+	fd = open_event();
+
+	while (read(ping[0], &c, 1) == 1) {
+		if (c == 'q')
+			break;
+		if (write(pong[1], &c, 1) != 1)
+			die("write");
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static int do_pingpong(void)
+{
+	uint64_t t0, t1, end, n = 0;
+	pthread_t tid;
+	char c = 'p';
+	int fd;
+
+	if (pipe(ping) || pipe(pong))
+		die("pipe");
+
+	fd = open_event();
+	if (pthread_create(&tid, NULL, pong_thread, NULL))
+		die("pthread_create");
+
+	t0 = now_ns();
+	end = t0 + secs * 1000000000ULL;
+	do {
+		if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+			die("pipe io");
+		n++;
+	} while ((n & 1023) || now_ns() < end);
+	t1 = now_ns();
+
+	c = 'q';
+	if (write(ping[1], &c, 1) != 1)
+		die("write");
+	pthread_join(tid, NULL);
+	if (fd >= 0)
+		close(fd);
+
+	printf("mode=pingpong round_trips=%llu ns_per_switch=%.1f\n",
+	       (unsigned long long)n, (t1 - t0) / (2.0 * n));
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int do_read(void)
+{
+	uint64_t *lat, t0, val, sum = 0;
+	unsigned long i;
+	int fd;
+
+	fd = open_event();
+	if (fd < 0) {
+		fprintf(stderr, "read needs -e\n");
+		return 1;
+	}
+
+	lat = malloc(nr_reads * sizeof(*lat));
+	if (!lat)
+		die("malloc");
+
+	for (i = 0; i < nr_reads; i++) {
+		t0 = now_ns();
+		if (read(fd, &val, sizeof(val)) != sizeof(val))
+			die("read");
+		lat[i] = now_ns() - t0;
+		sum += lat[i];
+	}
+
+	qsort(lat, nr_reads, sizeof(*lat), cmp_u64);
+	printf("mode=read reads=%lu avg_ns=%.1f p50_ns=%llu p99_ns=%llu max_ns=%llu\n",
+	       nr_reads, (double)sum / nr_reads,
+	       (unsigned long long)lat[nr_reads / 2],
+	       (unsigned long long)lat[nr_reads * 99 / 100],
+	       (unsigned long long)lat[nr_reads - 1]);
+
+	free(lat);
+	close(fd);
+	return 0;
+}
+
+static int do_idle(void)
+{
+	int fd;
+
+	fd = open_event();
+	sleep(secs);
+	if (fd >= 0)
+		close(fd);
+
+	printf("mode=idle secs=%u\n", secs);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cqmload stream|pingpong|read|idle|paced [-t threads] [-m MB]\n"
+		"               [-s secs] [-n reads] [-r] [-e type:config[:config1]]\n"
+		"               [-S MBps:secs[,MBps:secs...]]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode;
+	int opt;
+
+	if (argc < 2)
+		usage();
+	mode = argv[1];
+	optind = 2;
+
+	while ((opt = getopt(argc, argv, "t:m:s:n:re:S:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			buf_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_reads = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			random_walk = 1;
+			break;
+		case 'e':
+			if (parse_event(optarg))
+				usage();
+			break;
+		case 'S':
+			if (parse_sched(optarg))
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!nr_threads || !buf_mb || !nr_reads)
+		usage();
+
+	if (!strcmp(mode, "stream"))
+		return do_stream();
+	if (!strcmp(mode, "pingpong"))
+		return do_pingpong();
+	if (!strcmp(mode, "read"))
+		return do_read();
+	if (!strcmp(mode, "idle"))
+		return do_idle();
+	if (!strcmp(mode, "paced"))
+		return do_paced();
+
+	usage();
+	return 2;
+}
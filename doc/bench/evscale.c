@@ -0,0 +1,302 @@
+/*
+ * evscale - how event creation and destruction scale, e.g. an agent
+ * opening task events for thousands of pids at once.
+ *
+ *   gcc -O2 -pthread -o evscale evscale.c
+ *
+ *   evscale [-n events] [-t threads] [-P pids] [-x task:cgroup:cpu]
+ *           [-g cgroup dir] [-e type:config[:config1]] [-r rounds]
+ *
+ * Forks -P sleeping children to monitor, then @threads threads each
+ * open their share of @events, all at once, and close them again. -x
+ * sets the mix of task (round robin over the children), cgroup (-g,
+ * round robin over cpus) and cpu events, default 1:0:0.
+ *
+ * -e picks the event as for cqmload, default 1:0 (cpu-clock), so the
+ * numbers for the intel_cqm PMU can be compared with perf's own cost.
+ *
+ * Prints one line of key=value pairs per round: open and close
+ * throughput and their latency percentiles in ns.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+enum { EV_TASK, EV_CGROUP, EV_CPU, NR_EV_KINDS };
+
+static struct perf_event_attr ev_attr = {
+	.size	= sizeof(struct perf_event_attr),
+	.type	= PERF_TYPE_SOFTWARE,
+	.config	= PERF_COUNT_SW_CPU_CLOCK,
+};
+
+static unsigned int nr_events = 1000, nr_threads = 1, nr_pids = 100;
+static unsigned int mix[NR_EV_KINDS] = { 1, 0, 0 };
+static unsigned int nr_rounds = 1;
+static int cgroup_fd = -1;
+static int nr_cpus;
+static pid_t *pids;
+
+static pthread_barrier_t barrier;
+
+struct worker {
+	pthread_t	tid;
+	unsigned int	first, nr;
+	int		*fd;
+	uint64_t	*open_ns, *close_ns;
+	uint64_t	t[4];
+	unsigned int	failed;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/*
+ * Event @i is of the kind its slot in the mix falls into.
+ */
+static int event_kind(unsigned int i)
+{
+	unsigned int total = mix[EV_TASK] + mix[EV_CGROUP] + mix[EV_CPU];
+	unsigned int slot = i % total;
+
+	if (slot < mix[EV_TASK])
+		return EV_TASK;
+	if (slot < mix[EV_TASK] + mix[EV_CGROUP])
+		return EV_CGROUP;
+	return EV_CPU;
+}
+
+static int open_event(unsigned int i)
+{
+	switch (event_kind(i)) {
+	case EV_TASK:
+		return syscall(__NR_perf_event_open, &ev_attr,
+			       pids[i % nr_pids], -1, -1, 0);
+	case EV_CGROUP:
+		return syscall(__NR_perf_event_open, &ev_attr, cgroup_fd,
+			       i % nr_cpus, -1, PERF_FLAG_PID_CGROUP);
+	default:
+		return syscall(__NR_perf_event_open, &ev_attr, -1,
+			       i % nr_cpus, -1, 0);
+	}
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int i;
+	uint64_t t0;
+
+	pthread_barrier_wait(&barrier);
+	w->t[0] = now_ns();
+	for (i = 0; i < w->nr; i++) {
+		t0 = now_ns();
+		w->fd[i] = open_event(w->first + i);
+		w->open_ns[i] = now_ns() - t0;
+		if (w->fd[i] < 0)
+			w->failed++;
+	}
+	w->t[1] = now_ns();
+
+	pthread_barrier_wait(&barrier);
+	w->t[2] = now_ns();
+	for (i = 0; i < w->nr; i++) {
+		t0 = now_ns();
+		if (w->fd[i] >= 0)
+			close(w->fd[i]);
+		w->close_ns[i] = now_ns() - t0;
+	}
+	w->t[3] = now_ns();
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *lat, unsigned int n,
+		   uint64_t wall)
+{
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf(" %s_per_sec=%.0f %s_p50_ns=%llu %s_p99_ns=%llu %s_p999_ns=%llu %s_max_ns=%llu",
+	       what, n / (wall / 1e9),
+	       what, (unsigned long long)lat[n / 2],
+	       what, (unsigned long long)lat[(uint64_t)n * 99 / 100],
+	       what, (unsigned long long)lat[(uint64_t)n * 999 / 1000],
+	       what, (unsigned long long)lat[n - 1]);
+}
+
+static void run(unsigned int round)
+{
+	uint64_t *open_ns, *close_ns, t[4] = { UINT64_MAX, 0, UINT64_MAX, 0 };
+	unsigned int i, per, failed = 0;
+	struct worker *w;
+	int *fd;
+
+	w = calloc(nr_threads, sizeof(*w));
+	fd = calloc(nr_events, sizeof(*fd));
+	open_ns = calloc(nr_events, sizeof(*open_ns));
+	close_ns = calloc(nr_events, sizeof(*close_ns));
+	if (!w || !fd || !open_ns || !close_ns)
+		die("calloc");
+
+	if (pthread_barrier_init(&barrier, NULL, nr_threads + 1))
+		die("pthread_barrier_init");
+
+	per = nr_events / nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		w[i].first = i * per;
+		w[i].nr = i == nr_threads - 1 ? nr_events - w[i].first : per;
+		w[i].fd = fd + w[i].first;
+		w[i].open_ns = open_ns + w[i].first;
+		w[i].close_ns = close_ns + w[i].first;
+		if (pthread_create(&w[i].tid, NULL, worker_fn, &w[i]))
+			die("pthread_create");
+	}
+
+	pthread_barrier_wait(&barrier);
+	pthread_barrier_wait(&barrier);
+
+	/* Wall time from the first thread starting to the last finishing. */
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(w[i].tid, NULL);
+		failed += w[i].failed;
+		if (w[i].t[0] < t[0])
+			t[0] = w[i].t[0];
+		if (w[i].t[1] > t[1])
+			t[1] = w[i].t[1];
+		if (w[i].t[2] < t[2])
+			t[2] = w[i].t[2];
+		if (w[i].t[3] > t[3])
+			t[3] = w[i].t[3];
+	}
+
+	printf("round=%u events=%u threads=%u pids=%u mix=%u:%u:%u failed=%u",
+	       round, nr_events, nr_threads, nr_pids, mix[EV_TASK],
+	       mix[EV_CGROUP], mix[EV_CPU], failed);
+	report("open", open_ns, nr_events, t[1] - t[0]);
+	report("close", close_ns, nr_events, t[3] - t[2]);
+	printf("\n");
+
+	pthread_barrier_destroy(&barrier);
+	free(close_ns);
+	free(open_ns);
+	free(fd);
+	free(w);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: evscale [-n events] [-t threads] [-P pids] [-x task:cgroup:cpu]\n"
+		"               [-g cgroup dir] [-e type:config[:config1]] [-r rounds]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long type, config, config1;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:P:x:g:e:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_events = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			nr_pids = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			if (sscanf(optarg, "%u:%u:%u", &mix[EV_TASK],
+				   &mix[EV_CGROUP], &mix[EV_CPU]) != 3)
+				usage();
+			break;
+		case 'g':
+			cgroup_fd = open(optarg, O_RDONLY);
+			if (cgroup_fd < 0)
+				die(optarg);
+			break;
+		case 'e':
+			config1 = 0;
+			if (sscanf(optarg, "%llu:%lli:%lli", &type,
+				   (long long *)&config,
+				   (long long *)&config1) < 2)
+				usage();
+			ev_attr.type = type;
+			ev_attr.config = config;
+			ev_attr.config1 = config1;
+			break;
+		case 'r':
+			nr_rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!nr_events || !nr_threads || nr_threads > nr_events ||
+	    !(mix[EV_TASK] + mix[EV_CGROUP] + mix[EV_CPU]))
+		usage();
+	if (mix[EV_TASK] && !nr_pids)
+		usage();
+	if (mix[EV_CGROUP] && cgroup_fd < 0) {
+		fprintf(stderr, "cgroup events need -g\n");
+		return 2;
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	pids = calloc(nr_pids ? nr_pids : 1, sizeof(*pids));
+	if (!pids)
+		die("calloc");
+	for (i = 0; i < nr_pids; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			die("fork");
+		if (!pids[i]) {
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			pause();
+			_exit(0);
+		}
+	}
+
+	for (i = 0; i < nr_rounds; i++)
+		run(i);
+
+	for (i = 0; i < nr_pids; i++) {
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# Scaling curves for event creation and destruction: run evscale for
+# every number of events in EVENTS and threads in THREADS, one CSV row
+# per round.
+#
+# -b and -e work as for cqm-bench.sh; the other options go to evscale.
+#
+#   ./evscale.sh [-b hw|generic] [-e llc_occupancy] [-n "100 1000 5000"]
+#                [-t "1 2 4 8"] [-P pids] [-x task:cgroup:cpu]
+#                [-g cgroup dir] [-r rounds] [-o out.csv]
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+EVSCALE=$BENCH_DIR/evscale
+PMU=/sys/bus/event_source/devices/intel_cqm
+
+BACKEND=
+EVENT=llc_occupancy
+EVENTS="100 1000 5000"
+THREADS="1 2 4 8"
+PIDS=1000
+MIX=1:0:0
+CGROUP=
+ROUNDS=3
+OUT=/dev/stdout
+
+while getopts "b:e:n:t:P:x:g:r:o:" opt; do
+  case $opt in
+    b) BACKEND=$OPTARG ;;
+    e) EVENT=$OPTARG ;;
+    n) EVENTS=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    P) PIDS=$OPTARG ;;
+    x) MIX=$OPTARG ;;
+    g) CGROUP=$OPTARG ;;
+    r) ROUNDS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '/^#   \.\/evscale.sh/,/^#$/s/^#   //p' "$0" >&2; exit 2 ;;
+  esac
+done
+
+if [ -z "$BACKEND" ]; then
+  if [ -d $PMU ]; then BACKEND=hw; else BACKEND=generic; fi
+fi
+
+if [ $BACKEND = hw ]; then
+  [ -d $PMU ] || { echo "no intel_cqm PMU, try -b generic" >&2; exit 1; }
+  cfg=$(sed -n 's/^event=\(0x[0-9a-fA-F]*\).*/\1/p' $PMU/events/$EVENT)
+  [ -n "$cfg" ] || { echo "unknown event $EVENT" >&2; exit 1; }
+  SPEC=$(cat $PMU/type):$cfg
+else
+  EVENT=cpu-clock
+  SPEC=1:0
+fi
+
+if [ ! -x "$EVSCALE" ] || [ "$EVSCALE" -ot "$EVSCALE.c" ]; then
+  ${CC:-cc} -O2 -pthread -o "$EVSCALE" "$EVSCALE.c"
+fi
+
+COLS="round events threads pids mix failed open_per_sec open_p50_ns open_p99_ns open_p999_ns open_max_ns close_per_sec close_p50_ns close_p99_ns close_p999_ns close_max_ns"
+
+echo "backend,event,$(echo $COLS | tr ' ' ,)" > "$OUT"
+
+for n in $EVENTS; do
+  for t in $THREADS; do
+    "$EVSCALE" -n $n -t $t -P $PIDS -x $MIX ${CGROUP:+-g $CGROUP} \
+      -e $SPEC -r $ROUNDS |
+    while read -r line; do
+      row="$BACKEND,$EVENT"
+      for c in $COLS; do
+        row="$row,$(echo "$line" | sed -n "s/.*\\b$c=\\([^ ]*\\).*/\\1/p")"
+      done
+      echo "$row"
+    done >> "$OUT"
+  done
+done
@@ -0,0 +1,31 @@
+#!/bin/bash
+#
+# Pull the MBM sampling code out of the driver so that cqm_sim.h can
+# build it in userspace: the MBM defines, struct sample and struct
+# mbm_pkg, mbm_window_size and everything from __mbm_fifo_sum_lastn_out()
+# through mbm_read_event(). The code is copied as is, so the benchmarks
+# always measure what the driver runs.
+#
+#   ./mbm-extract.sh [perf_event_intel_cqm.c] > mbm_gen.h
+#
+
+set -e
+
+SRC=${1:-$(dirname "$0")/../updates/arch/x86/kernel/cpu/perf_event_intel_cqm.c}
+
+[ -r "$SRC" ] || { echo "can't read $SRC" >&2; exit 1; }
+
+echo "/* Generated by mbm-extract.sh from $(basename "$SRC"), do not edit. */"
+echo
+grep -E '^#define (MBM_|MAX_MBM_|QOS_MBM_|RMID_VAL_)' "$SRC"
+echo
+sed -n '/^enum mbm_evt_type {/,/^};/p' "$SRC"
+echo
+sed -n '/^struct sample {/,/^};/p' "$SRC"
+echo
+sed -n '/^struct mbm_pkg {/,/^};/p' "$SRC"
+echo
+grep '^static u32 mbm_window_size' "$SRC"
+echo
+sed -n '/^static u32 __mbm_fifo_sum_lastn_out/,/^static void intel_mbm_event_update/p' "$SRC" |
+	sed '$d'
@@ -0,0 +1,230 @@
+/*
+ * mbmbench - cost of the driver's MBM sampling code, in userspace.
+ *
+ *   ./mbm-extract.sh > mbm_gen.h
+ *   gcc -O2 -o mbmbench mbmbench.c
+ *
+ *   mbmbench [-w windows] [-r rmids] [-p pkgs] [-n sweeps]
+ *
+ * Lists are comma separated and take ranges, e.g. -w 10-300 for every
+ * window size. Defaults: -w 10,30,60,100,200,300 -r 1,8,64,512
+ * -p 1,2,4,8 -n 100.
+ *
+ * For every combination, fill the window (untimed), then time @sweeps
+ * polls one second apart of total and local bandwidth for every RMID
+ * on every package, i.e. the steady state rmid_read_mbm() path. The
+ * window kernels are also timed on their own.
+ *
+ * One CSV row per combination: ns per sample and, where perf allows
+ * it, cache misses per sample.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "cqm_sim.h"
+
+#define MAX_LIST	512
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * "a,b-c,d" into @out, returns the number of entries.
+ */
+static int parse_list(const char *s, unsigned int *out)
+{
+	unsigned int a, b, n = 0;
+	char *end;
+
+	while (*s) {
+		a = b = strtoul(s, &end, 0);
+		if (end == s)
+			return -1;
+		if (*end == '-')
+			b = strtoul(end + 1, &end, 0);
+		for (; a <= b && n < MAX_LIST; a++)
+			out[n++] = a;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		s = end;
+	}
+
+	return n;
+}
+
+static int misses_fd = -1;
+
+static void misses_open(void)
+{
+	struct perf_event_attr attr = {
+		.size		= sizeof(attr),
+		.type		= PERF_TYPE_HARDWARE,
+		.config		= PERF_COUNT_HW_CACHE_MISSES,
+		.exclude_kernel	= 1,
+	};
+
+	misses_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static u64 misses_read(void)
+{
+	u64 val = 0;
+
+	if (misses_fd < 0 || read(misses_fd, &val, sizeof(val)) != sizeof(val))
+		return 0;
+	return val;
+}
+
+static void sweep(void)
+{
+	unsigned int p, r;
+
+	sim_advance(NSEC_PER_SEC);
+	for (p = 0; p < sim_nr_pkgs; p++) {
+		sim_cur_pkg = p;
+		for (r = 0; r < sim_nr_rmids; r++) {
+			rmid_read_mbm(r, QOS_MBM_TOTAL_EVENT_ID);
+			rmid_read_mbm(r, QOS_MBM_LOCAL_EVENT_ID);
+		}
+	}
+}
+
+static volatile u64 sink;
+
+/*
+ * ns per call of the window kernels on one warm sample.
+ */
+static void time_kernels(double *sum_ns, double *in_ns)
+{
+	static struct sample s;
+	unsigned int i, n = 100000;
+	u64 t0, acc = 0;
+
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < mbm_window_size; i++)
+		mbm_fifo_in(&s, i);
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		acc += __mbm_fifo_sum_lastn_out(&s);
+	*sum_ns = (double)(now_ns() - t0) / n;
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		mbm_fifo_in(&s, i);
+	*in_ns = (double)(now_ns() - t0) / n;
+
+	sink = acc;
+}
+
+static void run(unsigned int window, unsigned int nr_rmids,
+		unsigned int nr_pkgs, unsigned int nr_sweeps)
+{
+	double sum_ns, in_ns, samples;
+	char misses[32] = "";
+	unsigned int i, p, r;
+	u64 t0, t1, m0, m1;
+
+	mbm_window_size = window;
+	sim_setup(nr_pkgs, nr_rmids);
+
+	/* Known, distinct rates so every sample does the full math. */
+	for (p = 0; p < nr_pkgs; p++) {
+		for (r = 0; r < nr_rmids; r++) {
+			sim_set_rate(p, r, false, 1000000 + 977 * r);
+			sim_set_rate(p, r, true, 500000 + 331 * r);
+		}
+	}
+
+	for (i = 0; i <= window; i++)
+		sweep();
+
+	m0 = misses_read();
+	t0 = now_ns();
+	for (i = 0; i < nr_sweeps; i++)
+		sweep();
+	t1 = now_ns();
+	m1 = misses_read();
+
+	time_kernels(&sum_ns, &in_ns);
+
+	samples = 2.0 * nr_pkgs * nr_rmids * nr_sweeps;
+	if (misses_fd >= 0)
+		snprintf(misses, sizeof(misses), "%.2f", (m1 - m0) / samples);
+
+	printf("%u,%u,%u,%.0f,%.1f,%s,%.1f,%.1f\n",
+	       window, nr_rmids, nr_pkgs, samples, (t1 - t0) / samples,
+	       misses, sum_ns, in_ns);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: mbmbench [-w windows] [-r rmids] [-p pkgs] [-n sweeps]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned int windows[MAX_LIST], rmids[MAX_LIST], pkgs[MAX_LIST];
+	int nr_w, nr_r, nr_p, opt;
+	unsigned int nr_sweeps = 100;
+	int w, r, p;
+
+	nr_w = parse_list("10,30,60,100,200,300", windows);
+	nr_r = parse_list("1,8,64,512", rmids);
+	nr_p = parse_list("1,2,4,8", pkgs);
+
+	while ((opt = getopt(argc, argv, "w:r:p:n:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nr_w = parse_list(optarg, windows);
+			break;
+		case 'r':
+			nr_r = parse_list(optarg, rmids);
+			break;
+		case 'p':
+			nr_p = parse_list(optarg, pkgs);
+			break;
+		case 'n':
+			nr_sweeps = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (nr_w <= 0 || nr_r <= 0 || nr_p <= 0 || !nr_sweeps)
+		usage();
+
+	for (w = 0; w < nr_w; w++) {
+		if (windows[w] < MBM_FIFO_SIZE_MIN ||
+		    windows[w] > MBM_FIFO_SIZE_MAX) {
+			fprintf(stderr, "window %u out of range %d-%d\n",
+				windows[w], MBM_FIFO_SIZE_MIN,
+				MBM_FIFO_SIZE_MAX);
+			return 1;
+		}
+	}
+
+	misses_open();
+
+	printf("window,rmids,pkgs,samples,ns_per_sample,misses_per_sample,fifo_sum_ns,fifo_in_ns\n");
+	for (w = 0; w < nr_w; w++)
+		for (r = 0; r < nr_r; r++)
+			for (p = 0; p < nr_p; p++)
+				run(windows[w], rmids[r], pkgs[p], nr_sweeps);
+
+	sim_teardown();
+	return 0;
+}
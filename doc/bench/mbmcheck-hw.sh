@@ -0,0 +1,105 @@
+#!/bin/bash
+#
+# Accuracy of the MBM events on real hardware: run cqmload's paced
+# generator on one node against a known schedule of rates and compare
+# what perf stat -I 1000 reports for it, second by second.
+#
+# The generator's rate is the truth for total_bw and, since its memory
+# is bound to the node it runs on, for local_bw too. The truth for the
+# avg_ events is the mean of the last WINDOW seconds of it, WINDOW
+# being the driver's sliding_window_size.
+#
+# On machines without the intel_cqm PMU, use mbmcheck instead, which
+# runs the driver's code on simulated counters.
+#
+#   ./mbmcheck-hw.sh [-S "MBps:secs,..."] [-t threads] [-m MB] [-N node]
+#                    [-o out.csv]
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CQMLOAD=$BENCH_DIR/cqmload
+PMU=/sys/bus/event_source/devices/intel_cqm
+PERF=${PERF:-perf}
+
+# steady, step up, step down, bursts
+SCHED=1000:20,4000:20,500:20,500:4,6000:1,500:4,6000:1,500:10
+THREADS=2
+MB=512
+NODE=0
+OUT=/dev/stdout
+EVENTS="total_bw avg_total_bw local_bw avg_local_bw"
+
+while getopts "S:t:m:N:o:" opt; do
+  case $opt in
+    S) SCHED=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    m) MB=$OPTARG ;;
+    N) NODE=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '/^#   \.\/mbmcheck-hw.sh/,/^#$/s/^#   //p' "$0" >&2; exit 2 ;;
+  esac
+done
+
+[ -d $PMU ] || { echo "no intel_cqm PMU, use mbmcheck" >&2; exit 1; }
+
+if [ ! -x "$CQMLOAD" ] || [ "$CQMLOAD" -ot "$CQMLOAD.c" ]; then
+  ${CC:-cc} -O2 -pthread -o "$CQMLOAD" "$CQMLOAD.c"
+fi
+
+WINDOW=$(cat $PMU/sliding_window_size 2>/dev/null || echo 10)
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+BIND=
+if command -v numactl > /dev/null; then
+  BIND="numactl --cpunodebind=$NODE --membind=$NODE"
+fi
+
+$BIND "$CQMLOAD" paced -S $SCHED -t $THREADS -m $MB > $TMP/gen &
+GEN=$!
+
+perf_events=
+for ev in $EVENTS; do perf_events="$perf_events -e intel_cqm/$ev/"; done
+$PERF stat -I 1000 -x, $perf_events -p $GEN -o $TMP/perf || true
+wait $GEN
+
+#
+# gen:  mode=paced t=N target_mbps=X mbps=Y
+# perf: time,value,unit,event,...
+#
+awk -v window=$WINDOW -F'[ ,=]' '
+  FNR == NR {
+    if ($3 == "t") { truth[$4] = $8; if ($4 > last) last = $4 }
+    next
+  }
+  /^#/ { next }
+  {
+    line = $0; sub(/^ +/, "", line)
+    if (split(line, f, ",") < 4 || f[2] !~ /^[0-9.]+$/)
+      next
+    t = int(f[1] + 0.5); ev = f[4]
+    sub(/^intel_cqm\//, "", ev); sub(/\/$/, "", ev)
+    got[t, ev] = f[2]
+  }
+  END {
+    print "t_s,event,truth_mbps,reported_mbps,err_pct"
+    n = split("total_bw avg_total_bw local_bw avg_local_bw", evs, " ")
+    for (t = 1; t <= last; t++) {
+      for (i = 1; i <= n; i++) {
+        ev = evs[i]
+        if (!((t, ev) in got))
+          continue
+        if (ev ~ /^avg_/) {
+          s = 0; k = 0
+          for (u = t; u > 0 && u > t - window; u--) { s += truth[u]; k++ }
+          want = s / k
+        } else {
+          want = truth[t]
+        }
+        err = want > 0 ? (got[t, ev] - want) * 100 / want : 0
+        printf "%d,%s,%.1f,%s,%.2f\n", t, ev, want, got[t, ev], err
+      }
+    }
+  }' $TMP/gen $TMP/perf > "$OUT"
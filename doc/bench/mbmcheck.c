@@ -0,0 +1,319 @@
+/*
+ * mbmcheck - accuracy of the driver's MBM bandwidth numbers against
+ * known ground truth, on simulated counters.
+ *
+ *   ./mbm-extract.sh > mbm_gen.h
+ *   gcc -O2 -o mbmcheck mbmcheck.c -lm
+ *
+ *   mbmcheck [-s scenario] [-w window] [-v]
+ *
+ * Every scenario drives the total and local counters of one RMID with
+ * a known rate schedule (local runs at 60% of total) and polls them
+ * like the driver's hrtimer, once a second unless the scenario says
+ * otherwise:
+ *
+ *   steady	constant rate
+ *   step	rate steps up 8x, then down
+ *   burst	1s bursts at 12x every 10s
+ *   wrap	close to one counter wrap per poll, then more than one
+ *   late	some polls fire late, a few too late to be used
+ *   slow	polls every 100ms-1.5s
+ *
+ * The truth for total_bw/local_bw/remote_bw is the mean rate since the
+ * previous poll, for the avg_ events the mean rate over the last
+ * @window seconds. Both are in counter units per second, like the
+ * driver's. local_ratio should always be 60%. llc_occupancy stays at
+ * OCC_UNITS, so bw_per_occupancy is total_bw over that; llc_miss_rate
+ * is total_bw, its scale aside.
+ *
+ * Prints per scenario and event the mean and max error in percent,
+ * and the error of the very first sample. -v also prints every poll.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <unistd.h>
+
+#include "cqm_sim.h"
+
+#define MAX_SEGS	64
+#define MAX_POLLS	4096
+#define OCC_UNITS	320
+
+struct seg {
+	double	secs;
+	u64	rate;
+};
+
+struct scenario {
+	const char	*name;
+	struct seg	seg[MAX_SEGS];
+	/* poll interval in ms for poll @i */
+	u64		(*interval)(unsigned int i);
+};
+
+static u64 every_second(unsigned int i)
+{
+	return 1000;
+}
+
+/* Every 7th poll 600ms late, every 13th 2s late. */
+static u64 sometimes_late(unsigned int i)
+{
+	if (i && !(i % 13))
+		return 3000;
+	if (i && !(i % 7))
+		return 1600;
+	return 1000;
+}
+
+/* Sweep through 100ms-1500ms. */
+static u64 uneven(unsigned int i)
+{
+	return 100 + (i * 337) % 1400;
+}
+
+static struct scenario scenarios[] = {
+	{ "steady", { { 60, 1000000 } }, every_second },
+	{ "step",   { { 20, 1000000 }, { 20, 8000000 }, { 20, 500000 } },
+		    every_second },
+	{ "burst",  { { 9, 1000000 }, { 1, 12000000 },
+		      { 9, 1000000 }, { 1, 12000000 },
+		      { 9, 1000000 }, { 1, 12000000 },
+		      { 20, 1000000 } }, every_second },
+	{ "wrap",   { { 30, 16000000 }, { 30, 24000000 } }, every_second },
+	{ "late",   { { 60, 2000000 } }, sometimes_late },
+	{ "slow",   { { 60, 3000000 } }, uneven },
+};
+
+#define NR_SCENARIOS	(sizeof(scenarios) / sizeof(scenarios[0]))
+
+enum {
+	EV_TOTAL, EV_AVG_TOTAL, EV_LOCAL, EV_AVG_LOCAL,
+	EV_REMOTE, EV_AVG_REMOTE, EV_LOCAL_RATIO, EV_BW_PER_OCC,
+	EV_MISS_RATE, NR_EVS
+};
+
+static const char * const ev_name[NR_EVS] = {
+	"total_bw", "avg_total_bw", "local_bw", "avg_local_bw",
+	"remote_bw", "avg_remote_bw", "local_ratio", "bw_per_occupancy",
+	"llc_miss_rate",
+};
+
+static const u32 ev_id[NR_EVS] = {
+	QOS_MBM_TOTAL_EVENT_ID, QOS_MBM_TOTAL_AVG_EVENT_ID,
+	QOS_MBM_LOCAL_EVENT_ID, QOS_MBM_LOCAL_AVG_EVENT_ID,
+	QOS_MBM_REMOTE_EVENT_ID, QOS_MBM_REMOTE_AVG_EVENT_ID,
+	QOS_MBM_LOCAL_RATIO_EVENT_ID, QOS_MBM_BW_PER_OCCUP_EVENT_ID,
+	QOS_MBM_MISS_RATE_EVENT_ID,
+};
+
+/* Share of total_bw each event measures, local_ratio aside. */
+static const double ev_share[NR_EVS] = {
+	1.0, 1.0, 0.6, 0.6, 0.4, 0.4, 0, 1.0, 1.0,
+};
+
+static bool ev_avg(unsigned int e)
+{
+	return e == EV_AVG_TOTAL || e == EV_AVG_LOCAL || e == EV_AVG_REMOTE;
+}
+
+static int verbose;
+
+/*
+ * True total count of @sc at @t seconds after the start.
+ */
+static double truth_count(struct scenario *sc, double t)
+{
+	double start = 0, n = 0, d;
+	unsigned int i;
+
+	for (i = 0; i < MAX_SEGS && sc->seg[i].secs && start < t; i++) {
+		d = fmin(sc->seg[i].secs, t - start);
+		n += d * sc->seg[i].rate;
+		start += sc->seg[i].secs;
+	}
+
+	return n;
+}
+
+static double scenario_secs(struct scenario *sc)
+{
+	double secs = 0;
+	unsigned int i;
+
+	for (i = 0; i < MAX_SEGS && sc->seg[i].secs; i++)
+		secs += sc->seg[i].secs;
+
+	return secs;
+}
+
+/*
+ * The first segment boundary after @t_ns, in ns.
+ */
+static u64 next_boundary(struct scenario *sc, u64 t_ns)
+{
+	u64 end = 0;
+	unsigned int i;
+
+	for (i = 0; i < MAX_SEGS && sc->seg[i].secs; i++) {
+		end += sc->seg[i].secs * NSEC_PER_SEC;
+		if (end > t_ns)
+			return end;
+	}
+
+	return UINT64_MAX;
+}
+
+static u64 rate_at(struct scenario *sc, double t)
+{
+	double start = 0;
+	unsigned int i;
+
+	for (i = 0; i < MAX_SEGS && sc->seg[i].secs; i++) {
+		start += sc->seg[i].secs;
+		if (t < start)
+			return sc->seg[i].rate;
+	}
+
+	return 0;
+}
+
+struct err {
+	unsigned int	n;
+	double		sum, max, first;
+};
+
+static void account(struct err *e, double truth, double got)
+{
+	double pct;
+
+	if (truth <= 0)
+		return;
+
+	pct = fabs(got - truth) * 100 / truth;
+	if (!e->n)
+		e->first = pct;
+	e->n++;
+	e->sum += pct;
+	if (pct > e->max)
+		e->max = pct;
+}
+
+static void run(struct scenario *sc)
+{
+	double secs = scenario_secs(sc), t = 0, prev_t = 0, truth, win;
+	struct err err[NR_EVS] = { };
+	const double local = ev_share[EV_LOCAL];
+	u64 t_ns = 0, step, d, got;
+	unsigned int i, e;
+
+	sim_setup(1, 1);
+	sim_set_occ(0, 0, OCC_UNITS);
+	win = mbm_window_size;
+
+	/*
+	 * Event creation reads the counters once, that's the baseline
+	 * for the first poll one interval later.
+	 */
+	rmid_read_mbm(0, QOS_MBM_TOTAL_EVENT_ID);
+	rmid_read_mbm(0, QOS_MBM_LOCAL_EVENT_ID);
+
+	for (i = 0; i < MAX_POLLS && t < secs; i++) {
+		/* Move to the poll, through any rate changes on the way. */
+		for (step = sc->interval(i) * 1000000; step; step -= d) {
+			sim_set_rate(0, 0, false, rate_at(sc, t));
+			sim_set_rate(0, 0, true, rate_at(sc, t) * local);
+
+			d = next_boundary(sc, t_ns) - t_ns;
+			if (d > step)
+				d = step;
+
+			sim_advance(d);
+			t_ns += d;
+			t = (double)t_ns / NSEC_PER_SEC;
+		}
+
+		for (e = 0; e < NR_EVS; e++) {
+			got = mbm_read_event(0, ev_id[e], NULL);
+
+			if (e == EV_LOCAL_RATIO)
+				truth = local * MBM_RATIO_SCALE;
+			else if (!ev_avg(e))
+				truth = (truth_count(sc, t) -
+					 truth_count(sc, prev_t)) / (t - prev_t);
+			else
+				truth = (truth_count(sc, t) -
+					 truth_count(sc, fmax(t - win, 0))) /
+					fmin(win, t);
+			if (e != EV_LOCAL_RATIO)
+				truth *= ev_share[e];
+			if (e == EV_BW_PER_OCC)
+				truth = truth * MBM_BW_OCC_SCALE / OCC_UNITS;
+
+			account(&err[e], truth, got);
+			if (verbose)
+				printf("%s,%.3f,%s,%.0f,%llu,%.2f\n", sc->name,
+				       t, ev_name[e], truth,
+				       (unsigned long long)got,
+				       ((double)got - truth) * 100 / truth);
+		}
+		prev_t = t;
+	}
+
+	if (verbose)
+		return;
+
+	for (e = 0; e < NR_EVS; e++)
+		printf("%s,%s,%u,%u,%.2f,%.2f,%.2f,%lu,%lu,%lu\n", sc->name,
+		       ev_name[e], mbm_window_size, err[e].n,
+		       err[e].n ? err[e].sum / err[e].n : 0, err[e].max,
+		       err[e].first, sim_stat[CQM_STAT_MBM_OVERFLOW],
+		       sim_stat[CQM_STAT_MBM_LATE],
+		       sim_stat[CQM_STAT_MBM_THROTTLED]);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mbmcheck [-s scenario] [-w window] [-v]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	unsigned int i, w;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:w:v")) != -1) {
+		switch (opt) {
+		case 's':
+			only = optarg;
+			break;
+		case 'w':
+			w = strtoul(optarg, NULL, 0);
+			if (w < MBM_FIFO_SIZE_MIN || w > MBM_FIFO_SIZE_MAX)
+				usage();
+			mbm_window_size = w;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (verbose)
+		printf("scenario,t_s,event,truth,reported,err_pct\n");
+	else
+		printf("scenario,event,window,polls,mean_err_pct,max_err_pct,first_err_pct,overflows,late,throttled\n");
+
+	for (i = 0; i < NR_SCENARIOS; i++) {
+		if (only && strcmp(only, scenarios[i].name))
+			continue;
+		run(&scenarios[i]);
+	}
+
+	sim_teardown();
+	return 0;
+}
@@ -0,0 +1,591 @@
+/*
+ * mbmtrace - record raw per-RMID, per-package RDT counters into a
+ * compact trace, and replay traces through the driver's MBM code.
+ *
+ *   ./mbm-extract.sh > mbm_gen.h
+ *   gcc -O2 -o mbmtrace mbmtrace.c
+ *
+ *   mbmtrace record [-i ms] [-d secs] [-r rmids] -o trace
+ *   mbmtrace replay [-w window] [-r rmid] [-a] trace
+ *   mbmtrace dump trace
+ *
+ * record reads llc occupancy and the total and local MBM counters of
+ * RMIDs 0..rmids-1 (all by default) on one cpu of every package,
+ * through /dev/cpu/N/msr (modprobe msr; needs root), every interval
+ * until killed or for -d seconds.
+ *
+ * The msr device is not coordinated with the driver, which programs
+ * IA32_QM_EVTSEL too; every read checks that EVTSEL still selects what
+ * it wrote and retries otherwise.
+ *
+ * replay feeds the counters through rmid_read_mbm() with the given
+ * sliding window, as the driver would have seen them, and prints CSV
+ * of occupancy, bandwidth and bandwidth per occupancy (the rate the
+ * footprint is refilled at) per sweep, package and RMID; unavailable
+ * readings print as 0. RMIDs that never counted anything are left out
+ * unless -a is given. dump prints the raw readings.
+ *
+ * The trace is a header followed by one frame per sweep. A frame has,
+ * per package, the time of the sweep and, per RMID, the offset of its
+ * reads from that and one value per event; all of it as deltas to the
+ * previous frame, in LEB128 varints. MBM counter deltas are taken mod
+ * 2^24 like the driver does, occupancy deltas are zigzag coded; the
+ * low bit of every value is set when the counter was unavailable.
+ * Everything is little endian.
+ */
+#define _GNU_SOURCE
+#include <cpuid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cqm_sim.h"
+
+#define MSR_IA32_QM_CTR		0x0c8e
+#define MSR_IA32_QM_EVTSEL	0x0c8d
+
+#define QOS_L3_OCCUP_EVENT_ID	0x01
+
+#define TRACE_MAGIC		"MBMT"
+#define TRACE_VERSION		1
+
+#define EVSEL_RETRIES		8
+
+enum { EV_OCCUP, EV_TOTAL, EV_LOCAL, NR_EVS };
+
+static const u32 ev_id[NR_EVS] = {
+	QOS_L3_OCCUP_EVENT_ID, QOS_MBM_TOTAL_EVENT_ID, QOS_MBM_LOCAL_EVENT_ID,
+};
+
+struct trace_hdr {
+	char		magic[4];
+	uint16_t	version;
+	uint16_t	nr_pkgs;
+	uint32_t	nr_rmids;
+	uint32_t	l3_scale;	/* bytes per counter unit */
+	uint32_t	interval_ms;
+	uint32_t	events;		/* 1 << EV_* */
+	uint64_t	start_ns;	/* CLOCK_REALTIME */
+} __attribute__((packed));
+
+/* Last values, per package, RMID and event, and package times. */
+struct trace_state {
+	u64		*prev;
+	u64		pkg_ts[SIM_MAX_PKGS];
+};
+
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static u64 now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void put_varint(FILE *f, u64 v)
+{
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+static int get_varint(FILE *f, u64 *v)
+{
+	unsigned int shift = 0;
+	int c;
+
+	*v = 0;
+	do {
+		c = fgetc(f);
+		if (c == EOF || shift > 63)
+			return -1;
+		*v |= (u64)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+static u64 zigzag(s64 v)
+{
+	return ((u64)v << 1) ^ (u64)(v >> 63);
+}
+
+static s64 unzigzag(u64 v)
+{
+	return (s64)(v >> 1) ^ -(s64)(v & 1);
+}
+
+/*
+ * Values go out as (delta << 1) | unavailable. An unavailable reading
+ * keeps the previous value.
+ */
+static void put_value(FILE *f, u64 *prev, int ev, u64 val)
+{
+	u64 d;
+
+	if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL)) {
+		put_varint(f, 1);
+		return;
+	}
+
+	if (ev == EV_OCCUP)
+		d = zigzag(val - *prev);
+	else
+		d = (val - *prev) & MBM_CNTR_MAX;
+	*prev = val;
+
+	put_varint(f, d << 1);
+}
+
+static int get_value(FILE *f, u64 *prev, int ev, u64 *val)
+{
+	u64 d;
+
+	if (get_varint(f, &d))
+		return -1;
+
+	if (d & 1) {
+		*val = *prev | RMID_VAL_UNAVAIL;
+		return 0;
+	}
+
+	d >>= 1;
+	if (ev == EV_OCCUP)
+		*prev += unzigzag(d);
+	else
+		*prev = (*prev + d) & MBM_CNTR_MAX;
+	*val = *prev;
+	return 0;
+}
+
+/*
+ * One cpu per package, the first online one.
+ */
+static int find_pkg_cpus(int *cpus)
+{
+	int cpu, pkg, i, nr = 0, nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int seen[SIM_MAX_PKGS];
+	char path[128];
+	FILE *f;
+
+	for (cpu = 0; cpu < nr_cpus && nr < SIM_MAX_PKGS; cpu++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/online", cpu);
+		f = fopen(path, "r");
+		if (f) {
+			i = fgetc(f);
+			fclose(f);
+			if (i == '0')
+				continue;
+		}
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			 cpu);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		i = fscanf(f, "%d", &pkg);
+		fclose(f);
+		if (i != 1)
+			continue;
+
+		for (i = 0; i < nr; i++)
+			if (seen[i] == pkg)
+				break;
+		if (i < nr)
+			continue;
+
+		seen[nr] = pkg;
+		cpus[nr++] = cpu;
+	}
+
+	return nr;
+}
+
+/*
+ * EVTSEL/CTR through the msr device. Somebody else (the driver) may
+ * reprogram EVTSEL between the two, so check it afterwards.
+ */
+static u64 msr_read_counter(int fd, u32 eventid, u32 rmid,
+			    unsigned long *races)
+{
+	u64 sel = ((u64)rmid << 32) | eventid, cur, val;
+	int i;
+
+	for (i = 0; i < EVSEL_RETRIES; i++) {
+		if (pwrite(fd, &sel, sizeof(sel), MSR_IA32_QM_EVTSEL) != sizeof(sel) ||
+		    pread(fd, &val, sizeof(val), MSR_IA32_QM_CTR) != sizeof(val) ||
+		    pread(fd, &cur, sizeof(cur), MSR_IA32_QM_EVTSEL) != sizeof(cur))
+			return RMID_VAL_ERROR;
+		if (cur == sel)
+			return val;
+		(*races)++;
+	}
+
+	return RMID_VAL_UNAVAIL;
+}
+
+static int record(int argc, char **argv)
+{
+	unsigned int interval = 1000, secs = 0, nr_rmids = 0, max_rmids;
+	unsigned int eax, ebx, ecx, edx, pkg, rmid, ev;
+	int cpus[SIM_MAX_PKGS], fds[SIM_MAX_PKGS], nr_pkgs, opt;
+	const char *out = NULL;
+	unsigned long races = 0, frames = 0;
+	struct trace_state st = { };
+	struct trace_hdr hdr = { };
+	u64 next, ts, t0, val;
+	char path[64];
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "i:d:r:o:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nr_rmids = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (!out || !interval)
+		return 2;
+
+	/* CPUID.(EAX=0xf, ECX=1): L3 monitoring. */
+	if (!__get_cpuid_count(0xf, 1, &eax, &ebx, &ecx, &edx) || !edx) {
+		fprintf(stderr, "mbmtrace: no L3 monitoring\n");
+		return 1;
+	}
+	max_rmids = ecx + 1;
+	if (!nr_rmids || nr_rmids > max_rmids)
+		nr_rmids = max_rmids;
+
+	memcpy(hdr.magic, TRACE_MAGIC, 4);
+	hdr.version = TRACE_VERSION;
+	hdr.nr_rmids = nr_rmids;
+	hdr.l3_scale = ebx;
+	hdr.interval_ms = interval;
+	for (ev = 0; ev < NR_EVS; ev++) {
+		if (edx & (1 << (ev_id[ev] - 1)))
+			hdr.events |= 1 << ev;
+	}
+
+	nr_pkgs = find_pkg_cpus(cpus);
+	for (pkg = 0; pkg < (unsigned int)nr_pkgs; pkg++) {
+		snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpus[pkg]);
+		fds[pkg] = open(path, O_RDWR);
+		if (fds[pkg] < 0) {
+			perror(path);
+			return 1;
+		}
+	}
+	hdr.nr_pkgs = nr_pkgs;
+
+	st.prev = sim_zalloc(nr_pkgs * nr_rmids * NR_EVS * sizeof(u64));
+
+	f = fopen(out, "w");
+	if (!f) {
+		perror(out);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	hdr.start_ns = now_ns(CLOCK_REALTIME);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	t0 = next = now_ns(CLOCK_MONOTONIC);
+	while (!done && (!secs || next - t0 < secs * NSEC_PER_SEC)) {
+		for (pkg = 0; pkg < hdr.nr_pkgs; pkg++) {
+			ts = now_ns(CLOCK_MONOTONIC);
+			put_varint(f, ts - st.pkg_ts[pkg]);
+			st.pkg_ts[pkg] = ts;
+
+			for (rmid = 0; rmid < nr_rmids; rmid++) {
+				put_varint(f, now_ns(CLOCK_MONOTONIC) - ts);
+				for (ev = 0; ev < NR_EVS; ev++) {
+					if (!(hdr.events & (1 << ev)))
+						continue;
+					val = msr_read_counter(fds[pkg], ev_id[ev],
+							       rmid, &races);
+					put_value(f, &st.prev[(pkg * nr_rmids + rmid) *
+							      NR_EVS + ev], ev, val);
+				}
+			}
+		}
+		/* Only whole frames if we get killed. */
+		fflush(f);
+		frames++;
+
+		next += interval * 1000000ULL;
+		ts = now_ns(CLOCK_MONOTONIC);
+		if (next > ts)
+			usleep((next - ts) / 1000);
+	}
+
+	fprintf(stderr, "mbmtrace: %lu frames, %ld bytes, %lu EVTSEL races\n",
+		frames, ftell(f), races);
+	fclose(f);
+	return 0;
+}
+
+static FILE *open_trace(const char *path, struct trace_hdr *hdr)
+{
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+	    memcmp(hdr->magic, TRACE_MAGIC, 4) ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->nr_pkgs > SIM_MAX_PKGS || !hdr->nr_rmids) {
+		fprintf(stderr, "mbmtrace: %s: not a trace\n", path);
+		exit(1);
+	}
+
+	return f;
+}
+
+/*
+ * Decode one frame into @ts (per package and RMID) and @val. Returns
+ * -1 at the end of the trace.
+ */
+static int read_frame(FILE *f, struct trace_hdr *hdr, struct trace_state *st,
+		      u64 *ts, u64 *val)
+{
+	unsigned int pkg, rmid, ev, i;
+	u64 d;
+
+	for (pkg = 0; pkg < hdr->nr_pkgs; pkg++) {
+		if (get_varint(f, &d))
+			return -1;
+		st->pkg_ts[pkg] += d;
+
+		for (rmid = 0; rmid < hdr->nr_rmids; rmid++) {
+			if (get_varint(f, &d))
+				return -1;
+			ts[pkg * hdr->nr_rmids + rmid] = st->pkg_ts[pkg] + d;
+
+			for (ev = 0; ev < NR_EVS; ev++) {
+				i = (pkg * hdr->nr_rmids + rmid) * NR_EVS + ev;
+				if (!(hdr->events & (1 << ev)))
+					val[i] = RMID_VAL_UNAVAIL;
+				else if (get_value(f, &st->prev[i], ev, &val[i]))
+					return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void print_val(u64 val)
+{
+	if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+		printf(",");
+	else
+		printf(",%llu", (unsigned long long)val);
+}
+
+static int dump(int argc, char **argv)
+{
+	struct trace_state st = { };
+	struct trace_hdr hdr;
+	unsigned int n, i;
+	u64 *ts, *val, t0 = 0;
+	FILE *f;
+
+	if (argc != 2)
+		return 2;
+
+	f = open_trace(argv[1], &hdr);
+	n = hdr.nr_pkgs * hdr.nr_rmids;
+	st.prev = sim_zalloc(n * NR_EVS * sizeof(u64));
+	ts = sim_zalloc(n * sizeof(u64));
+	val = sim_zalloc(n * NR_EVS * sizeof(u64));
+
+	printf("# start %llu, scale %u\n", (unsigned long long)hdr.start_ns,
+	       hdr.l3_scale);
+	printf("t_ns,pkg,rmid,occupancy,total,local\n");
+	while (!read_frame(f, &hdr, &st, ts, val)) {
+		if (!t0)
+			t0 = ts[0];
+		for (i = 0; i < n; i++) {
+			printf("%llu,%u,%u", (unsigned long long)(ts[i] - t0),
+			       i / hdr.nr_rmids, i % hdr.nr_rmids);
+			print_val(val[i * NR_EVS + EV_OCCUP]);
+			print_val(val[i * NR_EVS + EV_TOTAL]);
+			print_val(val[i * NR_EVS + EV_LOCAL]);
+			printf("\n");
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int replay(int argc, char **argv)
+{
+	unsigned int n, i, j, pkg, rmid, w;
+	int opt, only = -1, all = 0;
+	struct trace_state st = { };
+	struct trace_hdr hdr;
+	u64 *ts, *val, t0 = 0, occ, bw[2], avg[2], remote, ratio, refill;
+	bool *busy;
+	double mb;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "w:r:a")) != -1) {
+		switch (opt) {
+		case 'w':
+			w = strtoul(optarg, NULL, 0);
+			if (w < MBM_FIFO_SIZE_MIN || w > MBM_FIFO_SIZE_MAX)
+				return 2;
+			mbm_window_size = w;
+			break;
+		case 'r':
+			only = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			all = 1;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind != argc - 1)
+		return 2;
+
+	f = open_trace(argv[optind], &hdr);
+	n = hdr.nr_pkgs * hdr.nr_rmids;
+	st.prev = sim_zalloc(n * NR_EVS * sizeof(u64));
+	ts = sim_zalloc(n * sizeof(u64));
+	val = sim_zalloc(n * NR_EVS * sizeof(u64));
+	busy = sim_zalloc(n * sizeof(bool));
+
+	sim_setup(hdr.nr_pkgs, hdr.nr_rmids);
+	/* Counter units per second to MB/sec, like the event's .scale. */
+	mb = hdr.l3_scale / 1e6;
+
+	printf("t_s,pkg,rmid,occupancy_bytes,total_mbps,local_mbps,"
+	       "avg_total_mbps,avg_local_mbps,remote_mbps,local_pct,"
+	       "bw_per_occupancy\n");
+	while (!read_frame(f, &hdr, &st, ts, val)) {
+		if (!t0)
+			t0 = ts[0];
+
+		for (i = 0; i < n; i++) {
+			pkg = i / hdr.nr_rmids;
+			rmid = i % hdr.nr_rmids;
+			if (only >= 0 && rmid != (unsigned int)only)
+				continue;
+
+			/* Keep the clock well away from zero, see sim_setup(). */
+			sim_set_time(3600 * NSEC_PER_SEC + ts[i] - t0);
+			sim_cur_pkg = pkg;
+			sim_set_raw(pkg, rmid, false, val[i * NR_EVS + EV_TOTAL]);
+			sim_set_raw(pkg, rmid, true, val[i * NR_EVS + EV_LOCAL]);
+			sim_set_occ(pkg, rmid, val[i * NR_EVS + EV_OCCUP]);
+
+			/* What the driver's overflow timer does every second. */
+			bw[0] = rmid_read_mbm(rmid, QOS_MBM_TOTAL_EVENT_ID);
+			bw[1] = rmid_read_mbm(rmid, QOS_MBM_LOCAL_EVENT_ID);
+			avg[0] = this_mbm_pkg()->total[rmid].runavg;
+			avg[1] = this_mbm_pkg()->local[rmid].runavg;
+			/* Same interval as above, the derived events. */
+			remote = mbm_read_event(rmid, QOS_MBM_REMOTE_EVENT_ID, NULL);
+			ratio = mbm_read_event(rmid, QOS_MBM_LOCAL_RATIO_EVENT_ID,
+					       NULL);
+			refill = mbm_read_event(rmid, QOS_MBM_BW_PER_OCCUP_EVENT_ID,
+						NULL);
+
+			for (j = 0; j < 2; j++) {
+				if (bw[j] & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+					bw[j] = 0;
+			}
+			if (remote & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+				remote = 0;
+			if (ratio & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+				ratio = 0;
+			if (refill & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+				refill = 0;
+			occ = val[i * NR_EVS + EV_OCCUP];
+			if (occ & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+				occ = 0;
+
+			if (occ || bw[0] || bw[1])
+				busy[i] = true;
+			if (!busy[i] && !all)
+				continue;
+
+			printf("%.3f,%u,%u,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f,%.3f\n",
+			       (double)(ts[i] - t0) / NSEC_PER_SEC, pkg, rmid,
+			       (unsigned long long)(occ * hdr.l3_scale),
+			       bw[0] * mb, bw[1] * mb, avg[0] * mb, avg[1] * mb,
+			       remote * mb, ratio * 100.0 / MBM_RATIO_SCALE,
+			       (double)refill / MBM_BW_OCC_SCALE);
+		}
+	}
+
+	fprintf(stderr, "mbmtrace: window %u, %lu overflows, %lu late, "
+		"%lu throttled\n", mbm_window_size,
+		sim_stat[CQM_STAT_MBM_OVERFLOW], sim_stat[CQM_STAT_MBM_LATE],
+		sim_stat[CQM_STAT_MBM_THROTTLED]);
+
+	sim_teardown();
+	fclose(f);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: mbmtrace record [-i ms] [-d secs] [-r rmids] -o trace\n"
+		"       mbmtrace replay [-w window] [-r rmid] [-a] trace\n"
+		"       mbmtrace dump trace\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 2;
+
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "record"))
+		ret = record(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "replay"))
+		ret = replay(argc - 1, argv + 1);
+	else if (!strcmp(argv[1], "dump"))
+		ret = dump(argc - 1, argv + 1);
+
+	if (ret == 2)
+		usage();
+	return ret;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Pull the allocation (CAT and MBA) control code out of the driver so
+# that rdt_sim.h can build it in userspace: the MBM defines the MBA
+# controller samples with, everything from MSR_IA32_L3_CBM_BASE up to
+# __intel_cat_reset() and from MSR_IA32_MBA_THRTL_BASE up to
+# __intel_mba_reset(). Copied as is, so the checks always run what the
+# driver runs.
+#
+#   ./rdt-extract.sh [perf_event_intel_cqm.c] > rdt_gen.h
+#
+
+set -e
+
+SRC=${1:-$(dirname "$0")/../updates/arch/x86/kernel/cpu/perf_event_intel_cqm.c}
+
+[ -r "$SRC" ] || { echo "can't read $SRC" >&2; exit 1; }
+
+echo "/* Generated by rdt-extract.sh from $(basename "$SRC"), do not edit. */"
+echo
+grep -E '^#define (MBM_|MAX_MBM_|QOS_MBM_|RMID_VAL_)' "$SRC"
+echo
+sed -n '/^enum mbm_evt_type {/,/^};/p' "$SRC"
+echo
+sed -n '/^#define MSR_IA32_L3_CBM_BASE/,/^static void __intel_cat_reset/p' "$SRC" |
+	sed '$d'
+echo
+sed -n '/^#define MSR_IA32_MBA_THRTL_BASE/,/^static void __intel_mba_reset/p' "$SRC" |
+	sed '$d'
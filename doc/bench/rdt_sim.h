@@ -0,0 +1,240 @@
+/*
+ * rdt_sim.h - the driver's allocation control code on a simulated MSR
+ * backend.
+ *
+ * Provides just enough of the kernel for rdt_gen.h (see rdt-extract.sh)
+ * to build in userspace, on a per-package MSR file for the 0xc00-0xdff
+ * control MSRs:
+ *
+ *   sim_setup(pkgs)			fresh packages, every MSR at zero
+ *   sim_rdmsr(pkg, msr)		what the driver last wrote
+ *   sim_msr_writes			MSR writes so far
+ *   sim_pkg_offline[pkg]		skipped by cqm_on_each_reader()
+ *   sim_cur_pkg			package the driver runs on
+ *
+ * and simulated time and MBM counters for the MBA controller:
+ *
+ *   sim_set_rate(pkg, rmid, local, r)	counter r increments per second
+ *   sim_advance(ns)			move the clock forward
+ *   sim_now				the clock, as ktime_get() reads it
+ *
+ * Counters are 24 bits wide and wrap like the hardware's. Nothing but
+ * the code under test reads them.
+ */
+#ifndef _RDT_SIM_H
+#define _RDT_SIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef s64 ktime_t;
+
+#define MSEC_PER_SEC	1000L
+#define NSEC_PER_SEC	1000000000ULL
+
+#define BIT(n)			(1UL << (n))
+#define BITS_PER_LONG		(8 * sizeof(long))
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define div_u64(a, b)		((u64)(a) / (b))
+#define div64_u64(a, b)		((u64)(a) / (b))
+
+#define lockdep_assert_held(l)	do { } while (0)
+
+#define SIM_MAX_PKGS	64
+#define SIM_MAX_RMIDS	8
+#define SIM_CNTR_MASK	0xffffffULL
+
+struct work_struct {
+	int	pending;
+};
+
+#define DECLARE_DELAYED_WORK(n, f)	struct work_struct n
+
+struct perf_event {
+	struct {
+		u64	config;
+		u64	config1;
+	} attr;
+	struct {
+		u32	cqm_rmid;
+	} hw;
+};
+
+static unsigned long find_next_bit(const unsigned long *addr,
+				   unsigned long size, unsigned long off)
+{
+	for (; off < size && off < BITS_PER_LONG; off++) {
+		if (*addr & BIT(off))
+			return off;
+	}
+	return size;
+}
+
+static unsigned long find_next_zero_bit(const unsigned long *addr,
+					unsigned long size, unsigned long off)
+{
+	for (; off < size && off < BITS_PER_LONG; off++) {
+		if (!(*addr & BIT(off)))
+			return off;
+	}
+	return size;
+}
+
+#define find_first_bit(addr, size)	find_next_bit(addr, size, 0)
+
+#define SIM_MSR_BASE	0xc00
+#define SIM_NR_MSRS	0x200
+
+static u64 sim_msr[SIM_MAX_PKGS][SIM_NR_MSRS];
+static bool sim_pkg_offline[SIM_MAX_PKGS];
+static unsigned long sim_msr_writes;
+static unsigned int sim_nr_pkgs;
+static int sim_cur_pkg;
+
+static inline void cqm_wrmsr(unsigned int msr, u32 low, u32 high)
+{
+	sim_msr[sim_cur_pkg][msr - SIM_MSR_BASE] = (u64)high << 32 | low;
+	sim_msr_writes++;
+}
+
+static inline void cqm_wrmsrl(unsigned int msr, u64 val)
+{
+	cqm_wrmsr(msr, val, val >> 32);
+}
+
+static inline u64 sim_rdmsr(int pkg, unsigned int msr)
+{
+	return sim_msr[pkg][msr - SIM_MSR_BASE];
+}
+
+static u64 sim_now;
+
+static inline ktime_t ktime_get(void)
+{
+	return sim_now;
+}
+
+static inline s64 ktime_ms_delta(ktime_t later, ktime_t earlier)
+{
+	return (later - earlier) / 1000000;
+}
+
+/*
+ * One MBM counter: @acc counts since the start, @rem carries the
+ * fraction of a count over to the next update.
+ */
+struct sim_ctr {
+	u64	acc;
+	u64	rem;
+	u64	rate;
+	u64	t;
+};
+
+static struct sim_ctr sim_ctr[SIM_MAX_PKGS][2][SIM_MAX_RMIDS];
+static unsigned int cqm_l3_scale;
+
+static void sim_ctr_update(struct sim_ctr *c)
+{
+	u64 n = c->rate * (sim_now - c->t) + c->rem;
+
+	c->acc += n / NSEC_PER_SEC;
+	c->rem = n % NSEC_PER_SEC;
+	c->t = sim_now;
+}
+
+static inline void sim_set_rate(int pkg, u32 rmid, bool local, u64 rate)
+{
+	struct sim_ctr *c = &sim_ctr[pkg][local][rmid];
+
+	sim_ctr_update(c);
+	c->rate = rate;
+}
+
+static inline void sim_advance(u64 ns)
+{
+	sim_now += ns;
+}
+
+static u64 cqm_read_counter(u32 eventid, u32 rmid);
+
+typedef void (*smp_call_func_t)(void *info);
+
+/*
+ * One call per online package, on that package.
+ */
+static inline void cqm_on_each_reader(smp_call_func_t func, void *info)
+{
+	int cur = sim_cur_pkg;
+	unsigned int pkg;
+
+	for (pkg = 0; pkg < sim_nr_pkgs; pkg++) {
+		if (sim_pkg_offline[pkg])
+			continue;
+		sim_cur_pkg = pkg;
+		func(info);
+	}
+	sim_cur_pkg = cur;
+}
+
+/* Not every tool uses all of the driver's code. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#include "rdt_gen.h"
+#pragma GCC diagnostic pop
+
+static u64 cqm_read_counter(u32 eventid, u32 rmid)
+{
+	struct sim_ctr *c;
+
+	c = &sim_ctr[sim_cur_pkg][eventid == QOS_MBM_LOCAL_EVENT_ID][rmid];
+	sim_ctr_update(c);
+	return c->acc & SIM_CNTR_MASK;
+}
+
+/* Not extracted; the checks run the controller steps themselves. */
+static inline void intel_mba_ctrl_update(struct work_struct *work)
+{
+}
+
+static void *sim_zalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * Fresh packages, every MSR and counter at zero and stopped. The clock
+ * starts well away from zero like a real ktime would.
+ */
+static void sim_setup(unsigned int nr_pkgs)
+{
+	if (nr_pkgs > SIM_MAX_PKGS) {
+		fprintf(stderr, "at most %d packages\n", SIM_MAX_PKGS);
+		exit(1);
+	}
+
+	memset(sim_msr, 0, sizeof(sim_msr));
+	memset(sim_pkg_offline, 0, sizeof(sim_pkg_offline));
+	memset(sim_ctr, 0, sizeof(sim_ctr));
+	sim_msr_writes = 0;
+	sim_now = 3600 * NSEC_PER_SEC;
+	sim_nr_pkgs = nr_pkgs;
+	sim_cur_pkg = 0;
+}
+
+#endif /* _RDT_SIM_H */
@@ -0,0 +1,514 @@
+/*
+ * rdtcheck - the driver's allocation control code (CAT) against a
+ * simulated MSR file, and the MBA bandwidth controller against simulated
+ * MBM counters.
+ *
+ *   ./rdt-extract.sh > rdt_gen.h
+ *   gcc -O2 -o rdtcheck rdtcheck.c
+ *
+ *   rdtcheck [-v]
+ *
+ * Checks:
+ *
+ *   cbm_valid	every mask of up to cbm_len + 1 bits against a reference:
+ *		non-empty, in range and contiguous
+ *   cbm_set	intel_cat_set_cbm() rejects CLOSID 0, CLOSIDs out of
+ *		range and invalid masks without touching the MSRs, and
+ *		programs valid ones on every package, once
+ *   closid	intel_rdt_check_closid(): the CLOSID range with CAT, MBA,
+ *		both and neither present, and -EBUSY for joining a group
+ *		under another CLOSID
+ *   cat_online	a package that was offline while masks changed gets all
+ *		of them from intel_cat_cpu_starting()
+ *   mba_step	mba_ctrl_step() decisions around the hysteresis band,
+ *		at zero and at the maximum delay
+ *   mba_unread	mba_sample_rmid() on counters nothing else reads, as
+ *		when a group's MBM events are never read: both bandwidths
+ *		come out exact across counter wraps, and the first read and
+ *		a late one only take a baseline
+ *   mba_response	a CLOSID wanting twice its target settles at the delay
+ *		that meets it, and comes back unthrottled when demand
+ *		drops below the target
+ *   mba_clamp	far over target, the delay stops at mba_max_delay
+ *   mba_rate	every change is one MBA_DELAY_STEP, at least
+ *		MBA_CTRL_HOLDOFF intervals apart
+ *
+ * The controlled group runs on one RMID under CLOSID 1, its demand
+ * spread evenly over the packages and scaled down linearly by the delay
+ * programmed on each. Every interval is run like intel_mba_ctrl_update()
+ * does: sample the RMID on all packages, sum, and mba_ctrl_adjust().
+ *
+ * Prints one line per check, and what went wrong with -v. Exits 1 if
+ * any check failed.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+
+#include "rdt_sim.h"
+
+#define NR_PKGS		4
+#define CBM_LEN		11
+#define NR_CLOSIDS	16
+#define MBA_CLOSIDS	4
+#define MBA_MAX_DELAY	90
+#define MBA_TARGET	400	/* MB/sec */
+#define MBA_RMID	1
+#define L3_SCALE	64
+#define NSEC_PER_MSEC	1000000ULL
+
+static int verbose;
+static unsigned int nr_failed;
+
+#define fail(fmt, ...)							\
+({									\
+	if (verbose)							\
+		printf("  " fmt "\n", ##__VA_ARGS__);			\
+	false;								\
+})
+
+static void report(const char *name, bool ok)
+{
+	printf("%-14s %s\n", name, ok ? "ok" : "FAIL");
+	if (!ok)
+		nr_failed++;
+}
+
+/*
+ * Fresh packages and CAT state, CLOSID 0 at the full mask.
+ */
+static void cat_setup(void)
+{
+	unsigned int i;
+
+	sim_setup(NR_PKGS);
+
+	is_cat = true;
+	is_mba = false;
+	cat_cbm_len = CBM_LEN;
+	cat_max_closid = NR_CLOSIDS;
+	free(cat_cbm);
+	cat_cbm = sim_zalloc(NR_CLOSIDS * sizeof(*cat_cbm));
+	for (i = 0; i < NR_CLOSIDS; i++)
+		cat_cbm[i] = BIT(CBM_LEN) - 1;
+
+	for (i = 0; i < NR_PKGS; i++) {
+		sim_cur_pkg = i;
+		intel_cat_cpu_starting();
+	}
+	sim_cur_pkg = 0;
+}
+
+static bool ref_cbm_valid(unsigned long cbm)
+{
+	if (!cbm || cbm >= BIT(CBM_LEN))
+		return false;
+
+	while (!(cbm & 1))
+		cbm >>= 1;
+
+	return !(cbm & (cbm + 1));
+}
+
+static bool check_cbm_valid(void)
+{
+	unsigned long cbm;
+	bool ok = true;
+
+	cat_setup();
+	for (cbm = 0; cbm < BIT(CBM_LEN + 1); cbm++) {
+		if (cat_cbm_valid(cbm) != ref_cbm_valid(cbm))
+			ok = fail("cbm %#lx: got %d", cbm, cat_cbm_valid(cbm));
+	}
+
+	return ok;
+}
+
+/*
+ * Whether MSR @msr reads @val on all packages.
+ */
+static bool msr_all(unsigned int msr, u64 val)
+{
+	unsigned int pkg;
+	bool ok = true;
+
+	for (pkg = 0; pkg < NR_PKGS; pkg++) {
+		if (sim_rdmsr(pkg, msr) != val)
+			ok = fail("pkg %u msr %#x: %#llx, want %#llx", pkg, msr,
+				  (unsigned long long)sim_rdmsr(pkg, msr),
+				  (unsigned long long)val);
+	}
+
+	return ok;
+}
+
+static bool check_cbm_set(void)
+{
+	static const struct {
+		u32	closid;
+		u32	cbm;
+	} bad[] = {
+		{ 0, 0x00f },
+		{ NR_CLOSIDS, 0x00f },
+		{ 3, 0 },
+		{ 3, 0x505 },
+		{ 3, BIT(CBM_LEN) },
+	};
+	unsigned long writes;
+	bool ok = true;
+	unsigned int i;
+	int ret;
+
+	cat_setup();
+	writes = sim_msr_writes;
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		ret = intel_cat_set_cbm(bad[i].closid, bad[i].cbm);
+		if (ret != -EINVAL)
+			ok = fail("closid %u cbm %#x: %d", bad[i].closid,
+				  bad[i].cbm, ret);
+	}
+	if (sim_msr_writes != writes)
+		ok = fail("rejected masks wrote %lu MSRs",
+			  sim_msr_writes - writes);
+
+	ret = intel_cat_set_cbm(3, 0x0f0);
+	if (ret)
+		ok = fail("closid 3 cbm 0xf0: %d", ret);
+	ok &= msr_all(MSR_IA32_L3_CBM_BASE + 3, 0x0f0);
+	ok &= msr_all(MSR_IA32_L3_CBM_BASE + 4, BIT(CBM_LEN) - 1);
+
+	writes = sim_msr_writes;
+	intel_cat_set_cbm(3, 0x0f0);
+	if (sim_msr_writes != writes)
+		ok = fail("unchanged mask wrote %lu MSRs",
+			  sim_msr_writes - writes);
+
+	return ok;
+}
+
+static bool closid_ret(u32 closid, struct perf_event *group, int want)
+{
+	struct perf_event event = { };
+	int ret;
+
+	event.attr.config1 = (u64)closid << CQM_CLOSID_SHIFT;
+	ret = intel_rdt_check_closid(&event, group);
+	if (ret != want)
+		return fail("closid %u (cat %d mba %d): %d, want %d", closid,
+			    is_cat, is_mba, ret, want);
+
+	return true;
+}
+
+static bool check_closid(void)
+{
+	struct perf_event group = { };
+	bool ok = true;
+
+	cat_setup();
+	ok &= closid_ret(0, NULL, 0);
+	ok &= closid_ret(NR_CLOSIDS - 1, NULL, 0);
+	ok &= closid_ret(NR_CLOSIDS, NULL, -EINVAL);
+
+	/* With MBA as well, the smaller of the two counts. */
+	is_mba = true;
+	mba_max_closid = NR_CLOSIDS / 2;
+	ok &= closid_ret(NR_CLOSIDS / 2 - 1, NULL, 0);
+	ok &= closid_ret(NR_CLOSIDS / 2, NULL, -EINVAL);
+
+	is_cat = false;
+	ok &= closid_ret(NR_CLOSIDS / 2 - 1, NULL, 0);
+	ok &= closid_ret(NR_CLOSIDS / 2, NULL, -EINVAL);
+
+	/* Nothing to allocate: monitoring only, on CLOSID 0. */
+	is_mba = false;
+	ok &= closid_ret(0, NULL, 0);
+	ok &= closid_ret(1, NULL, -EINVAL);
+
+	is_cat = true;
+	group.attr.config1 = (u64)2 << CQM_CLOSID_SHIFT;
+	ok &= closid_ret(2, &group, 0);
+	ok &= closid_ret(3, &group, -EBUSY);
+	ok &= closid_ret(0, &group, -EBUSY);
+
+	return ok;
+}
+
+static bool check_cat_online(void)
+{
+	unsigned int closid;
+	bool ok = true;
+
+	cat_setup();
+	sim_pkg_offline[2] = true;
+	intel_cat_set_cbm(1, 0x003);
+	intel_cat_set_cbm(5, 0x7c0);
+
+	if (sim_rdmsr(2, MSR_IA32_L3_CBM_BASE + 5) == 0x7c0)
+		ok = fail("offline package was programmed");
+
+	/* Comes back with the MSRs at their reset value. */
+	memset(sim_msr[2], 0, sizeof(sim_msr[2]));
+	sim_pkg_offline[2] = false;
+	sim_cur_pkg = 2;
+	intel_cat_cpu_starting();
+	sim_cur_pkg = 0;
+
+	for (closid = 0; closid < NR_CLOSIDS; closid++)
+		ok &= msr_all(MSR_IA32_L3_CBM_BASE + closid, cat_cbm[closid]);
+
+	return ok;
+}
+
+static struct mba_sample mba_ms[NR_PKGS];
+
+static void mba_setup(u32 max_delay)
+{
+	sim_setup(NR_PKGS);
+	cqm_l3_scale = L3_SCALE;
+	memset(mba_ms, 0, sizeof(mba_ms));
+
+	is_cat = false;
+	is_mba = true;
+	mba_max_closid = MBA_CLOSIDS;
+	mba_max_delay = max_delay;
+	free(mba_ctrl);
+	mba_ctrl = sim_zalloc(MBA_CLOSIDS * sizeof(*mba_ctrl));
+	mba_ctrl[1].target = MBA_TARGET;
+}
+
+static bool check_mba_step(void)
+{
+	static const struct {
+		u32	delay, max_delay;
+		u64	bw;
+		u32	target, want;
+	} steps[] = {
+		{  0, 90, 1200, 1000, 10 },	/* over the band */
+		{  0, 90, 1100, 1000,  0 },	/* at its top */
+		{ 50, 90,  901, 1000, 50 },	/* in it */
+		{ 50, 90,  899, 1000, 40 },	/* under it */
+		{  0, 90,    0, 1000,  0 },	/* can't go below 0 */
+		{ 90, 90, 5000, 1000, 90 },	/* at the maximum */
+		{ 80, 85, 5000, 1000, 80 },	/* a step would pass it */
+	};
+	bool ok = true;
+	unsigned int i;
+	u32 got;
+
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		got = mba_ctrl_step(steps[i].delay, steps[i].max_delay,
+				    steps[i].bw, steps[i].target);
+		if (got != steps[i].want)
+			ok = fail("delay %u max %u bw %llu target %u: %u, want %u",
+				  steps[i].delay, steps[i].max_delay,
+				  (unsigned long long)steps[i].bw,
+				  steps[i].target, got, steps[i].want);
+	}
+
+	return ok;
+}
+
+#define MBA_INTERVAL_NS	(MBA_CTRL_INTERVAL_MS * NSEC_PER_MSEC)
+
+static bool check_mba_unread(void)
+{
+	/* Counts/sec; the total counter wraps almost every interval. */
+	const u64 total = 0xf00000, local = 0x340000;
+	struct mba_sample ms = { };
+	bool ok = true;
+	unsigned int i;
+
+	mba_setup(MBA_MAX_DELAY);
+	sim_set_rate(0, MBA_RMID, false, total);
+	sim_set_rate(0, MBA_RMID, true, local);
+
+	sim_advance(MBA_INTERVAL_NS);
+	if (mba_sample_rmid(&ms, MBA_RMID, sim_now) || ms.total_bw)
+		ok = fail("first read: bandwidth %llu",
+			  (unsigned long long)ms.total_bw);
+
+	for (i = 0; i < 20; i++) {
+		/* Late: the counters may have wrapped more than once. */
+		if (i == 10) {
+			sim_advance(2 * MBA_INTERVAL_NS);
+			if (mba_sample_rmid(&ms, MBA_RMID, sim_now) ||
+			    ms.total_bw)
+				ok = fail("late read: bandwidth %llu",
+					  (unsigned long long)ms.total_bw);
+		}
+
+		sim_advance(MBA_INTERVAL_NS);
+		if (!mba_sample_rmid(&ms, MBA_RMID, sim_now))
+			ok = fail("read %u: no whole interval", i);
+		if (ms.total_bw != total || ms.local_bw != local)
+			ok = fail("read %u: total %llu local %llu, want %llu %llu",
+				  i, (unsigned long long)ms.total_bw,
+				  (unsigned long long)ms.local_bw,
+				  (unsigned long long)total,
+				  (unsigned long long)local);
+	}
+
+	return ok;
+}
+
+/*
+ * One controller interval for CLOSID 1, like intel_mba_ctrl_update().
+ */
+static void mba_interval(void)
+{
+	bool whole = true;
+	unsigned int pkg;
+	u64 bw = 0;
+
+	sim_advance(MBA_INTERVAL_NS);
+	for (pkg = 0; pkg < NR_PKGS; pkg++) {
+		sim_cur_pkg = pkg;
+		whole &= mba_sample_rmid(&mba_ms[pkg], MBA_RMID, sim_now);
+		bw += mba_ms[pkg].total_bw;
+	}
+	sim_cur_pkg = 0;
+
+	mba_ctrl[1].bw = div_u64(bw * cqm_l3_scale, 1000000);
+	if (!whole && !mba_ctrl[1].holdoff)
+		mba_ctrl[1].holdoff = 1;
+
+	mba_ctrl_adjust();
+}
+
+/*
+ * The controller's history over one or more mba_run()s.
+ */
+struct mba_trace {
+	unsigned int	t;
+	unsigned int	last_change;
+	u32		delay;
+	u32		max_seen;
+	bool		ok;
+};
+
+/*
+ * Run the controller @n intervals for a CLOSID that would use @demand
+ * MB/sec unthrottled; checks the rate limit on the way.
+ */
+static void mba_run(struct mba_trace *tr, u64 demand, unsigned int n)
+{
+	u64 rate = demand * 1000000 / L3_SCALE / NR_PKGS;
+	unsigned int pkg;
+	u32 delay;
+
+	while (n--) {
+		for (pkg = 0; pkg < NR_PKGS; pkg++) {
+			delay = sim_rdmsr(pkg, MSR_IA32_MBA_THRTL_BASE + 1);
+			sim_set_rate(pkg, MBA_RMID, false,
+				     rate * (100 - delay) / 100);
+			sim_set_rate(pkg, MBA_RMID, true,
+				     rate * (100 - delay) / 200);
+		}
+		mba_interval();
+		tr->t++;
+
+		delay = mba_ctrl[1].delay;
+		if (delay == tr->delay)
+			continue;
+
+		if (delay != tr->delay + MBA_DELAY_STEP &&
+		    delay + MBA_DELAY_STEP != tr->delay)
+			tr->ok = fail("t %u: delay %u to %u", tr->t, tr->delay,
+				      delay);
+		if (tr->last_change &&
+		    tr->t - tr->last_change <= MBA_CTRL_HOLDOFF)
+			tr->ok = fail("t %u: changed %u intervals after the last",
+				      tr->t, tr->t - tr->last_change);
+
+		tr->last_change = tr->t;
+		tr->delay = delay;
+		if (delay > tr->max_seen)
+			tr->max_seen = delay;
+	}
+}
+
+static struct mba_trace rate_trace = { .ok = true };
+
+static bool check_mba_response(void)
+{
+	struct mba_trace tr = { .ok = true };
+	unsigned int settle;
+	bool ok = true;
+
+	mba_setup(MBA_MAX_DELAY);
+
+	/*
+	 * A baseline, then 5 steps to 50%, each followed by the holdoff.
+	 */
+	settle = 1 + 5 * (MBA_CTRL_HOLDOFF + 1);
+	mba_run(&tr, 2 * MBA_TARGET, settle);
+	if (tr.delay != 50)
+		ok = fail("after %u intervals at 2x: delay %u, want 50",
+			  settle, tr.delay);
+
+	mba_run(&tr, 2 * MBA_TARGET, 100);
+	if (tr.delay != 50)
+		ok = fail("2x: delay moved on to %u", tr.delay);
+	ok &= msr_all(MSR_IA32_MBA_THRTL_BASE + 1, 50);
+	ok &= msr_all(MSR_IA32_MBA_THRTL_BASE + 2, 0);
+
+	mba_run(&tr, MBA_TARGET / 2, 100);
+	if (tr.delay != 0)
+		ok = fail("0.5x: delay %u, want 0", tr.delay);
+	ok &= msr_all(MSR_IA32_MBA_THRTL_BASE + 1, 0);
+
+	rate_trace.ok &= tr.ok;
+	return ok;
+}
+
+static bool check_mba_clamp(void)
+{
+	struct mba_trace tr = { .ok = true };
+	bool ok = true;
+
+	mba_setup(MBA_MAX_DELAY - 20);
+	mba_run(&tr, 10 * MBA_TARGET, 200);
+	if (tr.max_seen != MBA_MAX_DELAY - 20 || tr.delay != tr.max_seen)
+		ok = fail("delay %u, max %u, want %u", tr.delay, tr.max_seen,
+			  MBA_MAX_DELAY - 20);
+	ok &= msr_all(MSR_IA32_MBA_THRTL_BASE + 1, MBA_MAX_DELAY - 20);
+
+	rate_trace.ok &= tr.ok;
+	return ok;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: rdtcheck [-v]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	report("cbm_valid", check_cbm_valid());
+	report("cbm_set", check_cbm_set());
+	report("closid", check_closid());
+	report("cat_online", check_cat_online());
+
+	report("mba_step", check_mba_step());
+	report("mba_unread", check_mba_unread());
+	report("mba_response", check_mba_response());
+	report("mba_clamp", check_mba_clamp());
+	report("mba_rate", rate_trace.ok);
+
+	free(cat_cbm);
+	free(mba_ctrl);
+	return nr_failed ? 1 : 0;
+}
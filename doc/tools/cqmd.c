@@ -0,0 +1,428 @@
+/*
+ * cqmd - one resident collector per host for LLC occupancy and memory
+ * bandwidth per cgroup, instead of a perf stat -I process per target.
+ *
+ *   gcc -O2 -o cqmd cqmd.c libcqm.c
+ *
+ *   cqmd [-i ms] [-s socket] [-f file] [-r cgroup root] [-a] [-d]
+ *        [cgroup dir...]
+ *
+ * Monitors the cgroups given and, with -r, every leaf cgroup below the
+ * root (rescanned every 10 intervals). A cgroup conflicts with its
+ * ancestors and descendants in the driver, only one of them holds an
+ * RMID at a time, so the walk leaves out inner cgroups. Every interval
+ * (default 1000ms) all targets are read, one read() per target and
+ * package, and the results are written in text exposition format:
+ *
+ *   - atomically to the file given with -f, for scrapers,
+ *   - to every client that connects to the Unix socket given with -s.
+ *
+ * Targets whose sample is stale (see libcqm.h), i.e. that had no RMID
+ * since the last collection, are left out of that collection and
+ * counted in cqm_targets_stale instead.
+ *
+ * -a reports avg_total_bw/avg_local_bw instead of total_bw/local_bw.
+ * -d detaches from the terminal.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libcqm.h"
+
+#define RESCAN_EVERY	10
+
+struct target {
+	struct cqm_target	t;
+	struct cqm_sample	s;
+	char			path[512];
+	char			label[1024];	/* name, escaped */
+	int			err;
+	int			seen;
+	int			keep;		/* given on the command line */
+};
+
+static struct cqm_pmu pmu;
+static struct target **targets;
+static unsigned int nr_targets;
+
+static const char *root;
+static size_t root_len;
+static int generation;
+
+static char *expo;
+static size_t expo_len, expo_size;
+
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct target *find_target(const char *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_targets; i++)
+		if (!strcmp(targets[i]->path, path))
+			return targets[i];
+	return NULL;
+}
+
+/*
+ * Escape @src for use as a label value: backslash, double quote and
+ * newline get a backslash. Truncates to @size.
+ */
+static void label_escape(char *dst, size_t size, const char *src)
+{
+	size_t n = 0;
+
+	for (; *src && n + 2 < size; src++) {
+		if (*src == '\\' || *src == '"') {
+			dst[n++] = '\\';
+			dst[n++] = *src;
+		} else if (*src == '\n') {
+			dst[n++] = '\\';
+			dst[n++] = 'n';
+		} else {
+			dst[n++] = *src;
+		}
+	}
+	dst[n] = '\0';
+}
+
+static struct target *add_target(const char *path, const char *name)
+{
+	struct target *tg, **tmp;
+	int ret;
+
+	tg = find_target(path);
+	if (tg) {
+		tg->seen = generation;
+		return tg;
+	}
+
+	tg = calloc(1, sizeof(*tg));
+	tmp = realloc(targets, (nr_targets + 1) * sizeof(*targets));
+	if (!tg || !tmp) {
+		free(tg);
+		return NULL;
+	}
+	targets = tmp;
+
+	snprintf(tg->path, sizeof(tg->path), "%s", path);
+	ret = cqm_open_cgroup(&pmu, &tg->t, path, name);
+	if (ret) {
+		fprintf(stderr, "cqmd: %s: %s\n", path, strerror(-ret));
+		free(tg);
+		return NULL;
+	}
+
+	label_escape(tg->label, sizeof(tg->label), tg->t.name);
+	tg->seen = generation;
+	targets[nr_targets++] = tg;
+	return tg;
+}
+
+static int scan_one(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	if (flag != FTW_D || !cqm_cgroup_leaf(path))
+		return 0;
+
+	add_target(path, path[root_len] ? path + root_len : "/");
+	return 0;
+}
+
+/*
+ * Pick up new leaf cgroups below the root and drop the ones that are
+ * gone or have grown children.
+ * Targets given on the command line stay whether or not the walk found
+ * them.
+ */
+static void rescan(void)
+{
+	unsigned int i, j;
+
+	generation++;
+	nftw(root, scan_one, 16, FTW_PHYS);
+
+	for (i = j = 0; i < nr_targets; i++) {
+		if (targets[i]->keep || targets[i]->seen == generation) {
+			targets[j++] = targets[i];
+			continue;
+		}
+		cqm_close(&targets[i]->t);
+		free(targets[i]);
+	}
+	nr_targets = j;
+}
+
+static void expo_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(expo + expo_len, expo_size - expo_len, fmt, ap);
+		va_end(ap);
+
+		if (n >= 0 && expo_len + n < expo_size) {
+			expo_len += n;
+			return;
+		}
+
+		expo_size = expo_size ? expo_size * 2 : 65536;
+		expo = realloc(expo, expo_size);
+		if (!expo) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+}
+
+static const struct metric {
+	const char	*name;
+	const char	*help;
+	enum cqm_ev	ev, ev2;	/* needs both */
+	size_t		off;
+} metrics[] = {
+	{ "cqm_llc_occupancy_bytes", "LLC occupancy.",
+	  CQM_EV_OCCUP, CQM_EV_OCCUP, offsetof(struct cqm_sample, occupancy) },
+	{ "cqm_mem_bw_total_mbps", "Total memory bandwidth, MB/sec.",
+	  CQM_EV_TOTAL, CQM_EV_TOTAL, offsetof(struct cqm_sample, total_bw) },
+	{ "cqm_mem_bw_local_mbps", "Local memory bandwidth, MB/sec.",
+	  CQM_EV_LOCAL, CQM_EV_LOCAL, offsetof(struct cqm_sample, local_bw) },
+	{ "cqm_mem_bw_remote_mbps", "Remote memory bandwidth, MB/sec.",
+	  CQM_EV_TOTAL, CQM_EV_LOCAL, offsetof(struct cqm_sample, remote_bw) },
+};
+
+static void collect(void)
+{
+	const struct metric *m;
+	struct target *tg;
+	unsigned int i, j, nr_stale = 0;
+	uint64_t t0;
+
+	t0 = now_ns();
+	for (i = 0; i < nr_targets; i++) {
+		tg = targets[i];
+		tg->err = cqm_read(&pmu, &tg->t, &tg->s);
+		if (!tg->err && tg->s.stale)
+			nr_stale++;
+	}
+
+	expo_len = 0;
+	for (j = 0; j < sizeof(metrics) / sizeof(metrics[0]); j++) {
+		m = &metrics[j];
+		if (!pmu.have[m->ev] || !pmu.have[m->ev2])
+			continue;
+
+		expo_printf("# HELP %s %s\n# TYPE %s gauge\n",
+			    m->name, m->help, m->name);
+		for (i = 0; i < nr_targets; i++) {
+			tg = targets[i];
+			if (tg->err || tg->s.stale)
+				continue;
+			expo_printf("%s{cgroup=\"%s\"} %.0f\n", m->name,
+				    tg->label,
+				    *(double *)((char *)&tg->s + m->off));
+		}
+	}
+
+	expo_printf("# HELP cqm_targets Monitored cgroups.\n"
+		    "# TYPE cqm_targets gauge\ncqm_targets %u\n", nr_targets);
+	expo_printf("# HELP cqm_targets_stale Cgroups left out, no RMID since the last collection.\n"
+		    "# TYPE cqm_targets_stale gauge\ncqm_targets_stale %u\n",
+		    nr_stale);
+	expo_printf("# HELP cqm_collect_seconds Time the last collection took.\n"
+		    "# TYPE cqm_collect_seconds gauge\ncqm_collect_seconds %.6f\n",
+		    (now_ns() - t0) / 1e9);
+}
+
+static void write_file(const char *file)
+{
+	char tmp[512];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+
+	if (write(fd, expo, expo_len) != (ssize_t)expo_len) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	close(fd);
+	rename(tmp, file);
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "cqmd: socket path too long\n");
+		exit(1);
+	}
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    listen(fd, 16)) {
+		perror(path);
+		exit(1);
+	}
+
+	return fd;
+}
+
+/*
+ * Clients get the last collection and are hung up on. Blocking write
+ * with a short timeout so that a stuck reader can't hold us up.
+ */
+static void serve(int lfd)
+{
+	struct timeval tv = { .tv_usec = 100000 };
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (write(fd, expo, expo_len) < 0 && errno != EPIPE)
+			perror("cqmd: write");
+		close(fd);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cqmd [-i ms] [-s socket] [-f file] [-r cgroup root] [-a] [-d]\n"
+		"            [cgroup dir...]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *sock = NULL, *file = NULL;
+	unsigned int interval = 1000, ticks = 0;
+	int opt, lfd = -1, ret, avg = 0, detach = 0;
+	uint64_t next, now;
+	struct pollfd pfd;
+
+	while ((opt = getopt(argc, argv, "i:s:f:r:ad")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'r':
+			root = optarg;
+			root_len = strlen(root);
+			while (root_len > 1 && root[root_len - 1] == '/')
+				root_len--;
+			break;
+		case 'a':
+			avg = 1;
+			break;
+		case 'd':
+			detach = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!interval || (!sock && !file) || (!root && optind == argc))
+		usage();
+
+	ret = cqm_pmu_init(&pmu, avg);
+	if (ret) {
+		fprintf(stderr, "cqmd: intel_cqm PMU: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	for (; optind < argc; optind++) {
+		struct target *tg = add_target(argv[optind], argv[optind]);
+
+		if (tg)
+			tg->keep = 1;
+	}
+	if (root)
+		rescan();
+
+	if (sock)
+		lfd = listen_on(sock);
+
+	if (detach && daemon(0, 0)) {
+		perror("daemon");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	next = now_ns();
+	while (!done) {
+		now = now_ns();
+		if (now >= next) {
+			if (root && !(++ticks % RESCAN_EVERY))
+				rescan();
+			collect();
+			if (file)
+				write_file(file);
+			next += interval * 1000000ULL;
+			if (next < now)
+				next = now + interval * 1000000ULL;
+			continue;
+		}
+
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, lfd >= 0, (next - now) / 1000000 + 1) > 0)
+			serve(lfd);
+	}
+
+	if (sock)
+		unlink(sock);
+	return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * libcqm - open and read intel_cqm events for processes and cgroups,
+ * see libcqm.h.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "libcqm.h"
+
+static const char * const ev_names[2][CQM_NR_EV] = {
+	{ "llc_occupancy", "total_bw", "local_bw", "rmid_time_running" },
+	{ "llc_occupancy", "avg_total_bw", "avg_local_bw",
+	  "rmid_time_running" },
+};
+
+static int read_file(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+
+	buf[n] = '\0';
+	return 0;
+}
+
+static int read_pmu_file(const char *name, char *buf, size_t len)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), CQM_PMU_DIR "/%s", name);
+	return read_file(path, buf, len);
+}
+
+/*
+ * The first online cpu of every package, for cgroup events.
+ */
+static void find_pkgs(struct cqm_pmu *pmu)
+{
+	int cpu, pkg, i, nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int seen[CQM_MAX_PKGS];
+	char path[128], buf[32];
+
+	pmu->nr_pkgs = 0;
+	for (cpu = 0; cpu < nr_cpus && pmu->nr_pkgs < CQM_MAX_PKGS; cpu++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/online", cpu);
+		if (!read_file(path, buf, sizeof(buf)) && buf[0] == '0')
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			 cpu);
+		if (read_file(path, buf, sizeof(buf)))
+			continue;
+		pkg = atoi(buf);
+
+		for (i = 0; i < pmu->nr_pkgs; i++)
+			if (seen[i] == pkg)
+				break;
+		if (i < pmu->nr_pkgs)
+			continue;
+
+		seen[pmu->nr_pkgs] = pkg;
+		pmu->pkg_cpu[pmu->nr_pkgs++] = cpu;
+	}
+}
+
+int cqm_pmu_init(struct cqm_pmu *pmu, bool avg)
+{
+	char name[64], buf[64];
+	unsigned long long config;
+	int i, ret;
+
+	memset(pmu, 0, sizeof(*pmu));
+
+	ret = read_pmu_file("type", buf, sizeof(buf));
+	if (ret)
+		return ret;
+	pmu->type = atoi(buf);
+
+	for (i = 0; i < CQM_NR_EV; i++) {
+		snprintf(name, sizeof(name), "events/%s", ev_names[avg][i]);
+		if (read_pmu_file(name, buf, sizeof(buf)) ||
+		    sscanf(buf, "event=%lli", (long long *)&config) != 1)
+			continue;
+
+		pmu->config[i] = config;
+		pmu->scale[i] = 1.0;
+		snprintf(name, sizeof(name), "events/%s.scale", ev_names[avg][i]);
+		if (!read_pmu_file(name, buf, sizeof(buf)))
+			pmu->scale[i] = strtod(buf, NULL);
+		pmu->have[i] = true;
+	}
+
+	if (!pmu->have[CQM_EV_OCCUP] && !pmu->have[CQM_EV_TOTAL])
+		return -ENOENT;
+
+	find_pkgs(pmu);
+	return pmu->nr_pkgs ? 0 : -ENODEV;
+}
+
+static int open_group(struct cqm_pmu *pmu, struct cqm_target *t, int pid,
+		      int cpu, unsigned long flags)
+{
+	struct perf_event_attr attr;
+	int i, fd, leader = -1, first = t->nr_all, n = 0;
+
+	for (i = 0; i < CQM_NR_EV; i++) {
+		if (!pmu->have[i])
+			continue;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pmu->type;
+		attr.config = pmu->config[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		fd = syscall(__NR_perf_event_open, &attr, pid, cpu, leader,
+			     flags);
+		if (fd < 0) {
+			fd = -errno;
+			while (t->nr_all > first)
+				close(t->all[--t->nr_all]);
+			return fd;
+		}
+
+		/* Siblings are read through the leader. */
+		if (leader < 0)
+			leader = fd;
+		t->all[t->nr_all++] = fd;
+		t->member[n++] = i;
+	}
+
+	t->nr_members = n;
+	return leader;
+}
+
+static void target_init(struct cqm_target *t, enum cqm_target_kind kind)
+{
+	memset(t, 0, sizeof(*t));
+	t->kind = kind;
+	t->cgroup_fd = -1;
+}
+
+int cqm_open_pid(struct cqm_pmu *pmu, struct cqm_target *t, pid_t pid)
+{
+	target_init(t, CQM_TARGET_PID);
+	t->pid = pid;
+	snprintf(t->name, sizeof(t->name), "%d", pid);
+
+	return cqm_add_task(pmu, t, pid);
+}
+
+int cqm_add_task(struct cqm_pmu *pmu, struct cqm_target *t, pid_t tid)
+{
+	int fd;
+
+	if (t->nr_fds == CQM_MAX_FDS)
+		return -ENOSPC;
+
+	fd = open_group(pmu, t, tid, -1, 0);
+	if (fd < 0)
+		return fd;
+
+	t->key[t->nr_fds] = tid;
+	t->running[t->nr_fds] = 0;
+	t->fd[t->nr_fds++] = fd;
+	return 0;
+}
+
+/*
+ * Every group has nr_members fds, in all[] in the order of fd[]; the
+ * last group takes the place of the one removed.
+ */
+void cqm_del_task(struct cqm_target *t, int i)
+{
+	int j, n = t->nr_members, last = t->nr_fds - 1;
+
+	for (j = 0; j < n; j++) {
+		close(t->all[i * n + j]);
+		t->all[i * n + j] = t->all[last * n + j];
+	}
+
+	t->fd[i] = t->fd[last];
+	t->key[i] = t->key[last];
+	t->running[i] = t->running[last];
+	t->nr_fds--;
+	t->nr_all -= n;
+}
+
+int cqm_open_cgroup(struct cqm_pmu *pmu, struct cqm_target *t,
+		    const char *path, const char *name)
+{
+	int i, fd;
+
+	target_init(t, CQM_TARGET_CGROUP);
+	snprintf(t->name, sizeof(t->name), "%s", name);
+
+	t->cgroup_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (t->cgroup_fd < 0)
+		return -errno;
+
+	for (i = 0; i < pmu->nr_pkgs; i++) {
+		fd = open_group(pmu, t, t->cgroup_fd, pmu->pkg_cpu[i],
+				PERF_FLAG_PID_CGROUP);
+		if (fd < 0) {
+			cqm_close(t);
+			return fd;
+		}
+		t->key[t->nr_fds] = pmu->pkg_cpu[i];
+		t->fd[t->nr_fds++] = fd;
+	}
+
+	return 0;
+}
+
+/*
+ * A cgroup conflicts with its ancestors and descendants in the driver,
+ * only one of them holds an RMID at a time. Tools walking a hierarchy
+ * monitor its leaves.
+ */
+bool cqm_cgroup_leaf(const char *path)
+{
+	struct dirent *de;
+	bool leaf = true;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return false;
+
+	while (leaf && (de = readdir(dir))) {
+		if (de->d_type == DT_DIR && strcmp(de->d_name, ".") &&
+		    strcmp(de->d_name, ".."))
+			leaf = false;
+	}
+	closedir(dir);
+	return leaf;
+}
+
+/*
+ * One read() per package for cgroups, one per thread for a pid. The
+ * first read of a group is stale only if it never had an RMID at all.
+ */
+int cqm_read(struct cqm_pmu *pmu, struct cqm_target *t,
+	     struct cqm_sample *s)
+{
+	uint64_t buf[1 + CQM_NR_EV];
+	double val;
+	ssize_t n;
+	int i, j;
+
+	memset(s, 0, sizeof(*s));
+
+	for (i = 0; i < t->nr_fds; i++) {
+		n = read(t->fd[i], buf, sizeof(buf));
+		if (n < 0)
+			return -errno;
+		if (n < (ssize_t)sizeof(uint64_t) ||
+		    buf[0] != (uint64_t)t->nr_members)
+			return -EIO;
+
+		for (j = 0; j < t->nr_members; j++) {
+			val = buf[1 + j] * pmu->scale[t->member[j]];
+			s->have[t->member[j]] = true;
+
+			switch (t->member[j]) {
+			case CQM_EV_OCCUP:
+				s->occupancy += val;
+				break;
+			case CQM_EV_TOTAL:
+				s->total_bw += val;
+				break;
+			case CQM_EV_LOCAL:
+				s->local_bw += val;
+				break;
+			case CQM_EV_RUNNING:
+				if (buf[1 + j] == t->running[i])
+					s->stale = true;
+				t->running[i] = buf[1 + j];
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	if (s->have[CQM_EV_TOTAL] && s->have[CQM_EV_LOCAL])
+		s->remote_bw = s->total_bw > s->local_bw ?
+			       s->total_bw - s->local_bw : 0;
+
+	return 0;
+}
+
+void cqm_close(struct cqm_target *t)
+{
+	int i;
+
+	for (i = 0; i < t->nr_all; i++)
+		close(t->all[i]);
+	t->nr_all = 0;
+	t->nr_fds = 0;
+
+	if (t->cgroup_fd >= 0)
+		close(t->cgroup_fd);
+	t->cgroup_fd = -1;
+}
@@ -0,0 +1,97 @@
+/*
+ * libcqm - open and read intel_cqm events for processes and cgroups.
+ *
+ * A target is one pid or one cgroup. Its events are opened as a single
+ * perf group (occupancy, total and local bandwidth) so that one read()
+ * returns all of them. Task events count every package from one fd;
+ * cgroup events need a cpu, and since the intel_cqm events are
+ * per-package, one fd on the first cpu of every package suffices.
+ * A task event only counts the one thread it was opened for, so a
+ * multi-threaded process needs a group per thread, see cqm_add_task().
+ *
+ * Values come back scaled by the PMU's .scale: occupancy in bytes,
+ * bandwidth in MB/sec (10^6 bytes).
+ *
+ * Where the PMU has rmid_time_running, it goes into the group as well.
+ * The driver holds the last values of a group while it has no RMID,
+ * i.e. while it is rotated out. A cgroup and its ancestors or
+ * descendants conflict and only ever get RMIDs in turn, so a daemon
+ * watching a whole hierarchy sees this all the time. A sample whose
+ * rmid_time_running did not advance since the previous read is marked
+ * stale.
+ */
+#ifndef _LIBCQM_H
+#define _LIBCQM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CQM_PMU_DIR	"/sys/bus/event_source/devices/intel_cqm"
+#define CQM_MAX_PKGS	64
+#define CQM_MAX_FDS	256	/* packages or threads per target */
+
+enum cqm_ev {
+	CQM_EV_OCCUP,
+	CQM_EV_TOTAL,
+	CQM_EV_LOCAL,
+	CQM_EV_RUNNING,
+	CQM_NR_EV,
+};
+
+struct cqm_pmu {
+	int		type;
+	bool		have[CQM_NR_EV];
+	uint64_t	config[CQM_NR_EV];
+	double		scale[CQM_NR_EV];
+	int		nr_pkgs;
+	int		pkg_cpu[CQM_MAX_PKGS];
+};
+
+enum cqm_target_kind {
+	CQM_TARGET_PID,
+	CQM_TARGET_CGROUP,
+};
+
+struct cqm_target {
+	enum cqm_target_kind	kind;
+	char			name[256];
+	pid_t			pid;
+	int			cgroup_fd;
+	int			nr_fds;
+	int			fd[CQM_MAX_FDS];	/* group leaders */
+	int			key[CQM_MAX_FDS];	/* their tid or cpu */
+	int			nr_all;
+	int			all[CQM_MAX_FDS * CQM_NR_EV];
+	int			nr_members;
+	enum cqm_ev		member[CQM_NR_EV];
+	uint64_t		running[CQM_MAX_FDS];	/* at the last read */
+	void			*priv;
+};
+
+struct cqm_sample {
+	double		occupancy;	/* bytes */
+	double		total_bw;	/* MB/sec */
+	double		local_bw;
+	double		remote_bw;	/* total - local */
+	bool		stale;		/* no RMID since the last read */
+	bool		have[CQM_NR_EV];
+};
+
+/*
+ * @avg picks avg_total_bw/avg_local_bw over total_bw/local_bw.
+ * Returns 0 or -errno.
+ */
+int cqm_pmu_init(struct cqm_pmu *pmu, bool avg);
+
+int cqm_open_pid(struct cqm_pmu *pmu, struct cqm_target *t, pid_t pid);
+int cqm_add_task(struct cqm_pmu *pmu, struct cqm_target *t, pid_t tid);
+void cqm_del_task(struct cqm_target *t, int i);
+int cqm_open_cgroup(struct cqm_pmu *pmu, struct cqm_target *t,
+		    const char *path, const char *name);
+bool cqm_cgroup_leaf(const char *path);
+int cqm_read(struct cqm_pmu *pmu, struct cqm_target *t,
+	     struct cqm_sample *s);
+void cqm_close(struct cqm_target *t);
+
+#endif /* _LIBCQM_H */
@@ -0,0 +1,585 @@
+/*
+ * mbmtop - processes and cgroups by memory bandwidth and LLC occupancy.
+ *
+ *   gcc -O2 -o mbmtop mbmtop.c libcqm.c
+ *
+ *   mbmtop [-i ms] [-s total|local|remote|occup] [-n rows] [-p]
+ *          [-c cgroup root] [-a] [-b] [-N iterations]
+ *
+ * Shows processes, or with -c the leaf cgroups below the root (and with
+ * -p as well processes), sorted by the chosen column. Inner cgroups are
+ * left out since the driver gives them RMIDs only in turn with their
+ * descendants. Keys t, l, r and o
+ * change the sort order, q quits. -b prints plain refreshes one after
+ * the other, for logging; -N stops after that many.
+ *
+ * RMIDs are few, so only processes that used cpu time since the last
+ * refresh get events, and they lose them again after IDLE_REFRESHES
+ * refreshes without. Events are kept across refreshes and read with
+ * one group read() per thread or package; a process or cgroup shows
+ * up from its second refresh on, when its first interval is complete.
+ *
+ * A row marked * had no RMID since the last refresh (see libcqm.h): it
+ * was rotated out, e.g. because a process in a monitored cgroup
+ * conflicts with the cgroup's events, and shows the values it held.
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "libcqm.h"
+
+#define IDLE_REFRESHES	10
+#define CGROUP_RESCAN	5
+#define HASH_SIZE	1024
+
+enum sort_key { SORT_TOTAL, SORT_LOCAL, SORT_REMOTE, SORT_OCCUP };
+
+static const char * const sort_name[] = {
+	"total", "local", "remote", "occup",
+};
+
+struct row {
+	struct row		*next;		/* hash chain */
+	struct cqm_target	t;
+	struct cqm_sample	s;
+	bool			cgroup;
+	bool			open;
+	bool			failed;
+	bool			fresh;		/* opened this refresh */
+	int			seen;
+	int			idle;
+	pid_t			pid;
+	unsigned long long	ticks;
+	char			comm[32];
+	char			path[512];
+};
+
+static struct cqm_pmu pmu;
+static struct row *hash[HASH_SIZE];
+static int generation;
+static unsigned int nr_procs, nr_open;
+
+static struct row **rows;
+static unsigned int nr_rows, rows_size;
+
+static const char *cg_root;
+static size_t cg_root_len;
+
+static enum sort_key sort_key = SORT_TOTAL;
+static bool batch;
+
+static struct termios saved_tio;
+static bool tio_saved;
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static void restore_tty(void)
+{
+	if (tio_saved)
+		tcsetattr(STDIN_FILENO, TCSANOW, &saved_tio);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int hash_str(const char *s)
+{
+	unsigned int h = 5381;
+
+	while (*s)
+		h = h * 33 + *s++;
+	return h % HASH_SIZE;
+}
+
+/*
+ * Processes are hashed by pid, cgroups by path.
+ */
+static struct row *lookup(pid_t pid, const char *path, bool create)
+{
+	unsigned int h = path ? hash_str(path) : (unsigned int)pid % HASH_SIZE;
+	struct row *r;
+
+	for (r = hash[h]; r; r = r->next) {
+		if (path ? (r->cgroup && !strcmp(r->path, path)) :
+			   (!r->cgroup && r->pid == pid))
+			return r;
+	}
+
+	if (!create)
+		return NULL;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->pid = pid;
+	if (path) {
+		r->cgroup = true;
+		snprintf(r->path, sizeof(r->path), "%s", path);
+	}
+	r->next = hash[h];
+	hash[h] = r;
+	return r;
+}
+
+static void close_row(struct row *r)
+{
+	if (!r->open)
+		return;
+
+	cqm_close(&r->t);
+	r->open = false;
+	nr_open--;
+}
+
+static void open_row(struct row *r)
+{
+	int ret;
+
+	if (r->cgroup)
+		ret = cqm_open_cgroup(&pmu, &r->t, r->path,
+				      r->path[cg_root_len] ?
+				      r->path + cg_root_len : "/");
+	else
+		ret = cqm_open_pid(&pmu, &r->t, r->pid);
+
+	/* Permissions don't change, don't try again. */
+	if (ret) {
+		r->failed = true;
+		return;
+	}
+
+	r->open = true;
+	r->fresh = true;
+	nr_open++;
+}
+
+/*
+ * Give every thread of a monitored process its group, and drop the
+ * groups of threads that are gone.
+ */
+static void sync_threads(struct row *r)
+{
+	pid_t tids[CQM_MAX_FDS];
+	int nr = 0, i, j;
+	struct dirent *de;
+	char path[64];
+	DIR *d;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", r->pid);
+	d = opendir(path);
+	if (!d)
+		return;
+
+	while ((de = readdir(d)) && nr < CQM_MAX_FDS) {
+		if (isdigit(de->d_name[0]))
+			tids[nr++] = atoi(de->d_name);
+	}
+	closedir(d);
+
+	for (i = r->t.nr_fds - 1; i >= 0; i--) {
+		for (j = 0; j < nr; j++)
+			if (tids[j] == r->t.key[i])
+				break;
+		if (j == nr)
+			cqm_del_task(&r->t, i);
+	}
+
+	for (j = 0; j < nr; j++) {
+		for (i = 0; i < r->t.nr_fds; i++)
+			if (tids[j] == r->t.key[i])
+				break;
+		if (i == r->t.nr_fds)
+			cqm_add_task(&pmu, &r->t, tids[j]);
+	}
+}
+
+/*
+ * comm and utime + stime from /proc/<pid>/stat.
+ */
+static int read_stat(pid_t pid, char *comm, size_t len,
+		     unsigned long long *ticks)
+{
+	unsigned long long utime, stime;
+	char path[64], buf[1024], *s, *e;
+	ssize_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+
+	/* comm may contain anything, including ") " */
+	s = strchr(buf, '(');
+	e = strrchr(buf, ')');
+	if (!s || !e || e < s)
+		return -1;
+	snprintf(comm, len, "%.*s", (int)(e - s - 1), s + 1);
+
+	/* state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime */
+	if (sscanf(e + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+		   &utime, &stime) != 2)
+		return -1;
+
+	*ticks = utime + stime;
+	return 0;
+}
+
+static void scan_procs(void)
+{
+	unsigned long long ticks;
+	struct dirent *de;
+	char comm[32];
+	struct row *r;
+	bool busy;
+	pid_t pid;
+	DIR *d;
+
+	d = opendir("/proc");
+	if (!d)
+		return;
+
+	nr_procs = 0;
+	while ((de = readdir(d))) {
+		if (!isdigit(de->d_name[0]))
+			continue;
+		pid = atoi(de->d_name);
+		if (read_stat(pid, comm, sizeof(comm), &ticks))
+			continue;
+		nr_procs++;
+
+		r = lookup(pid, NULL, true);
+		if (!r)
+			continue;
+
+		/* A new process has no previous ticks to compare with. */
+		busy = r->seen && ticks != r->ticks;
+		r->seen = generation;
+		r->ticks = ticks;
+		snprintf(r->comm, sizeof(r->comm), "%s", comm);
+
+		if (busy)
+			r->idle = 0;
+		else
+			r->idle++;
+
+		if (r->open && r->idle > IDLE_REFRESHES)
+			close_row(r);
+		else if (!r->open && busy && !r->failed)
+			open_row(r);
+
+		if (r->open)
+			sync_threads(r);
+	}
+	closedir(d);
+}
+
+static int scan_one(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	struct row *r;
+
+	if (flag != FTW_D || !cqm_cgroup_leaf(path))
+		return 0;
+
+	r = lookup(0, path, true);
+	if (!r)
+		return 0;
+
+	r->seen = generation;
+	if (!r->open && !r->failed)
+		open_row(r);
+	return 0;
+}
+
+/*
+ * Free what is gone, and collect what is monitored into rows[].
+ */
+static void sweep(bool cgroups_scanned)
+{
+	struct row *r, **pr;
+	unsigned int h;
+
+	nr_rows = 0;
+	for (h = 0; h < HASH_SIZE; h++) {
+		for (pr = &hash[h]; (r = *pr); ) {
+			if (r->seen != generation &&
+			    (!r->cgroup || cgroups_scanned)) {
+				close_row(r);
+				*pr = r->next;
+				free(r);
+				continue;
+			}
+			/* Not rescanned, still there. */
+			r->seen = generation;
+			pr = &r->next;
+
+			if (!r->open)
+				continue;
+
+			if (nr_rows == rows_size) {
+				rows_size = rows_size ? rows_size * 2 : 256;
+				rows = realloc(rows, rows_size * sizeof(*rows));
+				if (!rows) {
+					perror("realloc");
+					exit(1);
+				}
+			}
+			rows[nr_rows++] = r;
+		}
+	}
+}
+
+static double key_of(const struct row *r)
+{
+	switch (sort_key) {
+	case SORT_LOCAL:
+		return r->s.local_bw;
+	case SORT_REMOTE:
+		return r->s.remote_bw;
+	case SORT_OCCUP:
+		return r->s.occupancy;
+	default:
+		return r->s.total_bw;
+	}
+}
+
+static int cmp_rows(const void *a, const void *b)
+{
+	double ka = key_of(*(struct row **)a), kb = key_of(*(struct row **)b);
+
+	return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static void refresh(bool procs, unsigned int interval, unsigned int max_rows)
+{
+	unsigned int i, shown, nr_cgroups = 0, nr_stale = 0;
+	struct winsize ws;
+	bool rescanned = false;
+	uint64_t t0, t_read;
+	struct row *r;
+
+	generation++;
+	if (procs)
+		scan_procs();
+	if (cg_root && !((generation - 1) % CGROUP_RESCAN)) {
+		nftw(cg_root, scan_one, 16, FTW_PHYS);
+		rescanned = true;
+	}
+	sweep(rescanned);
+
+	t0 = now_ns();
+	for (i = 0; i < nr_rows; i++) {
+		r = rows[i];
+		if (cqm_read(&pmu, &r->t, &r->s))
+			memset(&r->s, 0, sizeof(r->s));
+		nr_cgroups += r->cgroup;
+		nr_stale += r->s.stale;
+	}
+	t_read = now_ns() - t0;
+
+	qsort(rows, nr_rows, sizeof(*rows), cmp_rows);
+
+	if (!max_rows) {
+		max_rows = 20;
+		if (!batch && !ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) &&
+		    ws.ws_row > 4)
+			max_rows = ws.ws_row - 4;
+	}
+
+	if (!batch)
+		printf("\033[H\033[2J");
+	printf("mbmtop - %u procs, %u monitored, %u cgroups, %u stale (*), "
+	       "sort %s, every %.1fs, read %lluus\n\n", nr_procs,
+	       nr_open - nr_cgroups, nr_cgroups, nr_stale,
+	       sort_name[sort_key], interval / 1000.0,
+	       (unsigned long long)(t_read / 1000));
+	printf("%8s %-24s %4s %10s %10s %10s %10s\n", "PID", "COMM/CGROUP",
+	       "THR", "LLC_MB", "TOTAL_MBs", "LOCAL_MBs", "REMOTE_MBs");
+
+	for (i = shown = 0; i < nr_rows && shown < max_rows; i++) {
+		r = rows[i];
+		if (r->fresh) {
+			r->fresh = false;
+			continue;
+		}
+
+		if (r->cgroup) {
+			size_t len = strlen(r->t.name);
+
+			printf("%8s %-24s %4s", "cgroup", len > 24 ?
+			       r->t.name + len - 24 : r->t.name, "");
+		} else {
+			printf("%8d %-24.24s %4d", r->pid, r->comm,
+			       r->t.nr_fds);
+		}
+		printf(" %10.1f %10.0f %10.0f %10.0f%s\n",
+		       r->s.occupancy / 1e6, r->s.total_bw, r->s.local_bw,
+		       r->s.remote_bw, r->s.stale ? " *" : "");
+		shown++;
+	}
+
+	/* Don't leave those for later, they'd show too early. */
+	for (; i < nr_rows; i++)
+		rows[i]->fresh = false;
+
+	if (batch)
+		printf("\n");
+	fflush(stdout);
+}
+
+/*
+ * Wait out @ms, handling keys on the way. Returns false on quit.
+ */
+static bool wait_keys(unsigned int ms)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	uint64_t end = now_ns() + ms * 1000000ULL, now;
+	char c;
+
+	while (!done && (now = now_ns()) < end) {
+		if (poll(&pfd, !batch, (end - now) / 1000000 + 1) <= 0)
+			continue;
+		if (read(STDIN_FILENO, &c, 1) != 1)
+			continue;
+
+		switch (c) {
+		case 'q':
+			return false;
+		case 't':
+			sort_key = SORT_TOTAL;
+			return true;
+		case 'l':
+			sort_key = SORT_LOCAL;
+			return true;
+		case 'r':
+			sort_key = SORT_REMOTE;
+			return true;
+		case 'o':
+			sort_key = SORT_OCCUP;
+			return true;
+		}
+	}
+
+	return !done;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: mbmtop [-i ms] [-s total|local|remote|occup] [-n rows] [-p]\n"
+		"              [-c cgroup root] [-a] [-b] [-N iterations]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int interval = 2000, max_rows = 0, iterations = 0, n;
+	bool procs = false, avg = false;
+	struct termios tio;
+	int opt, ret, i;
+
+	while ((opt = getopt(argc, argv, "i:s:n:pc:abN:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			for (i = 0; i <= SORT_OCCUP; i++)
+				if (!strcmp(optarg, sort_name[i]))
+					break;
+			if (i > SORT_OCCUP)
+				usage();
+			sort_key = i;
+			break;
+		case 'n':
+			max_rows = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			procs = true;
+			break;
+		case 'c':
+			cg_root = optarg;
+			cg_root_len = strlen(cg_root);
+			while (cg_root_len > 1 && cg_root[cg_root_len - 1] == '/')
+				cg_root_len--;
+			break;
+		case 'a':
+			avg = true;
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'N':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!interval || optind != argc)
+		usage();
+	if (!cg_root)
+		procs = true;
+
+	ret = cqm_pmu_init(&pmu, avg);
+	if (ret) {
+		fprintf(stderr, "mbmtop: intel_cqm PMU: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	if (!isatty(STDIN_FILENO))
+		batch = true;
+
+	if (!batch && !tcgetattr(STDIN_FILENO, &saved_tio)) {
+		tio_saved = true;
+		atexit(restore_tty);
+		tio = saved_tio;
+		tio.c_lflag &= ~(ICANON | ECHO);
+		tio.c_cc[VMIN] = 0;
+		tio.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSANOW, &tio);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (n = 0; !done; n++) {
+		refresh(procs, interval, max_rows);
+		if (iterations && n + 1 >= iterations)
+			break;
+		if (!wait_keys(interval))
+			break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM intel_cqm
+
+#if !defined(_TRACE_INTEL_CQM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_INTEL_CQM_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * RMID life cycle: allocated from the free lru, queued on the limbo
+ * lru, found dirty while in limbo, and returned to the free lru (or
+ * handed straight to a waiting group).
+ */
+DECLARE_EVENT_CLASS(cqm_rmid,
+
+	TP_PROTO(u32 rmid),
+
+	TP_ARGS(rmid),
+
+	TP_STRUCT__entry(
+		__field(u32,	rmid)
+	),
+
+	TP_fast_assign(
+		__entry->rmid	= rmid;
+	),
+
+	TP_printk("rmid=%u", __entry->rmid)
+);
+
+DEFINE_EVENT(cqm_rmid, cqm_rmid_alloc,
+	TP_PROTO(u32 rmid),
+	TP_ARGS(rmid)
+);
+
+DEFINE_EVENT(cqm_rmid, cqm_rmid_limbo,
+	TP_PROTO(u32 rmid),
+	TP_ARGS(rmid)
+);
+
+DEFINE_EVENT(cqm_rmid, cqm_rmid_dirty,
+	TP_PROTO(u32 rmid),
+	TP_ARGS(rmid)
+);
+
+DEFINE_EVENT(cqm_rmid, cqm_rmid_free,
+	TP_PROTO(u32 rmid),
+	TP_ARGS(rmid)
+);
+
+/*
+ * __intel_cqm_rmid_rotate() took @old_rmid away from the group at the
+ * head of cache_groups and gave @new_rmid to the first group without
+ * one.
+ */
+TRACE_EVENT(cqm_rotate,
+
+	TP_PROTO(u32 old_rmid, u32 new_rmid, unsigned int nr_needed,
+		 unsigned int threshold),
+
+	TP_ARGS(old_rmid, new_rmid, nr_needed, threshold),
+
+	TP_STRUCT__entry(
+		__field(u32,		old_rmid)
+		__field(u32,		new_rmid)
+		__field(unsigned int,	nr_needed)
+		__field(unsigned int,	threshold)
+	),
+
+	TP_fast_assign(
+		__entry->old_rmid	= old_rmid;
+		__entry->new_rmid	= new_rmid;
+		__entry->nr_needed	= nr_needed;
+		__entry->threshold	= threshold;
+	),
+
+	TP_printk("old_rmid=%u new_rmid=%u nr_needed=%u threshold=%u",
+		  __entry->old_rmid, __entry->new_rmid,
+		  __entry->nr_needed, __entry->threshold)
+);
+
+/*
+ * Stabilization is stuck, the recycle threshold was raised.
+ */
+TRACE_EVENT(cqm_threshold,
+
+	TP_PROTO(unsigned int threshold, unsigned int nr_available),
+
+	TP_ARGS(threshold, nr_available),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	threshold)
+		__field(unsigned int,	nr_available)
+	),
+
+	TP_fast_assign(
+		__entry->threshold	= threshold;
+		__entry->nr_available	= nr_available;
+	),
+
+	TP_printk("threshold=%u nr_available=%u",
+		  __entry->threshold, __entry->nr_available)
+);
+
+TRACE_EVENT(mbm_overflow,
+
+	TP_PROTO(u32 rmid, u32 evt_type, u64 prev, u64 cur),
+
+	TP_ARGS(rmid, evt_type, prev, cur),
+
+	TP_STRUCT__entry(
+		__field(u32,	rmid)
+		__field(u32,	evt_type)
+		__field(u64,	prev)
+		__field(u64,	cur)
+	),
+
+	TP_fast_assign(
+		__entry->rmid		= rmid;
+		__entry->evt_type	= evt_type;
+		__entry->prev		= prev;
+		__entry->cur		= cur;
+	),
+
+	TP_printk("rmid=%u evt_type=%u prev=%llu cur=%llu",
+		  __entry->rmid, __entry->evt_type,
+		  __entry->prev, __entry->cur)
+);
+
+/*
+ * An MBM counter read was either accepted (accepted=1), bw being the
+ * rate since the previous read, or discarded because it came too early
+ * or too late. diff_time is in ns.
+ */
+TRACE_EVENT(mbm_sample,
+
+	TP_PROTO(u32 rmid, u32 evt_type, u64 diff_time, u64 bw, u64 avg,
+		 bool accepted),
+
+	TP_ARGS(rmid, evt_type, diff_time, bw, avg, accepted),
+
+	TP_STRUCT__entry(
+		__field(u32,	rmid)
+		__field(u32,	evt_type)
+		__field(u64,	diff_time)
+		__field(u64,	bw)
+		__field(u64,	avg)
+		__field(bool,	accepted)
+	),
+
+	TP_fast_assign(
+		__entry->rmid		= rmid;
+		__entry->evt_type	= evt_type;
+		__entry->diff_time	= diff_time;
+		__entry->bw		= bw;
+		__entry->avg		= avg;
+		__entry->accepted	= accepted;
+	),
+
+	TP_printk("rmid=%u evt_type=%u diff_time=%lluns bw=%llu avg=%llu accepted=%d",
+		  __entry->rmid, __entry->evt_type, __entry->diff_time,
+		  __entry->bw, __entry->avg, __entry->accepted)
+);
+
+/*
+ * Synchronous IPI to the per-package readers in cqm_cpumask.
+ */
+TRACE_EVENT(cqm_ipi,
+
+	TP_PROTO(void *func, unsigned int nr_cpus),
+
+	TP_ARGS(func, nr_cpus),
+
+	TP_STRUCT__entry(
+		__field(void *,		func)
+		__field(unsigned int,	nr_cpus)
+	),
+
+	TP_fast_assign(
+		__entry->func		= func;
+		__entry->nr_cpus	= nr_cpus;
+	),
+
+	TP_printk("func=%pf nr_cpus=%u", __entry->func, __entry->nr_cpus)
+);
+
+#endif /* _TRACE_INTEL_CQM_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH asm/trace/
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE intel_cqm
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -6,12 +6,19 @@
 
 #include <linux/perf_event.h>
 #include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/rbtree.h>
+#include <linux/tick.h>
 #include <asm/cpu_device_id.h>
 #include "perf_event.h"
 
+#define CREATE_TRACE_POINTS
+#include <asm/trace/intel_cqm.h>
+
 #define MSR_IA32_PQR_ASSOC	0x0c8f
 #define MSR_IA32_QM_CTR		0x0c8e
 #define MSR_IA32_QM_EVTSEL	0x0c8d
+#define MSR_RMID_SNC_CONFIG	0x0ca0
 
 /*
  * MBM Counter is 24bits wide. MBM_CNTR_MAX defines max counter
@@ -29,10 +36,30 @@
 #define MBM_TIME_DELTA_EXP	1000
 
 /*
- *  Minimum time interval in ms between consecutive MSR reads for a given rmid
+ *  Minimum time interval in ms between consecutive sliding window samples
+ *  for a given rmid
  */
 #define MBM_TIME_DELTA_MIN	(100 * MAX_MBM_EVENT_TYPES)
 
+/*
+ * Minimum time interval in ns between consecutive MSR reads for a given
+ * rmid; closer reads return the previous bandwidth.
+ */
+#define MBM_READ_DELTA_MIN_NS	(10 * NSEC_PER_MSEC)
+
+/*
+ * local_ratio is local/total bandwidth in units of 1/MBM_RATIO_SCALE,
+ * i.e. in hundredths of a percent.
+ */
+#define MBM_RATIO_SCALE		10000
+
+/*
+ * bw_per_occupancy is total bandwidth over LLC occupancy, i.e. how often
+ * per second the footprint is refilled from memory, in units of
+ * 1/MBM_BW_OCC_SCALE.
+ */
+#define MBM_BW_OCC_SCALE	1000
+
 /*
  * Minimum size for sliding window i.e. the minimum monitoring period for
  * application(s). This fifo_size can be used for short duration monitoring
@@ -56,7 +83,26 @@ static u32 mbm_window_size = MBM_FIFO_SIZE_MIN;
 static u32 cqm_max_rmid = -1;
 static unsigned int cqm_l3_scale; /* supposedly cacheline size */
 static bool cqm_llc_occ, is_mbm;
-static u16  mbm_socket_max;
+
+/*
+ * Sub-NUMA Clustering (SNC) splits a package into cqm_snc_ways NUMA
+ * nodes, each with its own slice of the L3 and of the RMIDs. The
+ * hardware RMID that counts for logical RMID r on a node is then
+ * r + (node % cqm_snc_ways) * (cqm_max_rmid + 1), the per-cpu
+ * cqm_rmid_offset; PQR_ASSOC keeps taking the logical RMID.
+ *
+ * Without SNC a monitoring domain is a package, with it a node.
+ */
+static unsigned int cqm_snc_ways = 1;
+static DEFINE_PER_CPU(u32, cqm_rmid_offset);
+
+static inline int cqm_domain_id(int cpu)
+{
+	if (cqm_snc_ways > 1)
+		return cpu_to_node(cpu);
+
+	return topology_physical_package_id(cpu);
+}
 
 /**
  * struct intel_pqr_state - State cache for the PQR MSR
@@ -86,6 +132,144 @@ struct intel_pqr_state {
 static DEFINE_PER_CPU(struct intel_pqr_state, pqr_state);
 static DEFINE_PER_CPU(struct mbm_pmu *, mbm_pmu);
 
+/*
+ * Set while this cpu refreshes an event's perf mmap user page, see
+ * intel_cqm_event_publish().
+ */
+static DEFINE_PER_CPU(bool, cqm_userpage_update);
+
+/*
+ * Runtime statistics of the monitoring engine itself, exported through
+ * the "stats" attribute group of the intel_cqm PMU device. Counters are
+ * per cpu so that incrementing them from the hrtimer, IPI and
+ * context-switch paths stays cheap; readers sum over all cpus.
+ */
+enum cqm_stat_item {
+	CQM_STAT_MSR_READ,
+	CQM_STAT_MSR_WRITE,
+	CQM_STAT_IPI_SWEEP,
+	CQM_STAT_HRTIMER,
+	CQM_STAT_MBM_OVERFLOW,
+	CQM_STAT_MBM_THROTTLED,
+	CQM_STAT_MBM_LATE,
+	CQM_STAT_ROTATE,
+	CQM_STAT_RMID_EXHAUSTED,
+	NR_CQM_STATS,
+};
+
+struct cqm_stats {
+	unsigned long stat[NR_CQM_STATS];
+};
+
+static DEFINE_PER_CPU(struct cqm_stats, cqm_stats);
+
+static inline void cqm_stat_inc(enum cqm_stat_item item)
+{
+	this_cpu_inc(cqm_stats.stat[item]);
+}
+
+static unsigned long cqm_stat_sum(enum cqm_stat_item item)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(cqm_stats, cpu).stat[item];
+
+	return sum;
+}
+
+/*
+ * Log2 latency histograms, in nanoseconds, for:
+ *
+ *   CQM_LAT_COUNTER_READ	one EVTSEL/CTR MSR pair
+ *   CQM_LAT_IPI		one package reader, from the initiator sending
+ *				the IPI until the reader finished its work
+ *   CQM_LAT_COUNT		a full cross-package intel_cqm_event_count()
+ *   CQM_LAT_ROTATE		one pass of the rotation worker
+ *
+ * Bucket i counts latencies in [2^(i-1), 2^i) ns, the last bucket
+ * everything above. Timestamping is patched out by cqm_lat_key unless
+ * enabled through the "latency/enable" attribute.
+ */
+enum cqm_lat_item {
+	CQM_LAT_COUNTER_READ,
+	CQM_LAT_IPI,
+	CQM_LAT_COUNT,
+	CQM_LAT_ROTATE,
+	NR_CQM_LAT,
+};
+
+#define CQM_LAT_BUCKETS		32
+
+struct cqm_lat_hist {
+	unsigned long bucket[NR_CQM_LAT][CQM_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct cqm_lat_hist, cqm_lat_hist);
+static DEFINE_STATIC_KEY_FALSE(cqm_lat_key);
+
+static inline u64 cqm_lat_start(void)
+{
+	if (static_branch_unlikely(&cqm_lat_key))
+		return ktime_get_ns();
+
+	return 0;
+}
+
+static inline void cqm_lat_record(enum cqm_lat_item item, u64 start)
+{
+	u64 delta;
+
+	/* Histograms got enabled half way through the operation? */
+	if (!static_branch_unlikely(&cqm_lat_key) || !start)
+		return;
+
+	delta = ktime_get_ns() - start;
+	this_cpu_inc(cqm_lat_hist.bucket[item]
+		     [min_t(int, fls64(delta), CQM_LAT_BUCKETS - 1)]);
+}
+
+/*
+ * All accesses to the QoS MSRs go through these so they get counted.
+ */
+static inline void cqm_wrmsr(unsigned int msr, u32 low, u32 high)
+{
+	cqm_stat_inc(CQM_STAT_MSR_WRITE);
+	wrmsr(msr, low, high);
+}
+
+static inline void cqm_wrmsrl(unsigned int msr, u64 val)
+{
+	cqm_stat_inc(CQM_STAT_MSR_WRITE);
+	wrmsrl(msr, val);
+}
+
+static inline u64 cqm_rdmsrl(unsigned int msr)
+{
+	u64 val;
+
+	cqm_stat_inc(CQM_STAT_MSR_READ);
+	rdmsrl(msr, val);
+
+	return val;
+}
+
+/*
+ * Read the counter for @eventid of @rmid in this domain.
+ */
+static u64 cqm_read_counter(u32 eventid, u32 rmid)
+{
+	u64 val, start = cqm_lat_start();
+
+	rmid += __this_cpu_read(cqm_rmid_offset);
+	cqm_wrmsr(MSR_IA32_QM_EVTSEL, eventid, rmid);
+	val = cqm_rdmsrl(MSR_IA32_QM_CTR);
+	cqm_lat_record(CQM_LAT_COUNTER_READ, start);
+
+	return val;
+}
+
 /**
  * struct mbm_pmu - mbm events per cpu
  * @n_active:       number of active events for this pmu
@@ -108,7 +292,11 @@ struct mbm_pmu {
  * struct sample - mbm event's (local or total) data
  * @bytes:         previous MSR value
  * @runavg:        running average of memory bandwidth
- * @prev_time:     time stamp of previous sample i.e. {bytes, runavg}
+ * @prev_time:     ktime_get_ns() of the previous MSR read, 0 if none
+ * @curbw:         bandwidth between the last two MSR reads
+ * @count:         counter increments since the first read, unwrapped
+ * @win_count:     @count at the last sliding window sample
+ * @win_time:      ktime_get_ns() of the last sliding window sample
  * @index:         current sample number
  * @fifoin:        sliding window counter to store the sample
  * @fifoout:       start of the sliding window to calculate  bandwidh sum
@@ -116,38 +304,55 @@ struct mbm_pmu {
 struct sample {
 	u64 bytes;
 	u64 runavg;
-	ktime_t prev_time;
+	u64 prev_time;
+	u64 curbw;
+	u64 count;
+	u64 win_count;
+	u64 win_time;
 	u64 index;
 	u32 mbmfifo[MBM_FIFO_SIZE_MAX];
 	u32  fifoin;
 	u32  fifoout;
 };
 
-/*
- * samples profiled for total memory bandwidth type events
+/**
+ * struct mbm_pkg - mbm samples of one package
+ * @local:	samples profiled for local memory bandwidth, by rmid
+ * @total:	samples profiled for total memory bandwidth, by rmid
+ * @mba:	the MBA controller's own samples, by rmid
  */
-static struct sample *mbm_total;
+struct mbm_pkg {
+	struct sample		*local;
+	struct sample		*total;
+	struct mba_sample	*mba;
+};
 
 /*
- * samples profiled for local memory bandwidth type events
+ * Packages get a compact logical index in the order their first cpu
+ * comes online; cqm_pkg_domain[] maps it back to cqm_domain_id(), so
+ * with SNC every node is a "package" of its own here. Only the first
+ * cqm_nr_pkgs entries of mbm_pkgs[] are populated, so the samples are
+ * sized to the packages that are actually present rather than to the
+ * largest physical package id.
+ *
+ * CPU_STARTING cannot sleep, so CPU_UP_PREPARE makes sure mbm_pkg_spare
+ * is there for a hot-added package to take.
  */
-static struct sample *mbm_local;
+static int *cqm_pkg_domain;
+static unsigned int cqm_nr_pkgs;
+static struct mbm_pkg **mbm_pkgs;
+static struct mbm_pkg *mbm_pkg_spare;
+static DEFINE_PER_CPU(int, cqm_pkg_idx);
 
-#define pkg_id	topology_physical_package_id(smp_processor_id())
-/*
- * rmid_2_index returns the index for the rmid in mbm_local/mbm_total array.
- * mbm_total[] and mbm_local[] are linearly indexed by core# * max number of
- * rmids per socket, an example is given below
- * RMID1 of Socket0:  vrmid  = 1
- * RMID1 of Socket1:  vrmid =  1 * cqm_max_rmid + 1
- * RMID1 of Socket2:  vrmid =  2 * cqm_max_rmid + 1
- */
-#define rmid_2_index(rmid)  (pkg_id * cqm_max_rmid + rmid)
+static inline struct mbm_pkg *this_mbm_pkg(void)
+{
+	return mbm_pkgs[__this_cpu_read(cqm_pkg_idx)];
+}
 
 static enum hrtimer_restart mbm_hrtimer_handle(struct hrtimer *hrtimer);
 
 /*
- * Protects cache_cgroups and cqm_rmid_free_lru and cqm_rmid_limbo_lru.
+ * Protects cache_cgroups and cqm_rmid_free_lru and cqm_limbo_wheel.
  * Also protects event->hw.cqm_rmid
  *
  * Hold either for stability, both for modification of ->hw.cqm_rmid.
@@ -165,6 +370,48 @@ static LIST_HEAD(cache_groups);
  */
 static cpumask_t cqm_cpumask;
 
+/*
+ * A cqm_on_each_reader() call with the IPI latency being recorded:
+ * every reader records the time from the sweep's start to its own
+ * completion.
+ */
+struct cqm_ipi_call {
+	smp_call_func_t	func;
+	void		*info;
+	u64		start;
+};
+
+static void __cqm_ipi_call(void *arg)
+{
+	struct cqm_ipi_call *call = arg;
+
+	call->func(call->info);
+	cqm_lat_record(CQM_LAT_IPI, call->start);
+}
+
+/*
+ * Run @func on the reader cpu of every package and wait for it to
+ * complete everywhere.
+ */
+static void cqm_on_each_reader(smp_call_func_t func, void *info)
+{
+	struct cqm_ipi_call call = {
+		.func	= func,
+		.info	= info,
+		.start	= cqm_lat_start(),
+	};
+
+	if (trace_cqm_ipi_enabled())
+		trace_cqm_ipi(func, cpumask_weight(&cqm_cpumask));
+
+	cqm_stat_inc(CQM_STAT_IPI_SWEEP);
+
+	if (call.start)
+		on_each_cpu_mask(&cqm_cpumask, __cqm_ipi_call, &call, 1);
+	else
+		on_each_cpu_mask(&cqm_cpumask, func, info, 1);
+}
+
 #define RMID_VAL_ERROR		(1ULL << 63)
 #define RMID_VAL_UNAVAIL	(1ULL << 62)
 
@@ -178,11 +425,70 @@ enum mbm_evt_type {
 	QOS_MBM_LOCAL_EVENT_ID,
 	QOS_MBM_TOTAL_AVG_EVENT_ID,
 	QOS_MBM_LOCAL_AVG_EVENT_ID,
+	/*
+	 * Derived from the total and local counters and, for
+	 * bw_per_occupancy, llc_occupancy, see mbm_read_event(); never
+	 * programmed into EVTSEL.
+	 */
+	QOS_MBM_REMOTE_EVENT_ID,
+	QOS_MBM_REMOTE_AVG_EVENT_ID,
+	QOS_MBM_LOCAL_RATIO_EVENT_ID,
+	QOS_MBM_BW_PER_OCCUP_EVENT_ID,
+	QOS_MBM_MISS_RATE_EVENT_ID,
 };
 
 #define QOS_MBM_AVG_EVENT_MASK 0x04
 #define QOS_MBM_LOCAL_EVENT_MASK 0x01
 
+/*
+ * Not hardware events: how long the event's cache group has existed
+ * (enabled) and how much of that it held an RMID (running), in ns.
+ * Opened next to llc_occupancy or an MBM event on the same target they
+ * give the share of time the values were actually measured.
+ */
+#define QOS_RMID_ENABLED_EVENT_ID	0x10
+#define QOS_RMID_RUNNING_EVENT_ID	0x11
+
+static inline bool cqm_mux_event(struct perf_event *event)
+{
+	return event->attr.config == QOS_RMID_ENABLED_EVENT_ID ||
+	       event->attr.config == QOS_RMID_RUNNING_EVENT_ID;
+}
+
+static inline bool cqm_mbm_event(struct perf_event *event)
+{
+	return event->attr.config >= QOS_MBM_TOTAL_EVENT_ID &&
+	       event->attr.config <= QOS_MBM_MISS_RATE_EVENT_ID;
+}
+
+/*
+ * Events that read llc_occupancy and so need their RMID to go through
+ * limbo when it is freed.
+ */
+static inline bool cqm_occup_event(struct perf_event *event)
+{
+	return event->attr.config == QOS_L3_OCCUP_EVENT_ID ||
+	       event->attr.config == QOS_MBM_BW_PER_OCCUP_EVENT_ID;
+}
+
+/*
+ * MBM events that report the bandwidth of the last interval, rather
+ * than a running average, and keep the per-cpu hrtimer going.
+ */
+static inline bool cqm_mbm_timed_event(struct perf_event *event)
+{
+	switch (event->attr.config) {
+	case QOS_MBM_TOTAL_EVENT_ID:
+	case QOS_MBM_LOCAL_EVENT_ID:
+	case QOS_MBM_REMOTE_EVENT_ID:
+	case QOS_MBM_LOCAL_RATIO_EVENT_ID:
+	case QOS_MBM_BW_PER_OCCUP_EVENT_ID:
+	case QOS_MBM_MISS_RATE_EVENT_ID:
+		return true;
+	}
+	return false;
+}
+
 /*
  * This is central to the rotation algorithm in __intel_cqm_rmid_rotate().
  *
@@ -218,8 +524,7 @@ static u64 __rmid_read(u32 rmid)
 	 * Ignore the SDM, this thing is _NOTHING_ like a regular perfcnt,
 	 * it just says that to increase confusion.
 	 */
-	wrmsr(MSR_IA32_QM_EVTSEL, QOS_L3_OCCUP_EVENT_ID, rmid);
-	rdmsrl(MSR_IA32_QM_CTR, val);
+	val = cqm_read_counter(QOS_L3_OCCUP_EVENT_ID, rmid);
 
 	/*
 	 * Aside from the ERROR and UNAVAIL bits, assume this thing returns
@@ -228,19 +533,16 @@ static u64 __rmid_read(u32 rmid)
 	return val;
 }
 
-enum rmid_recycle_state {
-	RMID_YOUNG = 0,
-	RMID_AVAILABLE,
-	RMID_DIRTY,
-};
-
 struct cqm_rmid_entry {
 	u32 rmid;
-	enum rmid_recycle_state state;
 	struct list_head list;
 	unsigned long queue_time;
+	unsigned long due;
+	unsigned long last_read;
+	unsigned long backoff;
+	u64 last_occ;
 	bool is_cqm;
-	bool is_multi_event;
+	bool reserved;
 };
 
 static void intel_cqm_free_rmid(struct cqm_rmid_entry *entry);
@@ -258,17 +560,75 @@ static void intel_cqm_free_rmid(struct cqm_rmid_entry *entry);
  * list.
  *
  *
- * cqm_rmid_limbo_lru - list of currently unused but (potentially) dirty RMIDs.
+ * cqm_limbo_wheel - currently unused but (potentially) dirty RMIDs.
  *
- * This list is contains RMIDs that no one is currently using but that
- * may have a non-zero occupancy value associated with them. The
- * rotation worker moves RMIDs from the limbo list to the free list once
- * the occupancy value drops below __intel_cqm_threshold.
+ * The wheel contains RMIDs that no one is currently using but that may
+ * have a non-zero occupancy value associated with them. The rotation
+ * worker moves RMIDs from the wheel to the free list once the occupancy
+ * value drops below __intel_cqm_threshold. cqm_nr_limbo counts them.
  *
- * Both lists are protected by cache_mutex.
+ * cqm_rmid_reserved_lru - free RMIDs set aside for pinned groups.
+ *
+ * reserved_rmids RMIDs are taken out of the free pool for groups with
+ * config1 pin set; they are free, in use by a pinned group or cleaning
+ * in limbo, after which they come back here. cqm_nr_reserved counts
+ * them all.
+ *
+ * All lists are protected by cache_mutex.
  */
 static LIST_HEAD(cqm_rmid_free_lru);
-static LIST_HEAD(cqm_rmid_limbo_lru);
+static LIST_HEAD(cqm_rmid_reserved_lru);
+static unsigned int cqm_nr_reserved;
+
+/*
+ * Initially use this constant for both the limbo queue time and the
+ * rotation timer interval, pmu::hrtimer_interval_ms.
+ *
+ * They don't need to be the same, but the two are related since if you
+ * rotate faster than you recycle RMIDs, you may run out of available
+ * RMIDs.
+ */
+#define RMID_DEFAULT_QUEUE_TIME 250	/* ms */
+
+static unsigned int __rmid_queue_time_ms = RMID_DEFAULT_QUEUE_TIME;
+
+/*
+ * Limbo RMIDs sit in a timing wheel, hashed by the time they are next
+ * worth reading (entry->due). Each slot covers CQM_LIMBO_SLOT_MS.
+ * Anything due beyond the reach of the wheel goes into its last slot
+ * and is simply looked at early.
+ *
+ * cqm_limbo_clk is when the next slot expires, in jiffies. It only ever
+ * advances by a slot length, and the slot index is derived from it, so
+ * it can be compared with time_after() across a jiffies wrap.
+ */
+#define CQM_LIMBO_SLOT_MS	50
+#define CQM_LIMBO_SLOTS		64
+
+static struct list_head cqm_limbo_wheel[CQM_LIMBO_SLOTS];
+static unsigned long cqm_limbo_clk;
+static unsigned int cqm_nr_limbo;
+
+static inline struct list_head *cqm_limbo_slot(unsigned long clk)
+{
+	unsigned long len = msecs_to_jiffies(CQM_LIMBO_SLOT_MS);
+
+	return &cqm_limbo_wheel[(clk / len) % CQM_LIMBO_SLOTS];
+}
+
+static void cqm_limbo_queue(struct cqm_rmid_entry *entry, unsigned long due)
+{
+	unsigned long len = msecs_to_jiffies(CQM_LIMBO_SLOT_MS);
+	unsigned long off = 0;
+
+	/* The first slot that expires at or after @due. */
+	if (time_after(due, cqm_limbo_clk))
+		off = min_t(unsigned long, DIV_ROUND_UP(due - cqm_limbo_clk, len),
+			    CQM_LIMBO_SLOTS - 1);
+
+	entry->due = due;
+	list_add_tail(&entry->list, cqm_limbo_slot(cqm_limbo_clk + off * len));
+}
 
 /*
  * We use a simple array of pointers so that we can lookup a struct
@@ -295,30 +655,23 @@ static inline struct cqm_rmid_entry *__rmid_entry(u32 rmid)
 }
 
 /**
- * mbm_reset_stats - reset stats for a given rmid for the current cpu
+ * mbm_reset_stats - reset stats for a given rmid on every package
  * @rmid:	rmid value
- *
- * vrmid: array index for mbm_total or mbm_local of the current core for the
- * given rmid
- *
- * mbs_total[] and mbm_local[] are linearly indexed by core number * max number
- * rmids per socket, an example is given below
- * RMID1 of Socket0:  vrmid  = 1
- * RMID1 of Socket1:  vrmid =  1 * CQM_MAX_RMID + 1
- * RMID1 of Socket2:  vrmid =  2 * CQM_MAX_RMID + 1
  */
 static void mbm_reset_stats(u32 rmid)
 {
-	u32  i, vrmid;
+	unsigned int i, nr_pkgs;
 
 	if (!is_mbm)
 		return;
-	for (i=0; i < mbm_socket_max; i++) {
-		vrmid =  i * cqm_max_rmid + rmid;
-		memset(&mbm_local[vrmid], 0, sizeof(struct sample));
-		memset(&mbm_total[vrmid], 0, sizeof(struct sample));
-	}
 
+	nr_pkgs = READ_ONCE(cqm_nr_pkgs);
+	smp_rmb(); /* pairs with cqm_pkg_assign() */
+
+	for (i = 0; i < nr_pkgs; i++) {
+		memset(&mbm_pkgs[i]->local[rmid], 0, sizeof(struct sample));
+		memset(&mbm_pkgs[i]->total[rmid], 0, sizeof(struct sample));
+	}
 }
 
 /*
@@ -337,6 +690,27 @@ static u32 __get_rmid(void)
 
 	entry = list_first_entry(&cqm_rmid_free_lru, struct cqm_rmid_entry, list);
 	list_del(&entry->list);
+	trace_cqm_rmid_alloc(entry->rmid);
+
+	return entry->rmid;
+}
+
+/*
+ * Same as __get_rmid() for pinned groups.
+ */
+static u32 __get_reserved_rmid(void)
+{
+	struct cqm_rmid_entry *entry;
+
+	lockdep_assert_held(&cache_mutex);
+
+	if (list_empty(&cqm_rmid_reserved_lru))
+		return INVALID_RMID;
+
+	entry = list_first_entry(&cqm_rmid_reserved_lru,
+				 struct cqm_rmid_entry, list);
+	list_del(&entry->list);
+	trace_cqm_rmid_alloc(entry->rmid);
 
 	return entry->rmid;
 }
@@ -351,17 +725,27 @@ static void __put_rmid(u32 rmid)
 	entry = __rmid_entry(rmid);
 
 	entry->queue_time = jiffies;
-	entry->state = RMID_YOUNG;
 	mbm_reset_stats(rmid);
 
 	/*
 	 * If the RMID is used for measuring LLC_OCCUPANCY, put it in
-	 * cqm_rmid_limbo_lru so that it gets recycled. Otherwise, RMID
-	 * is put in free list and is immediately available for reuse
+	 * limbo so that it gets recycled. Otherwise, RMID is put in free
+	 * list and is immediately available for reuse.
+	 *
+	 * We hold RMIDs placed into limbo for a minimum queue time.
+	 * Until then, any RMID placed into limbo will likely still have
+	 * data tagged in the cache, so we'd probably fail to recycle it
+	 * anyway and can save ourselves the read.
 	 */
-	if (entry->is_cqm)
-		list_add_tail(&entry->list, &cqm_rmid_limbo_lru);
-	else
+	if (entry->is_cqm) {
+		entry->last_read = entry->queue_time;
+		entry->last_occ = ~0ULL;
+		entry->backoff = 0;
+		cqm_limbo_queue(entry, entry->queue_time +
+				msecs_to_jiffies(__rmid_queue_time_ms));
+		cqm_nr_limbo++;
+		trace_cqm_rmid_limbo(rmid);
+	} else
 		intel_cqm_free_rmid(entry);
 
 }
@@ -372,6 +756,11 @@ static int intel_cqm_setup_rmid_cache(void)
 	unsigned int nr_rmids;
 	int r = 0;
 
+	for (r = 0; r < CQM_LIMBO_SLOTS; r++)
+		INIT_LIST_HEAD(&cqm_limbo_wheel[r]);
+	cqm_limbo_clk = jiffies;
+	r = 0;
+
 	nr_rmids = cqm_max_rmid + 1;
 	cqm_rmid_ptrs = kmalloc(sizeof(struct cqm_rmid_entry *) *
 				nr_rmids, GFP_KERNEL);
@@ -388,6 +777,7 @@ static int intel_cqm_setup_rmid_cache(void)
 		INIT_LIST_HEAD(&entry->list);
 		entry->rmid = r;
 		entry->is_cqm = false;
+		entry->reserved = false;
 		cqm_rmid_ptrs[r] = entry;
 
 		list_add_tail(&entry->list, &cqm_rmid_free_lru);
@@ -422,7 +812,6 @@ fail:
 static bool __match_event(struct perf_event *a, struct perf_event *b)
 {
 	/* Per-cpu and task events don't mix */
-	printk(KERN_WARNING "a_state %d config %d b_bstate %d config %d \n",a->attach_state,a->attr.config,b->attach_state,b->attr.config);
 	if ((a->attach_state & PERF_ATTACH_TASK) !=
 	    (b->attach_state & PERF_ATTACH_TASK))
 		return false;
@@ -431,31 +820,20 @@ static bool __match_event(struct perf_event *a, struct perf_event *b)
 	if (a->cgrp != b->cgrp)
 		return false;
 #endif
-	printk(KERN_WARNING "match 1 ");
 	/* If not task event, we're machine wide */
 	if (!(b->attach_state & PERF_ATTACH_TASK))
 		return true;
-	printk(KERN_WARNING "2");
 	/*
 	 * Events that target same task are placed into the same cache group.
 	 */
-	if (a->hw.target == b->hw.target) {
-		if (a->attr.config  != b->attr.config) {
-			struct cqm_rmid_entry *entry;
-
-				entry = __rmid_entry(a->hw.cqm_rmid);
-				entry->is_multi_event = true;
-				printk(KERN_WARNING "multi \n");
-		}
+	if (a->hw.target == b->hw.target)
 		return true;
-	}
-	printk(KERN_WARNING " 3");
+
 	/*
 	 * Are we an inherited event?
 	 */
 	if (b->parent == a)
 		return true;
-	printk(KERN_WARNING "4 \n");
 	return false;
 }
 
@@ -558,99 +936,518 @@ static bool __conflict_event(struct perf_event *a, struct perf_event *b)
 struct rmid_read {
 	u32 rmid;
 	atomic64_t value;
+	atomic64_t denom;	/* ratio events: sum of the denominator */
 	enum mbm_evt_type evt_type;
 };
 
 static void __intel_cqm_event_count(void *info);
+static void __intel_mbm_event_count(void *info);
+static u64 rmid_read_value(struct rmid_read *rr);
+
+/**
+ * struct cqm_group - multiplexing accounting of a cache group
+ * @created:	ktime_get_ns() when the group was set up
+ * @running:	ns the group held an RMID before it last got one
+ * @since:	when the group last got an RMID
+ * @vrun:	@running scaled by CQM_WEIGHT_SCALE / @weight
+ * @weight:	share of monitored time relative to other groups
+ * @prio:	never rotated out, and first in line for an RMID
+ * @pinned:	holds a reserved RMID for its whole life
+ * @leader:	the event of the group on cache_groups
+ * @wait_node:	in cqm_wait_tree while the group has no RMID
+ * @mon_entry:	on cqm_mon_groups while it has one
+ * @nr_events:	number of events linked to the group
+ * @multi_event: the group mixes event types (or config1 settings), so
+ *		every event reports its own value, not just the leader
+ *
+ * Once there are more groups than RMIDs, rotation takes turns giving
+ * them one. A group is enabled for its whole life and running while it
+ * holds an RMID; @running and @since change with the RMID, under
+ * cache_lock. Everything else is protected by cache_mutex.
+ */
+struct cqm_group {
+	u64			created;
+	u64			running;
+	u64			since;
+	u64			vrun;
+	unsigned int		weight;
+	bool			prio;
+	bool			pinned;
+	struct perf_event	*leader;
+	struct rb_node		wait_node;
+	struct list_head	mon_entry;
+	unsigned int		nr_events;
+	bool			multi_event;
+	struct rcu_head		rcu;
+};
 
 /*
- * Exchange the RMID of a group of events.
+ * attr.config1 prio and weight, see struct cqm_group.
  */
-static u32 intel_cqm_xchg_rmid(struct perf_event *group, u32 rmid)
+#define CQM_PRIO		BIT_ULL(2)
+#define CQM_PIN			BIT_ULL(3)
+#define CQM_WEIGHT_SHIFT	48
+#define CQM_WEIGHT_MASK		0xff
+#define CQM_WEIGHT_SCALE	1024
+
+static inline bool cqm_event_prio(struct perf_event *event)
 {
-	struct perf_event *event;
-	struct list_head *head = &group->hw.cqm_group_entry;
-	u32 old_rmid = group->hw.cqm_rmid;
+	return event->attr.config1 & CQM_PRIO;
+}
 
-	lockdep_assert_held(&cache_mutex);
+static inline bool cqm_event_pinned(struct perf_event *event)
+{
+	return event->attr.config1 & CQM_PIN;
+}
 
-	/*
-	 * If our RMID is being deallocated, perform a read now.
-	 */
-	if (__rmid_valid(old_rmid) && !__rmid_valid(rmid)) {
-		struct rmid_read rr = {
-			.value = ATOMIC64_INIT(0),
-			.rmid = old_rmid,
-		};
+/* weight=0, i.e. unset, counts as 1 */
+static inline unsigned int cqm_event_weight(struct perf_event *event)
+{
+	return max_t(unsigned int, 1,
+		     (event->attr.config1 >> CQM_WEIGHT_SHIFT) &
+		     CQM_WEIGHT_MASK);
+}
 
-		on_each_cpu_mask(&cqm_cpumask, __intel_cqm_event_count,
-				 &rr, 1);
-		local64_set(&group->count, atomic64_read(&rr.value));
-	}
+/*
+ * Rotation scheduler, CFS style: groups without an RMID wait in
+ * cqm_wait_tree, prio groups first, then by vrun, so the next group to
+ * get an RMID is the leftmost one, O(log n). Groups with an RMID are on
+ * cqm_mon_groups, which is bounded by the number of RMIDs; the victim
+ * of a rotation is the best-effort group there with the largest vrun.
+ * With everyone competing, groups end up monitored for time in
+ * proportion to their weight.
+ *
+ * New groups start at cqm_min_vrun, the vrun of the last group given an
+ * RMID by rotation, so they neither starve nor get starved.
+ */
+static struct rb_root cqm_wait_tree = RB_ROOT;
+static unsigned int cqm_nr_waiting;
+static LIST_HEAD(cqm_mon_groups);
+static u64 cqm_min_vrun;
 
-	raw_spin_lock_irq(&cache_lock);
+static bool cqm_group_before(struct cqm_group *a, struct cqm_group *b)
+{
+	if (a->prio != b->prio)
+		return a->prio;
 
-	group->hw.cqm_rmid = rmid;
-	list_for_each_entry(event, head, hw.cqm_group_entry)
-		event->hw.cqm_rmid = rmid;
+	return a->vrun < b->vrun;
+}
 
-	raw_spin_unlock_irq(&cache_lock);
+static void cqm_wait_enqueue(struct cqm_group *grp)
+{
+	struct rb_node **link = &cqm_wait_tree.rb_node, *parent = NULL;
 
-	return old_rmid;
+	while (*link) {
+		parent = *link;
+		if (cqm_group_before(grp, rb_entry(parent, struct cqm_group,
+						   wait_node)))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&grp->wait_node, parent, link);
+	rb_insert_color(&grp->wait_node, &cqm_wait_tree);
+	cqm_nr_waiting++;
 }
 
-/*
- * If we fail to assign a new RMID for intel_cqm_rotation_rmid because
- * cachelines are still tagged with RMIDs in limbo, we progressively
- * increment the threshold until we find an RMID in limbo with <=
- * __intel_cqm_threshold lines tagged. This is designed to mitigate the
- * problem where cachelines tagged with an RMID are not steadily being
- * evicted.
- *
- * On successful rotations we decrease the threshold back towards zero.
- *
- * __intel_cqm_max_threshold provides an upper bound on the threshold,
- * and is measured in bytes because it's exposed to userland.
- */
-static unsigned int __intel_cqm_threshold;
-static unsigned int __intel_cqm_max_threshold;
+static void cqm_wait_dequeue(struct cqm_group *grp)
+{
+	rb_erase(&grp->wait_node, &cqm_wait_tree);
+	RB_CLEAR_NODE(&grp->wait_node);
+	cqm_nr_waiting--;
+}
 
 /*
- * Test whether an RMID has a zero occupancy value on this cpu.
+ * Move @grp between the wait tree and the monitored list as it gets or
+ * loses an RMID.
+ *
+ * We expect to be called with cache_mutex held.
  */
-static void intel_cqm_stable(void *arg)
+static void cqm_group_set_monitored(struct cqm_group *grp, bool monitored)
 {
-	struct cqm_rmid_entry *entry;
-
-	list_for_each_entry(entry, &cqm_rmid_limbo_lru, list) {
-		if (entry->state != RMID_AVAILABLE)
-			break;
+	lockdep_assert_held(&cache_mutex);
 
-		if (__rmid_read(entry->rmid) > __intel_cqm_threshold)
-			entry->state = RMID_DIRTY;
+	if (monitored) {
+		if (!RB_EMPTY_NODE(&grp->wait_node))
+			cqm_wait_dequeue(grp);
+		list_add_tail(&grp->mon_entry, &cqm_mon_groups);
+	} else {
+		if (!list_empty(&grp->mon_entry))
+			list_del_init(&grp->mon_entry);
+		cqm_wait_enqueue(grp);
 	}
 }
 
 /*
- * If we have group events waiting for an RMID that don't conflict with
- * events already running, assign @rmid.
+ * Would giving @event an RMID take away one of a pinned group's?
+ *
+ * We expect to be called with cache_mutex held.
  */
-static bool intel_cqm_sched_in_event(u32 rmid)
+static bool cqm_conflicts_pinned(struct perf_event *event)
 {
-	struct perf_event *leader, *event;
+	struct cqm_group *grp;
 
-	lockdep_assert_held(&cache_mutex);
+	list_for_each_entry(grp, &cqm_mon_groups, mon_entry) {
+		if (grp->pinned && grp->leader != event &&
+		    __conflict_event(grp->leader, event))
+			return true;
+	}
 
-	leader = list_first_entry(&cache_groups, struct perf_event,
+	return false;
+}
+
+static u64 cqm_group_vrun(struct cqm_group *grp, u64 now)
+{
+	if (list_empty(&grp->mon_entry))
+		return grp->vrun;
+
+	return grp->vrun +
+	       div_u64((now - grp->since) * CQM_WEIGHT_SCALE, grp->weight);
+}
+
+/*
+ * Every event, group leader or not, finds its cqm_group through a
+ * cqm_group_link in cqm_group_hash, so nothing has to change when the
+ * leader goes away. Modified under cache_mutex, looked up under it or
+ * under rcu_read_lock().
+ */
+struct cqm_group_link {
+	struct hlist_node	node;
+	struct perf_event	*event;
+	struct cqm_group	*group;
+	struct rcu_head		rcu;
+};
+
+static DEFINE_HASHTABLE(cqm_group_hash, 10);
+
+static struct cqm_group *cqm_event_group(struct perf_event *event)
+{
+	struct cqm_group_link *link;
+
+	hash_for_each_possible_rcu(cqm_group_hash, link, node,
+				   (unsigned long)event) {
+		if (link->event == event)
+			return link->group;
+	}
+
+	return NULL;
+}
+
+static void cqm_group_link_del(struct perf_event *event)
+{
+	struct cqm_group_link *link;
+
+	lockdep_assert_held(&cache_mutex);
+
+	hash_for_each_possible(cqm_group_hash, link, node,
+			       (unsigned long)event) {
+		if (link->event != event)
+			continue;
+
+		hash_del_rcu(&link->node);
+		if (!--link->group->nr_events) {
+			if (!RB_EMPTY_NODE(&link->group->wait_node))
+				cqm_wait_dequeue(link->group);
+			list_del(&link->group->mon_entry);
+			kfree_rcu(link->group, rcu);
+		}
+		kfree_rcu(link, rcu);
+		return;
+	}
+}
+
+static bool cqm_event_multi(struct perf_event *event)
+{
+	struct cqm_group *grp;
+	bool multi;
+
+	rcu_read_lock();
+	grp = cqm_event_group(event);
+	multi = grp && grp->multi_event;
+	rcu_read_unlock();
+
+	return multi;
+}
+
+static u64 cqm_group_running(struct cqm_group *grp, u32 rmid, u64 now)
+{
+	if (__rmid_valid(rmid))
+		return grp->running + now - grp->since;
+
+	return grp->running;
+}
+
+/*
+ * Read @event's value from @rmid now, before the RMID goes away, if it
+ * reads occupancy. MBM events keep their last bandwidth instead.
+ */
+static void intel_cqm_event_snapshot(struct perf_event *event, u32 rmid)
+{
+	struct rmid_read rr = {
+		.value = ATOMIC64_INIT(0),
+		.rmid = rmid,
+		.evt_type = event->attr.config,
+	};
+
+	if (!cqm_occup_event(event))
+		return;
+
+	if (event->attr.config == QOS_L3_OCCUP_EVENT_ID)
+		cqm_on_each_reader(__intel_cqm_event_count, &rr);
+	else if (is_mbm)
+		cqm_on_each_reader(__intel_mbm_event_count, &rr);
+
+	local64_set(&event->count, rmid_read_value(&rr));
+}
+
+/*
+ * Exchange the RMID of a group of events.
+ */
+static u32 intel_cqm_xchg_rmid(struct perf_event *group, u32 rmid)
+{
+	struct perf_event *event;
+	struct list_head *head = &group->hw.cqm_group_entry;
+	struct cqm_group *grp = cqm_event_group(group);
+	u32 old_rmid = group->hw.cqm_rmid;
+	u64 now;
+
+	lockdep_assert_held(&cache_mutex);
+
+	/*
+	 * If our RMID is being deallocated, perform a read now for
+	 * every event of the group that reads occupancy, whichever of
+	 * them leads.
+	 */
+	if (__rmid_valid(old_rmid) && !__rmid_valid(rmid)) {
+		intel_cqm_event_snapshot(group, old_rmid);
+		list_for_each_entry(event, head, hw.cqm_group_entry)
+			intel_cqm_event_snapshot(event, old_rmid);
+	}
+
+	raw_spin_lock_irq(&cache_lock);
+
+	if (grp && __rmid_valid(old_rmid) != __rmid_valid(rmid)) {
+		now = ktime_get_ns();
+		if (__rmid_valid(rmid)) {
+			grp->since = now;
+		} else {
+			grp->vrun = cqm_group_vrun(grp, now);
+			grp->running += now - grp->since;
+		}
+	}
+
+	group->hw.cqm_rmid = rmid;
+	list_for_each_entry(event, head, hw.cqm_group_entry)
+		event->hw.cqm_rmid = rmid;
+
+	raw_spin_unlock_irq(&cache_lock);
+
+	if (grp && __rmid_valid(old_rmid) != __rmid_valid(rmid))
+		cqm_group_set_monitored(grp, __rmid_valid(rmid));
+
+	return old_rmid;
+}
+
+/*
+ * If we fail to assign a new RMID for intel_cqm_rotation_rmid because
+ * cachelines are still tagged with RMIDs in limbo, we progressively
+ * increment the threshold until we find an RMID in limbo with <=
+ * __intel_cqm_threshold lines tagged. This is designed to mitigate the
+ * problem where cachelines tagged with an RMID are not steadily being
+ * evicted.
+ *
+ * On successful rotations we decrease the threshold back towards zero.
+ *
+ * __intel_cqm_max_threshold provides an upper bound on the threshold,
+ * and is measured in bytes because it's exposed to userland.
+ */
+static unsigned int __intel_cqm_threshold;
+static unsigned int __intel_cqm_max_threshold;
+
+/*
+ * The limbo RMIDs read by one stabilization pass, and the largest
+ * occupancy any package reported for each. Protected by cache_mutex.
+ */
+#define CQM_LIMBO_BATCH		64
+
+struct cqm_limbo_batch {
+	unsigned int		nr;
+	struct cqm_rmid_entry	*entry[CQM_LIMBO_BATCH];
+	u64			occ[CQM_LIMBO_BATCH];
+};
+
+static struct cqm_limbo_batch cqm_limbo_batch;
+
+/*
+ * Read the occupancy of every RMID in the batch on this cpu.
+ */
+static void intel_cqm_stable(void *arg)
+{
+	struct cqm_limbo_batch *b = arg;
+	unsigned int i;
+	u64 val, old;
+
+	for (i = 0; i < b->nr; i++) {
+		val = __rmid_read(b->entry[i]->rmid);
+
+		/* The other readers are doing the same. */
+		do {
+			old = READ_ONCE(b->occ[i]);
+			if (old >= val)
+				break;
+		} while (cmpxchg64(&b->occ[i], old, val) != old);
+	}
+}
+
+/*
+ * Nothing new is tagged with a limbo RMID, so its occupancy only ever
+ * drains. Extrapolate the drain seen since the last read to guess how
+ * long until it reaches the threshold; when it isn't visibly draining,
+ * back off exponentially. Returns the delay in jiffies.
+ */
+static unsigned long cqm_limbo_predict(struct cqm_rmid_entry *entry,
+				       u64 occ, unsigned long now)
+{
+	unsigned long min = msecs_to_jiffies(CQM_LIMBO_SLOT_MS);
+	unsigned long max = min * CQM_LIMBO_SLOTS;
+	unsigned long dt = now - entry->last_read;
+	u64 delay;
+
+	if (occ & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+		occ = ~0ULL;
+
+	if (occ < entry->last_occ && dt) {
+		delay = div64_u64((occ - __intel_cqm_threshold) * dt,
+				  entry->last_occ - occ);
+	} else {
+		delay = (u64)entry->backoff * 2;
+	}
+
+	delay = clamp_t(u64, delay, min, max);
+
+	entry->backoff = delay;
+	entry->last_occ = occ;
+	entry->last_read = now;
+
+	return delay;
+}
+
+/*
+ * Take the limbo RMIDs that are due by @now off the wheel, at most a
+ * batch worth. Under @pressure and with nothing due, take the next
+ * ones that will be instead.
+ */
+static void cqm_limbo_collect(struct cqm_limbo_batch *b, unsigned long now,
+			      bool pressure)
+{
+	unsigned long len = msecs_to_jiffies(CQM_LIMBO_SLOT_MS);
+	struct cqm_rmid_entry *entry, *tmp;
+	struct list_head *slot;
+	LIST_HEAD(later);
+	unsigned int i;
+
+	b->nr = 0;
+
+	/* Every slot is expired, visit each once. */
+	if (!time_before(now, cqm_limbo_clk + CQM_LIMBO_SLOTS * len))
+		cqm_limbo_clk += ((now - cqm_limbo_clk) / len -
+				  (CQM_LIMBO_SLOTS - 1)) * len;
+
+	while (!time_after(cqm_limbo_clk, now)) {
+		slot = cqm_limbo_slot(cqm_limbo_clk);
+
+		list_for_each_entry_safe(entry, tmp, slot, list) {
+			if (b->nr == CQM_LIMBO_BATCH)
+				break;
+
+			if (time_after(entry->due, now)) {
+				list_move_tail(&entry->list, &later);
+				continue;
+			}
+
+			list_del(&entry->list);
+			b->entry[b->nr++] = entry;
+		}
+
+		/* Batch is full, pick up the rest of the slot next time. */
+		if (!list_empty(slot))
+			break;
+
+		cqm_limbo_clk += len;
+	}
+
+	list_for_each_entry_safe(entry, tmp, &later, list) {
+		list_del(&entry->list);
+		cqm_limbo_queue(entry, entry->due);
+	}
+
+	if (b->nr || !pressure)
+		return;
+
+	for (i = 0; i < CQM_LIMBO_SLOTS; i++) {
+		slot = cqm_limbo_slot(cqm_limbo_clk + i * len);
+
+		list_for_each_entry_safe(entry, tmp, slot, list) {
+			if (b->nr == CQM_LIMBO_BATCH)
+				break;
+
+			list_del(&entry->list);
+			b->entry[b->nr++] = entry;
+		}
+
+		if (b->nr)
+			break;
+	}
+}
+
+/*
+ * Occupancy only drains in limbo, so an RMID last read at or below the
+ * (just raised) threshold is clean without reading it again.
+ *
+ * We expect to be called with cache_mutex held.
+ */
+static void cqm_limbo_reap(void)
+{
+	struct cqm_rmid_entry *entry, *tmp;
+	unsigned int i;
+
+	lockdep_assert_held(&cache_mutex);
+
+	for (i = 0; i < CQM_LIMBO_SLOTS; i++) {
+		list_for_each_entry_safe(entry, tmp, &cqm_limbo_wheel[i], list) {
+			if (entry->last_occ > __intel_cqm_threshold)
+				continue;
+
+			list_del(&entry->list);
+			cqm_nr_limbo--;
+			intel_cqm_free_rmid(entry);
+		}
+	}
+}
+
+/*
+ * If we have group events waiting for an RMID that don't conflict with
+ * events already running, assign @rmid; first come in cqm_wait_tree
+ * order.
+ */
+static bool intel_cqm_sched_in_event(u32 rmid)
+{
+	struct perf_event *leader, *event;
+	struct rb_node *node;
+
+	lockdep_assert_held(&cache_mutex);
+
+	leader = list_first_entry(&cache_groups, struct perf_event,
 				  hw.cqm_groups_entry);
-	event = leader;
 
-	list_for_each_entry_continue(event, &cache_groups,
-				     hw.cqm_groups_entry) {
-		if (__rmid_valid(event->hw.cqm_rmid))
+	for (node = rb_first(&cqm_wait_tree); node; node = rb_next(node)) {
+		event = rb_entry(node, struct cqm_group, wait_node)->leader;
+		if (event == leader)
 			continue;
 
-		if (__conflict_event(event, leader))
+		if (__conflict_event(event, leader) ||
+		    cqm_conflicts_pinned(event))
 			continue;
 
 		intel_cqm_xchg_rmid(event, rmid);
@@ -662,6 +1459,16 @@ static bool intel_cqm_sched_in_event(u32 rmid)
 
 static void intel_cqm_free_rmid(struct cqm_rmid_entry *entry)
 {
+	trace_cqm_rmid_free(entry->rmid);
+
+	/*
+	 * Reserved RMIDs only ever go to pinned groups.
+	 */
+	if (entry->reserved) {
+		list_add_tail(&entry->list, &cqm_rmid_reserved_lru);
+		return;
+	}
+
 	/*
 	 * The rotation RMID gets priority if it's currently invalid.
 	 *
@@ -727,6 +1534,20 @@ static void mbm_fifo_in(struct sample *bw_stat, u32 val)
 		bw_stat->fifoin = 0;
 }
 
+/*
+ * @count per second over @ns. count * NSEC_PER_SEC is exact for
+ * counts up to 2^34, far more than a 24-bit counter does between two
+ * reads; beyond that, fall back to ms resolution rather than overflow.
+ */
+static u64 mbm_rate(u64 count, u64 ns)
+{
+	if (count <= U64_MAX / NSEC_PER_SEC)
+		return div64_u64(count * NSEC_PER_SEC, ns);
+
+	ns = max_t(u64, div_u64(ns, NSEC_PER_MSEC), 1);
+	return div64_u64(count, ns) * MSEC_PER_SEC;
+}
+
 /*
  * rmid_read_mbm checks whether it is LOCAL or Total MBM event and reads
  * its MSR counter. Check whether overflow occurred and handle it. Calculate
@@ -734,13 +1555,13 @@ static void mbm_fifo_in(struct sample *bw_stat, u32 val)
  *
  * MBM Counter Overflow:
  * Calculation of Current Bandwidth value:
- * If MSR is read within last 100ms, then we rturn the previous value
- * Currently perf receommends keeping 100ms between samples. Driver uses
- * this guideline. If the MSR was Read with in last 100ms, why  incur an
- * extra overhead of doing the MSR reads again.
+ * If the MSR was read within the last MBM_READ_DELTA_MIN_NS, we return
+ * the previous value rather than divide by next to no time.
  *
  * Bandwidth is calculated as:
  * memory bandwidth = (difference of  two msr counter values )/time difference
+ * with the time in ns, taken right after the MSR read, so that it is
+ * exact for any interval.
  *
  * cum_avg = Running Average of bandwidth with last 'n' bandwidth values of
  * the samples that are processed
@@ -765,131 +1586,229 @@ static void mbm_fifo_in(struct sample *bw_stat, u32 val)
  */
 static u64 rmid_read_mbm(unsigned int rmid, enum mbm_evt_type evt_type)
 {
-	u64  val, currentmsr, diff_time,  currentbw, bytes, prevavg;
-	bool overflow = false, first = false;
-	ktime_t cur_time;
+	u64 val, currentmsr, diff_time, win_time, bytes, prevavg, now;
+	bool accepted = false;
 	u32 eventid, index;
 	struct sample *mbm_current;
-	u32 vrmid = rmid_2_index(rmid);
+	struct mbm_pkg *pkg = this_mbm_pkg();
 
-	cur_time = ktime_get();
 	if (evt_type & QOS_MBM_LOCAL_EVENT_MASK) {
-		mbm_current = &mbm_local[vrmid];
+		mbm_current = &pkg->local[rmid];
 		eventid     =  QOS_MBM_LOCAL_EVENT_ID;
 	} else {
-		mbm_current = &mbm_total[vrmid];
+		mbm_current = &pkg->total[rmid];
 		eventid     = QOS_MBM_TOTAL_EVENT_ID;
 	}
 
 	prevavg = mbm_current->runavg;
-	if (mbm_current->fifoin > 0)
-		currentbw = mbm_current->mbmfifo[mbm_current->fifoin-1];
-	else
-		currentbw = prevavg;
-	diff_time = ktime_ms_delta(cur_time,
-				   mbm_current->prev_time);
-	u64 diff,val1=mbm_current->bytes,val2= (prevavg * (cqm_l3_scale));
-	printk(KERN_WARNING "msr %d lastmsr %d  val %u L/T %d BW  %u MB/sec    diff_time %u cma %u index %d  cpu  %u pkg_id %d rmid %d vrmid %d pid %d\n",currentmsr,bytes,val, evt_type,val2, diff_time,prevavg,index,smp_processor_id(),topology_physical_package_id(smp_processor_id()),rmid,vrmid,current->pid);
-	if (diff_time > MBM_TIME_DELTA_MIN) {
-
-		wrmsr(MSR_IA32_QM_EVTSEL, eventid, rmid);
-		rdmsrl(MSR_IA32_QM_CTR, val);
-
-		if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
-			return val;
-
-		bytes = mbm_current->bytes;
-		currentmsr = val;
-		val &= MBM_CNTR_MAX;
-		/* if MSR current read value is less than MSR previous read
-		 * value then it is an overflow. MSR values are increasing
-		 * when bandwidth consumption for the thread is non-zero;
-		 * Overflow occurs, When MBM counter value reaches its
-		 * maximum i.e. MBM_CNTR_MAX.
-		 *
-		 * After overflow, MSR current value goes back to zero and
-		 * starts increasing again at the rate of bandwidth.
-		 *
-		 * Overflow handling:
-		 * First overflow is detected by comparing current msr values
-		 * will with the last read value. If current msr value is less
-		 * than previous value then it is an overflow. When overflow
-		 * occurs, (MBM_CONTR_MAX - prev msr value) is added the current
-		 * msr value to the get actual value.
-		 */
+	diff_time = ktime_get_ns() - mbm_current->prev_time;
+	if (diff_time < MBM_READ_DELTA_MIN_NS) {
+		cqm_stat_inc(CQM_STAT_MBM_THROTTLED);
+		goto out;
+	}
+
+	val = cqm_read_counter(eventid, rmid);
+	if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+		return val;
 
-		if (val < bytes) {
-			val = MBM_CNTR_MAX - bytes + val + 1;
-			overflow = true;
-		} else
-			val = val - bytes;
+	/* The time that goes with the counter value, not with the call. */
+	now = ktime_get_ns();
+	diff_time = now - mbm_current->prev_time;
 
-		/*
-		 * MBM_TIME_DELTA_EXP is picked as per MBM specs. As per
-		 * hardware functionality, overflow can occur maximum once in a
-		 * second. So latest we want to read the MSR counters is 1000ms.
-		 * Minimum time interval between two MSR reads is 100ms. If
-		 * read_rmid_mbm is called with in less than 100ms, use the
-		 * previous sammple since perf also recommends to use the
-		 * minimum sampling period of 100ms.
-		 */
+	bytes = mbm_current->bytes;
+	currentmsr = val;
+	val &= MBM_CNTR_MAX;
 
-		if ((diff_time > MBM_TIME_DELTA_EXP) && (!prevavg))
-		/* First sample, we can't use the time delta */
-			first = true;
+	/*
+	 * The first read only sets the baseline. The same goes for a
+	 * read that comes too long after the previous one to tell how
+	 * often the counter wrapped in between: the hardware can wrap
+	 * once a second at most, and we expect to be read every
+	 * MBM_TIME_DELTA_EXP ms.
+	 */
+	if (!mbm_current->prev_time ||
+	    diff_time > (MBM_TIME_DELTA_EXP + MBM_TIME_DELTA_MIN) * NSEC_PER_MSEC) {
+		if (mbm_current->prev_time)
+			cqm_stat_inc(CQM_STAT_MBM_LATE);
+		mbm_current->bytes = currentmsr;
+		mbm_current->prev_time = now;
+		mbm_current->win_count = mbm_current->count;
+		mbm_current->win_time = now;
+		goto out;
+	}
 
-		if ((diff_time <= (MBM_TIME_DELTA_EXP + MBM_TIME_DELTA_MIN))  ||
-			   overflow || first) {
-			int averagebw, bwsum;
+	/*
+	 * if MSR current read value is less than MSR previous read
+	 * value then it is an overflow. MSR values are increasing
+	 * when bandwidth consumption for the thread is non-zero;
+	 * Overflow occurs, When MBM counter value reaches its
+	 * maximum i.e. MBM_CNTR_MAX.
+	 *
+	 * After overflow, MSR current value goes back to zero and
+	 * starts increasing again at the rate of bandwidth.
+	 */
+	if (val < bytes) {
+		trace_mbm_overflow(rmid, evt_type, bytes, val);
+		cqm_stat_inc(CQM_STAT_MBM_OVERFLOW);
+		val = MBM_CNTR_MAX - bytes + val + 1;
+	} else
+		val = val - bytes;
+
+	mbm_current->count += val;
+	mbm_current->curbw = mbm_rate(val, diff_time);
+	mbm_current->bytes = currentmsr;
+	mbm_current->prev_time = now;
+	accepted = true;
 
-			/*
-			 * For the first 'mbm_window_size -1' samples
-			 * calculate average by adding the current sample's
-			 * bandwidth to the sum of existing bandwidth values and
-			 * dividing the sum with the #samples profiled so far
-			*/
-			averagebw = 0;
-			index = mbm_current->index;
-			currentbw =  (val * MSEC_PER_SEC) / diff_time;
-			averagebw = currentbw;
-			printk(KERN_WARNING "cal1 %d val %d cpu %d rmid %d ",currentbw,val,smp_processor_id(),rmid);
-			if (index    && (index < mbm_window_size)) {
-				averagebw = prevavg  + currentbw / index -
-				    prevavg / index;
-			} else  if (index >= mbm_window_size) {
-				/*
-				 * Compute the sum of bandwidth for recent n-1
-				 * sampland slide the window by 1
-				 */
-				bwsum = __mbm_fifo_sum_lastn_out(mbm_current);
-				/*
-				 * recalculate the running average by adding
-				 * current bandwidth  and
-				 * __mbm_fifo_sum_lastn_out which is the sum of
-				 * last bandwidth values from the sliding
-				 * window. The sum divided by mbm_window_size'
-				 * is the new running average of the MBM
-				 * Bandwidth
-				 */
-				averagebw = (bwsum + currentbw) /
-					     mbm_window_size;
-				printk(KERN_WARNING "avg1 %d  cpu %d rmid %d ",averagebw,smp_processor_id(),rmid);
-			}
+	/*
+	 * The sliding window takes one sample per MBM_TIME_DELTA_MIN ms
+	 * or more, the bandwidth since the previous one, however many
+	 * reads happened in between.
+	 */
+	win_time = now - mbm_current->win_time;
+	if (win_time >= MBM_TIME_DELTA_MIN * NSEC_PER_MSEC) {
+		u32 averagebw, bwsum, currentbw;
 
-			/* save the current sample's bandwidth in fifo */
-			mbm_fifo_in(mbm_current, currentbw);
-			mbm_current->index++;
-			mbm_current->runavg = averagebw;
-			mbm_current->bytes = currentmsr;
-			mbm_current->prev_time = cur_time;
+		currentbw = mbm_rate(mbm_current->count -
+				     mbm_current->win_count, win_time);
 
+		/*
+		 * For the first 'mbm_window_size -1' samples
+		 * calculate average by adding the current sample's
+		 * bandwidth to the sum of existing bandwidth values and
+		 * dividing the sum with the #samples profiled so far
+		 */
+		averagebw = currentbw;
+		index = mbm_current->index;
+		if (index    && (index < mbm_window_size)) {
+			averagebw = prevavg  + currentbw / index -
+			    prevavg / index;
+		} else  if (index >= mbm_window_size) {
+			/*
+			 * Compute the sum of bandwidth for recent n-1
+			 * sampland slide the window by 1
+			 */
+			bwsum = __mbm_fifo_sum_lastn_out(mbm_current);
+			/*
+			 * recalculate the running average by adding
+			 * current bandwidth  and
+			 * __mbm_fifo_sum_lastn_out which is the sum of
+			 * last bandwidth values from the sliding
+			 * window. The sum divided by mbm_window_size'
+			 * is the new running average of the MBM
+			 * Bandwidth
+			 */
+			averagebw = (bwsum + currentbw) /
+				     mbm_window_size;
 		}
+
+		/* save the current sample's bandwidth in fifo */
+		mbm_fifo_in(mbm_current, currentbw);
+		mbm_current->index++;
+		mbm_current->runavg = averagebw;
+		mbm_current->win_count = mbm_current->count;
+		mbm_current->win_time = now;
 	}
-	/* No change, return the existing running average */
+out:
+	trace_mbm_sample(rmid, evt_type, diff_time, mbm_current->curbw,
+			 mbm_current->runavg, accepted);
+
 	if (evt_type & QOS_MBM_AVG_EVENT_MASK)
 		return mbm_current->runavg;
 	else
-		return currentbw;
+		return mbm_current->curbw;
+}
+
+/*
+ * The fixed-point value of ratio event @evt_type from the summed
+ * numerator and denominator. Without any occupancy there is no
+ * footprint to refill and bw_per_occupancy reads 0.
+ */
+static u64 mbm_ratio(u32 evt_type, u64 num, u64 denom)
+{
+	if (!denom)
+		return 0;
+
+	if (evt_type == QOS_MBM_BW_PER_OCCUP_EVENT_ID)
+		return div64_u64(num * MBM_BW_OCC_SCALE, denom);
+
+	return div64_u64(min(num, denom) * MBM_RATIO_SCALE, denom);
+}
+
+/*
+ * Events that divide one sum over all packages by another, see
+ * rmid_read_value(). Only task events read all packages at once.
+ */
+static inline bool mbm_ratio_event(u32 evt_type)
+{
+	return evt_type == QOS_MBM_LOCAL_RATIO_EVENT_ID ||
+	       evt_type == QOS_MBM_BW_PER_OCCUP_EVENT_ID;
+}
+
+/*
+ * mbm_read_event - read MBM event @evt_type of @rmid on this package
+ *
+ * The hardware events go straight to rmid_read_mbm(). remote_bw,
+ * avg_remote_bw and local_ratio read the total and the local counter
+ * back to back, so that both values cover the same interval, and are
+ * computed from the pair. bw_per_occupancy does the same with
+ * llc_occupancy and the total, so both describe the same instant.
+ * llc_miss_rate is the total bandwidth; its scale turns that into
+ * cachelines per second, see intel_mbm_init().
+ *
+ * Task events sum over packages; for the ratio events that has to be
+ * done before dividing. With @denom given, they therefore return the
+ * numerator and store the denominator in *@denom, see rmid_read_value().
+ */
+static u64 mbm_read_event(unsigned int rmid, u32 evt_type, u64 *denom)
+{
+	u64 tot, loc, occ;
+	bool avg;
+
+	switch (evt_type) {
+	case QOS_MBM_REMOTE_EVENT_ID:
+	case QOS_MBM_REMOTE_AVG_EVENT_ID:
+	case QOS_MBM_LOCAL_RATIO_EVENT_ID:
+		break;
+	case QOS_MBM_MISS_RATE_EVENT_ID:
+		return rmid_read_mbm(rmid, QOS_MBM_TOTAL_EVENT_ID);
+	case QOS_MBM_BW_PER_OCCUP_EVENT_ID:
+		occ = __rmid_read(rmid);
+		if (occ & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+			return occ;
+
+		tot = rmid_read_mbm(rmid, QOS_MBM_TOTAL_EVENT_ID);
+		if (tot & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+			return tot;
+
+		if (!denom)
+			return mbm_ratio(evt_type, tot, occ);
+
+		*denom = occ;
+		return tot;
+	default:
+		return rmid_read_mbm(rmid, evt_type);
+	}
+
+	avg = evt_type == QOS_MBM_REMOTE_AVG_EVENT_ID;
+	tot = rmid_read_mbm(rmid, avg ? QOS_MBM_TOTAL_AVG_EVENT_ID :
+					QOS_MBM_TOTAL_EVENT_ID);
+	if (tot & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+		return tot;
+
+	loc = rmid_read_mbm(rmid, avg ? QOS_MBM_LOCAL_AVG_EVENT_ID :
+					QOS_MBM_LOCAL_EVENT_ID);
+	if (loc & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
+		return loc;
+
+	if (evt_type != QOS_MBM_LOCAL_RATIO_EVENT_ID)
+		return tot > loc ? tot - loc : 0;
+
+	if (!denom)
+		return mbm_ratio(evt_type, loc, tot);
+
+	*denom = tot;
+	return loc;
 }
 
 static void intel_mbm_event_update(struct perf_event *event)
@@ -904,7 +1823,7 @@ static void intel_mbm_event_update(struct perf_event *event)
 	rmid = event->hw.cqm_rmid;
 	if (!__rmid_valid(rmid))
 		return;
-	val = rmid_read_mbm(rmid, event->attr.config);
+	val = mbm_read_event(rmid, event->attr.config, NULL);
 	/*
 	 * Ignore this reading on error states and do not update the value.
 	 */
@@ -914,151 +1833,138 @@ static void intel_mbm_event_update(struct perf_event *event)
 	local64_set(&event->count, val);
 }
 
-/*
- * Initially use this constant for both the limbo queue time and the
- * rotation timer interval, pmu::hrtimer_interval_ms.
- *
- * They don't need to be the same, but the two are related since if you
- * rotate faster than you recycle RMIDs, you may run out of available
- * RMIDs.
- */
-#define RMID_DEFAULT_QUEUE_TIME 250	/* ms */
-
-static unsigned int __rmid_queue_time_ms = RMID_DEFAULT_QUEUE_TIME;
-
 /*
  * intel_cqm_rmid_stabilize - move RMIDs from limbo to free list
- * @nr_available: number of freeable RMIDs on the limbo list
+ * @nr_available: number of RMIDs left in limbo
+ * @pressure: somebody is waiting for an RMID
  *
  * Quiescent state; wait for all 'freed' RMIDs to become unused, i.e. no
  * cachelines are tagged with those RMIDs. After this we can reuse them
  * and know that the current set of active RMIDs is stable.
  *
+ * Only the RMIDs due on the limbo wheel are read, in one batch per
+ * package. Those still dirty are put back on the wheel for when their
+ * occupancy is predicted to have drained, see cqm_limbo_predict().
+ *
  * Return %true or %false depending on whether stabilization needs to be
  * reattempted.
- *
- * If we return %true then @nr_available is updated to indicate the
- * number of RMIDs on the limbo list that have been queued for the
- * minimum queue time (RMID_AVAILABLE), but whose data occupancy values
- * are above __intel_cqm_threshold.
  */
-static bool intel_cqm_rmid_stabilize(unsigned int *available)
+static bool intel_cqm_rmid_stabilize(unsigned int *available, bool pressure)
 {
-	struct cqm_rmid_entry *entry, *tmp;
+	struct cqm_limbo_batch *b = &cqm_limbo_batch;
+	struct cqm_rmid_entry *entry;
+	unsigned long now = jiffies;
+	unsigned int i;
 
 	lockdep_assert_held(&cache_mutex);
 
-	*available = 0;
-	list_for_each_entry(entry, &cqm_rmid_limbo_lru, list) {
-		unsigned long min_queue_time;
-		unsigned long now = jiffies;
-
-		/*
-		 * We hold RMIDs placed into limbo for a minimum queue
-		 * time. Before the minimum queue time has elapsed we do
-		 * not recycle RMIDs.
-		 *
-		 * The reasoning is that until a sufficient time has
-		 * passed since we stopped using an RMID, any RMID
-		 * placed onto the limbo list will likely still have
-		 * data tagged in the cache, which means we'll probably
-		 * fail to recycle it anyway.
-		 *
-		 * We can save ourselves an expensive IPI by skipping
-		 * any RMIDs that have not been queued for the minimum
-		 * time.
-		 */
-		min_queue_time = entry->queue_time +
-			msecs_to_jiffies(__rmid_queue_time_ms);
-
-		if (time_after(min_queue_time, now))
-			break;
-
-		entry->state = RMID_AVAILABLE;
-		(*available)++;
-	}
+	cqm_limbo_collect(b, now, pressure);
+	*available = cqm_nr_limbo;
 
 	/*
-	 * Fast return if none of the RMIDs on the limbo list have been
-	 * sitting on the queue for the minimum queue time.
+	 * Fast return if nothing in limbo is worth reading yet.
 	 */
-	if (!*available)
+	if (!b->nr)
 		return false;
 
 	/*
 	 * Test whether an RMID is free for each package.
 	 */
-	on_each_cpu_mask(&cqm_cpumask, intel_cqm_stable, NULL, true);
+	memset(b->occ, 0, sizeof(b->occ[0]) * b->nr);
+	cqm_on_each_reader(intel_cqm_stable, b);
 
-	list_for_each_entry_safe(entry, tmp, &cqm_rmid_limbo_lru, list) {
-		/*
-		 * Exhausted all RMIDs that have waited min queue time.
-		 */
-		if (entry->state == RMID_YOUNG)
-			break;
+	for (i = 0; i < b->nr; i++) {
+		entry = b->entry[i];
 
-		if (entry->state == RMID_DIRTY)
+		if (b->occ[i] > __intel_cqm_threshold) {
+			trace_cqm_rmid_dirty(entry->rmid);
+			cqm_limbo_queue(entry, now +
+					cqm_limbo_predict(entry, b->occ[i], now));
 			continue;
+		}
 
-		list_del(&entry->list);	/* remove from limbo */
+		cqm_nr_limbo--;
 		intel_cqm_free_rmid(entry);
 	}
 
+	*available = cqm_nr_limbo;
 
 	return __rmid_valid(intel_cqm_rotation_rmid);
 }
 
 /*
  * Pick a victim group and move it to the tail of the group list.
- * @next: The first group without an RMID
+ * @next: The group without an RMID that gets one next
+ * @nr_needed: The number of groups without an RMID
+ *
+ * The victim is the best-effort group with an RMID that has the
+ * largest vrun; ties go to the one monitored longest. prio and pinned
+ * groups are never picked.
+ *
+ * Returns %false if @next has had at least as much monitored time as
+ * any victim, i.e. there is nothing fair to rotate.
  */
-static void __intel_cqm_pick_and_rotate(struct perf_event *next)
+static bool __intel_cqm_pick_and_rotate(struct perf_event *next,
+					unsigned int nr_needed)
 {
-	struct perf_event *rotor;
+	struct cqm_group *grp, *victim = NULL;
+	struct cqm_group *want = cqm_event_group(next);
+	u64 vrun, max_vrun = 0, now = ktime_get_ns();
 	u32 rmid;
 
 	lockdep_assert_held(&cache_mutex);
 
-	rotor = list_first_entry(&cache_groups, struct perf_event,
-				 hw.cqm_groups_entry);
+	list_for_each_entry(grp, &cqm_mon_groups, mon_entry) {
+		if (grp->prio || grp->pinned)
+			continue;
+
+		vrun = cqm_group_vrun(grp, now);
+		if (!victim || vrun > max_vrun) {
+			victim = grp;
+			max_vrun = vrun;
+		}
+	}
 
 	/*
-	 * The group at the front of the list should always have a valid
-	 * RMID. If it doesn't then no groups have RMIDs assigned and we
-	 * don't need to rotate the list.
+	 * No best-effort groups have RMIDs assigned, we don't need to
+	 * rotate.
 	 */
-	if (next == rotor)
-		return;
+	if (!victim)
+		return true;
+
+	if (!want->prio && max_vrun <= want->vrun)
+		return false;
 
-	rmid = intel_cqm_xchg_rmid(rotor, INVALID_RMID);
+	rmid = intel_cqm_xchg_rmid(victim->leader, INVALID_RMID);
+	trace_cqm_rotate(rmid, intel_cqm_rotation_rmid, nr_needed,
+			 __intel_cqm_threshold);
+	cqm_stat_inc(CQM_STAT_ROTATE);
 	__put_rmid(rmid);
 
-	list_rotate_left(&cache_groups);
+	list_move_tail(&victim->leader->hw.cqm_groups_entry, &cache_groups);
+
+	return true;
 }
 
 /*
- * Deallocate the RMIDs from any events that conflict with @event, and
- * place them on the back of the group list.
+ * Deallocate the RMIDs from any events that conflict with @event. Only
+ * groups with an RMID can conflict, so walk those.
  */
 static void intel_cqm_sched_out_conflicting_events(struct perf_event *event)
 {
-	struct perf_event *group, *g;
+	struct cqm_group *grp, *g;
+	struct perf_event *group;
 	u32 rmid;
 
 	lockdep_assert_held(&cache_mutex);
 
-	list_for_each_entry_safe(group, g, &cache_groups, hw.cqm_groups_entry) {
-		if (group == event)
+	list_for_each_entry_safe(grp, g, &cqm_mon_groups, mon_entry) {
+		group = grp->leader;
+		if (group == event || grp->pinned)
 			continue;
 
 		rmid = group->hw.cqm_rmid;
 
-		/*
-		 * Skip events that don't have a valid RMID.
-		 */
-		if (!__rmid_valid(rmid))
-			continue;
-
 		/*
 		 * No conflict? No problem! Leave the event alone.
 		 */
@@ -1070,6 +1976,26 @@ static void intel_cqm_sched_out_conflicting_events(struct perf_event *event)
 	}
 }
 
+/*
+ * The first waiting group that can be given an RMID without taking
+ * one from a pinned group.
+ *
+ * We expect to be called with cache_mutex held.
+ */
+static struct cqm_group *cqm_first_waiting(void)
+{
+	struct cqm_group *grp;
+	struct rb_node *node;
+
+	for (node = rb_first(&cqm_wait_tree); node; node = rb_next(node)) {
+		grp = rb_entry(node, struct cqm_group, wait_node);
+		if (!cqm_conflicts_pinned(grp->leader))
+			return grp;
+	}
+
+	return NULL;
+}
+
 /*
  * Attempt to rotate the groups and assign new RMIDs.
  *
@@ -1096,9 +2022,10 @@ static void intel_cqm_sched_out_conflicting_events(struct perf_event *event)
  */
 static bool __intel_cqm_rmid_rotate(void)
 {
-	struct perf_event *group, *start = NULL;
+	struct perf_event *start;
+	struct cqm_group *grp;
 	unsigned int threshold_limit;
-	unsigned int nr_needed = 0;
+	unsigned int nr_needed;
 	unsigned int nr_available;
 	bool rotated = false;
 
@@ -1109,22 +2036,16 @@ again:
 	 * Fast path through this function if there are no groups and no
 	 * RMIDs that need cleaning.
 	 */
-	if (list_empty(&cache_groups) && list_empty(&cqm_rmid_limbo_lru))
+	if (list_empty(&cache_groups) && !cqm_nr_limbo)
 		goto out;
 
-	list_for_each_entry(group, &cache_groups, hw.cqm_groups_entry) {
-		if (!__rmid_valid(group->hw.cqm_rmid)) {
-			if (!start)
-				start = group;
-			nr_needed++;
-		}
-	}
+	nr_needed = cqm_nr_waiting;
 
 	/*
 	 * We have some event groups, but they all have RMIDs assigned
 	 * and no RMIDs need cleaning.
 	 */
-	if (!nr_needed && list_empty(&cqm_rmid_limbo_lru))
+	if (!nr_needed && !cqm_nr_limbo)
 		goto out;
 
 	if (!nr_needed)
@@ -1135,21 +2056,42 @@ again:
 	 * or we have event groups that conflict with the ones currently
 	 * scheduled.
 	 *
-	 * We force deallocate the rmid of the group at the head of
-	 * cache_groups. The first event group without an RMID then gets
-	 * assigned intel_cqm_rotation_rmid. This ensures we always make
-	 * forward progress.
-	 *
-	 * Rotate the cache_groups list so the previous head is now the
-	 * tail.
+	 * We force deallocate the rmid of the victim group, and the first
+	 * group in cqm_wait_tree then gets assigned
+	 * intel_cqm_rotation_rmid. This ensures we always make forward
+	 * progress.
 	 */
-	__intel_cqm_pick_and_rotate(start);
+	grp = cqm_first_waiting();
+	if (!grp) {
+		/*
+		 * Every waiting group conflicts with a pinned one; none
+		 * of them can be given an RMID, so only clean limbo on
+		 * this pass.
+		 */
+		nr_needed = 0;
+		goto stabilize;
+	}
+	start = grp->leader;
+
+	/*
+	 * Nobody can fairly give up an RMID to @start; stealing more
+	 * won't change that, so only clean limbo on this pass.
+	 */
+	if (!__intel_cqm_pick_and_rotate(start, nr_needed)) {
+		nr_needed = 0;
+		goto stabilize;
+	}
 
 	/*
 	 * If the rotation is going to succeed, reduce the threshold so
 	 * that we don't needlessly reuse dirty RMIDs.
+	 *
+	 * A victim RMID that needs no cleaning may have gone straight to
+	 * @start already, see intel_cqm_free_rmid().
 	 */
-	if (__rmid_valid(intel_cqm_rotation_rmid)) {
+	if (__rmid_valid(intel_cqm_rotation_rmid) &&
+	    !__rmid_valid(start->hw.cqm_rmid)) {
+		cqm_min_vrun = max(cqm_min_vrun, grp->vrun);
 		intel_cqm_xchg_rmid(start, intel_cqm_rotation_rmid);
 		intel_cqm_rotation_rmid = __get_rmid();
 
@@ -1172,7 +2114,7 @@ stabilize:
 	 */
 	threshold_limit = __intel_cqm_max_threshold / cqm_l3_scale;
 
-	while (intel_cqm_rmid_stabilize(&nr_available) &&
+	while (intel_cqm_rmid_stabilize(&nr_available, nr_needed) &&
 	       __intel_cqm_threshold < threshold_limit) {
 		unsigned int steal_limit;
 
@@ -1184,8 +2126,8 @@ stabilize:
 		if (!nr_needed)
 			break;
 
-		/* Allow max 25% of RMIDs to be in limbo. */
-		steal_limit = (cqm_max_rmid + 1) / 4;
+		/* Allow max 25% of unreserved RMIDs to be in limbo. */
+		steal_limit = (cqm_max_rmid + 1 - cqm_nr_reserved) / 4;
 
 		/*
 		 * We failed to stabilize any RMIDs so our rotation
@@ -1213,6 +2155,8 @@ stabilize:
 			goto again;
 
 		__intel_cqm_threshold++;
+		trace_cqm_threshold(__intel_cqm_threshold, nr_available);
+		cqm_limbo_reap();
 	}
 
 out:
@@ -1226,36 +2170,83 @@ static DECLARE_DELAYED_WORK(intel_cqm_rmid_work, intel_cqm_rmid_rotate);
 
 static struct pmu intel_cqm_pmu;
 
+static int intel_rdt_check_closid(struct perf_event *event,
+				  struct perf_event *group);
+
 static void intel_cqm_rmid_rotate(struct work_struct *work)
 {
 	unsigned long delay;
+	u64 start = cqm_lat_start();
 
 	__intel_cqm_rmid_rotate();
+	cqm_lat_record(CQM_LAT_ROTATE, start);
 
 	delay = msecs_to_jiffies(intel_cqm_pmu.hrtimer_interval_ms);
 	schedule_delayed_work(&intel_cqm_rmid_work, delay);
 }
 
+/*
+ * A group is as important as its most important event.
+ *
+ * We expect to be called with cache_mutex held.
+ */
+static void cqm_group_update_class(struct cqm_group *grp,
+				   struct perf_event *event)
+{
+	bool waiting = !RB_EMPTY_NODE(&grp->wait_node);
+
+	if (waiting)
+		cqm_wait_dequeue(grp);
+
+	grp->prio |= cqm_event_prio(event);
+	grp->weight = max(grp->weight, cqm_event_weight(event));
+
+	if (waiting)
+		cqm_wait_enqueue(grp);
+}
+
 /*
  * Find a group and setup RMID.
  *
  * If we're part of a group, we use the group's RMID.
+ *
+ * Returns -EBUSY if the group's tasks are already assigned to a
+ * different CLOSID.
+ *
+ * @link comes with a new cqm_group, which is used if we start a group
+ * and freed if we join one.
  */
-static void intel_cqm_setup_event(struct perf_event *event,
-				  struct perf_event **group)
+static int intel_cqm_setup_event(struct perf_event *event,
+				 struct perf_event **group,
+				 struct cqm_group_link *link)
 {
+	struct cqm_group *grp;
 	struct perf_event *iter;
 	bool conflict = false;
-	u32 rmid, cpu = smp_processor_id();
+	u32 rmid;
 
 	list_for_each_entry(iter, &cache_groups, hw.cqm_groups_entry) {
 		rmid = iter->hw.cqm_rmid;
 
 		if (__match_event(iter, event)) {
+			if (intel_rdt_check_closid(event, iter))
+				return -EBUSY;
+
+			if (cqm_event_pinned(iter) != cqm_event_pinned(event))
+				return -EBUSY;
+
 			/* All tasks in a group share an RMID */
 			event->hw.cqm_rmid = rmid;
 			*group = iter;
-			return;
+
+			kfree(link->group);
+			link->group = cqm_event_group(iter);
+			link->group->nr_events++;
+			if ((iter->attr.config  != event->attr.config) ||
+			    (iter->attr.config1 != event->attr.config1))
+				link->group->multi_event = true;
+			cqm_group_update_class(link->group, event);
+			return 0;
 		}
 
 		/*
@@ -1266,21 +2257,77 @@ static void intel_cqm_setup_event(struct perf_event *event,
 			conflict = true;
 	}
 
-	if (conflict)
+	/*
+	 * A pinned group gets a reserved RMID or nothing, and makes room
+	 * for itself unless another pinned group is in the way.
+	 */
+	if (cqm_event_pinned(event)) {
+		if (cqm_conflicts_pinned(event))
+			return -EBUSY;
+
+		rmid = __get_reserved_rmid();
+		if (!__rmid_valid(rmid)) {
+			cqm_stat_inc(CQM_STAT_RMID_EXHAUSTED);
+			return -ENOSPC;
+		}
+	} else if (conflict) {
 		rmid = INVALID_RMID;
-	else
+	} else {
 		rmid = __get_rmid();
+		/* Left for the rotation worker to hand it one. */
+		if (!__rmid_valid(rmid))
+			cqm_stat_inc(CQM_STAT_RMID_EXHAUSTED);
+	}
 
-	if (event->attr.config == QOS_L3_OCCUP_EVENT_ID) {
+	if (cqm_occup_event(event) && __rmid_valid(rmid)) {
 		struct cqm_rmid_entry *entry;
 
 		entry = __rmid_entry(rmid);
 		entry->is_cqm = true;
 	}
-	printk(KERN_WARNING "event_setup rmid %d config %d cpu %d pid %d\n",rmid,event->attr.config,cpu,current->pid);
 	event->hw.cqm_rmid = rmid;
-	if ((event->attr.config >= QOS_MBM_TOTAL_EVENT_ID) && (event->attr.config <= QOS_MBM_LOCAL_AVG_EVENT_ID))
-		rmid_read_mbm(rmid, event->attr.config);
+	if (cqm_mbm_event(event))
+		mbm_read_event(rmid, event->attr.config, NULL);
+
+	grp = link->group;
+	grp->created = ktime_get_ns();
+	grp->since = grp->created;
+	grp->vrun = cqm_min_vrun;
+	grp->weight = cqm_event_weight(event);
+	grp->prio = cqm_event_prio(event);
+	grp->pinned = cqm_event_pinned(event);
+	grp->leader = event;
+	grp->nr_events = 1;
+	RB_CLEAR_NODE(&grp->wait_node);
+	INIT_LIST_HEAD(&grp->mon_entry);
+	cqm_group_set_monitored(grp, __rmid_valid(rmid));
+
+	if (grp->pinned && conflict)
+		intel_cqm_sched_out_conflicting_events(event);
+
+	return 0;
+}
+
+static void intel_cqm_mux_read(struct perf_event *event)
+{
+	struct cqm_group *grp;
+	unsigned long flags;
+	u64 now, val;
+
+	rcu_read_lock();
+	grp = cqm_event_group(event);
+	if (grp) {
+		raw_spin_lock_irqsave(&cache_lock, flags);
+		now = ktime_get_ns();
+		if (event->attr.config == QOS_RMID_ENABLED_EVENT_ID)
+			val = now - grp->created;
+		else
+			val = cqm_group_running(grp, event->hw.cqm_rmid, now);
+		raw_spin_unlock_irqrestore(&cache_lock, flags);
+
+		local64_set(&event->count, val);
+	}
+	rcu_read_unlock();
 }
 
 static void intel_cqm_event_read(struct perf_event *event)
@@ -1294,9 +2341,13 @@ static void intel_cqm_event_read(struct perf_event *event)
 	 */
 	if (event->cpu == -1)
 		return;
-	printk(KERN_WARNING "event_read rmid %d config %d cpu %d pid %d \n",event->hw.cqm_rmid,event->attr.config,smp_processor_id(),current->pid);
-	if  ((event->attr.config >= QOS_MBM_TOTAL_EVENT_ID) &&
-	     (event->attr.config <= QOS_MBM_LOCAL_AVG_EVENT_ID))
+
+	if (cqm_mux_event(event)) {
+		intel_cqm_mux_read(event);
+		return;
+	}
+
+	if (cqm_mbm_event(event))
 		intel_mbm_event_update(event);
 
 	if (event->attr.config !=  QOS_L3_OCCUP_EVENT_ID)
@@ -1339,6 +2390,64 @@ static inline bool cqm_group_leader(struct perf_event *event)
 	return !list_empty(&event->hw.cqm_groups_entry);
 }
 
+/*
+ * attr.config1 node_filter restricts a task event to the domain of NUMA
+ * node @node, so a NUMA balancer can get node-level local and remote
+ * bandwidth per job. With SNC that is the node itself, without it the
+ * package the node is in.
+ */
+#define CQM_NODE_FILTER		BIT_ULL(1)
+#define CQM_NODE_SHIFT		32
+#define CQM_NODE_MASK		0xffff
+
+static inline bool cqm_event_node_filter(struct perf_event *event)
+{
+	return event->attr.config1 & CQM_NODE_FILTER;
+}
+
+static inline int cqm_event_node(struct perf_event *event)
+{
+	return (event->attr.config1 >> CQM_NODE_SHIFT) & CQM_NODE_MASK;
+}
+
+/*
+ * The reader covering @node, -1 if it has no online cpus.
+ */
+static int cqm_node_reader(int node)
+{
+	int cpu, i;
+
+	cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		return -1;
+
+	for_each_cpu(i, &cqm_cpumask) {
+		if (cqm_domain_id(i) == cqm_domain_id(cpu))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Run @func on the readers @event counts on: all of them, or the one of
+ * its node.
+ */
+static void cqm_on_event_readers(struct perf_event *event,
+				 smp_call_func_t func, void *info)
+{
+	int cpu;
+
+	if (!cqm_event_node_filter(event)) {
+		cqm_on_each_reader(func, info);
+		return;
+	}
+
+	cpu = cqm_node_reader(cqm_event_node(event));
+	if (cpu >= 0)
+		smp_call_function_single(cpu, func, info, 1);
+}
+
 static void mbm_stop_hrtimer(struct mbm_pmu *pmu)
 {
 	hrtimer_cancel(&pmu->hrtimer);
@@ -1347,21 +2456,34 @@ static void mbm_stop_hrtimer(struct mbm_pmu *pmu)
 static void __intel_mbm_event_count(void *info)
 {
 	struct rmid_read *rr = info;
-	u64 val;
+	u64 val, denom = 0;
 
-	val = rmid_read_mbm(rr->rmid, rr->evt_type);
+	val = mbm_read_event(rr->rmid, rr->evt_type, &denom);
 	if (val & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL))
 		return;
 
 	atomic64_add(val, &rr->value);
+	atomic64_add(denom, &rr->denom);
+}
+
+/*
+ * The value of @rr summed over the packages read.
+ */
+static u64 rmid_read_value(struct rmid_read *rr)
+{
+	u64 val = atomic64_read(&rr->value);
+
+	if (mbm_ratio_event(rr->evt_type))
+		return mbm_ratio(rr->evt_type, val, atomic64_read(&rr->denom));
+
+	return val;
 }
 
 static u64 intel_mbm_event_count(struct perf_event *event, struct rmid_read *rr)
 {
 	struct mbm_pmu *pmu = __this_cpu_read(mbm_pmu);
 
-	on_each_cpu_mask(&cqm_cpumask, __intel_mbm_event_count,
-		   rr, 1);
+	cqm_on_event_readers(event, __intel_mbm_event_count, rr);
 	if (pmu) {
 		pmu->n_active--;
 		if (pmu->n_active == 0)
@@ -1369,13 +2491,14 @@ static u64 intel_mbm_event_count(struct perf_event *event, struct rmid_read *rr)
 	}
 
 	if (event->hw.cqm_rmid == rr->rmid)
-		local64_set(&event->count, atomic64_read(&rr->value));
+		local64_set(&event->count, rmid_read_value(rr));
 	return __perf_event_count(event);
 
 }
 static u64 intel_cqm_event_count(struct perf_event *event)
 {
 	unsigned long flags;
+	u64 count, start;
 	struct rmid_read rr = {
 		.value = ATOMIC64_INIT(0),
 	};
@@ -1385,10 +2508,16 @@ static u64 intel_cqm_event_count(struct perf_event *event)
 	 * are handled like usual, i.e. entirely with
 	 * intel_cqm_event_read().
 	 */
-	printk(KERN_WARNING "event_count rmid %d config %d cpu %d pid %d \n",event->hw.cqm_rmid,event->attr.config,smp_processor_id(),current->pid);
 	if (event->cpu != -1)
 		return __perf_event_count(event);
 
+	/*
+	 * The user page is being refreshed from a snapshot we've just
+	 * taken, don't go and read the hardware again.
+	 */
+	if (__this_cpu_read(cqm_userpage_update))
+		return __perf_event_count(event);
+
 	/*
 	 * Only the group leader gets to report values. This stops us
 	 * reporting duplicate values to userspace, and gives us a clear
@@ -1398,12 +2527,16 @@ static u64 intel_cqm_event_count(struct perf_event *event)
 	 * specific packages - we forfeit that ability when we create
 	 * task events.
 	 */
-	if (!cqm_group_leader(event)) {
-		struct cqm_rmid_entry *entry;
+	if (!cqm_group_leader(event) && !cqm_event_multi(event))
+		return 0;
 
-		entry = __rmid_entry(event->hw.cqm_rmid);
-		if (!entry->is_multi_event)
-			return 0;
+	/*
+	 * No hardware involved, and the answer is just as good while
+	 * the group is rotated out.
+	 */
+	if (cqm_mux_event(event)) {
+		intel_cqm_mux_read(event);
+		return __perf_event_count(event);
 	}
 
 	/*
@@ -1427,25 +2560,162 @@ static u64 intel_cqm_event_count(struct perf_event *event)
 	 */
 	rr.rmid = ACCESS_ONCE(event->hw.cqm_rmid);
 
+	/*
+	 * Rotated out: hold the last value, i.e. the last measured
+	 * bandwidth for MBM events. rmid_time_running tells how much of
+	 * the time that is an estimate.
+	 */
 	if (!__rmid_valid(rr.rmid))
 		goto out;
 
+	start = cqm_lat_start();
+
 	if (event->attr.config == QOS_L3_OCCUP_EVENT_ID)
-		on_each_cpu_mask(&cqm_cpumask, __intel_cqm_event_count, &rr, 1);
+		cqm_on_event_readers(event, __intel_cqm_event_count, &rr);
 
-	if (((event->attr.config >= QOS_MBM_TOTAL_EVENT_ID) &&
-	     (event->attr.config <= QOS_MBM_LOCAL_AVG_EVENT_ID))  && (is_mbm)) {
+	if (cqm_mbm_event(event) && is_mbm) {
 		rr.evt_type = event->attr.config;
-		return intel_mbm_event_count(event, &rr);
+		count = intel_mbm_event_count(event, &rr);
+		cqm_lat_record(CQM_LAT_COUNT, start);
+		return count;
 	}
 	raw_spin_lock_irqsave(&cache_lock, flags);
 	if (event->hw.cqm_rmid == rr.rmid)
 		local64_set(&event->count, atomic64_read(&rr.value));
 	raw_spin_unlock_irqrestore(&cache_lock, flags);
+	cqm_lat_record(CQM_LAT_COUNT, start);
 out:
 	return __perf_event_count(event);
 }
 
+/*
+ * Self-monitoring through the perf mmap user page.
+ *
+ * Reading a task event with read() costs a syscall plus an IPI to every
+ * package. Tasks that mmap() their event instead get the most recent
+ * value published in perf_event_mmap_page::offset, updated under the
+ * page's sequence lock (->lock) by intel_cqm_userpage_work. Userspace
+ * then reads it with plain loads:
+ *
+ *	do {
+ *		seq = pc->lock;
+ *		barrier();
+ *		count = pc->offset;
+ *		barrier();
+ *	} while (pc->lock != seq);
+ *
+ * pc->index is always 0, there is no counter to rdpmc.
+ *
+ * Only task events are published this way; system-wide and cgroup
+ * events are per-package and read on the designated reader cpus by
+ * intel_cqm_event_read().
+ *
+ * The page is refreshed every publish_interval_ms, independent of the
+ * rotation interval. MBM events don't get new bandwidth more often than
+ * every MBM_READ_DELTA_MIN_NS, so that is the default.
+ */
+#define CQM_PUBLISH_MS_DEFAULT	(MBM_READ_DELTA_MIN_NS / NSEC_PER_MSEC)
+#define CQM_PUBLISH_MS_MAX	MSEC_PER_SEC
+
+static unsigned int cqm_publish_interval_ms = CQM_PUBLISH_MS_DEFAULT;
+static atomic_t cqm_mapped_events = ATOMIC_INIT(0);
+
+static void intel_cqm_userpage_update(struct work_struct *work);
+
+static DECLARE_DELAYED_WORK(intel_cqm_userpage_work,
+			    intel_cqm_userpage_update);
+
+static bool cqm_event_published(struct perf_event *event)
+{
+	if (event->cpu != -1 || !READ_ONCE(event->rb))
+		return false;
+
+	/*
+	 * Same rule as intel_cqm_event_count(), only the group leader
+	 * reports values unless the group mixes event types.
+	 */
+	if (!cqm_group_leader(event) && !cqm_event_multi(event))
+		return false;
+
+	return true;
+}
+
+/*
+ * Take a snapshot of @event's value across all packages and publish it
+ * in the event's user page.
+ *
+ * We expect to be called with cache_mutex held, which keeps
+ * event->hw.cqm_rmid stable across the IPIs.
+ */
+static void intel_cqm_event_publish(struct perf_event *event)
+{
+	struct rmid_read rr = {
+		.value = ATOMIC64_INIT(0),
+		.rmid = event->hw.cqm_rmid,
+		.evt_type = event->attr.config,
+	};
+
+	lockdep_assert_held(&cache_mutex);
+
+	if (!cqm_event_published(event))
+		return;
+
+	if (__rmid_valid(rr.rmid)) {
+		if (event->attr.config == QOS_L3_OCCUP_EVENT_ID)
+			cqm_on_each_reader(__intel_cqm_event_count, &rr);
+		else if (is_mbm)
+			cqm_on_each_reader(__intel_mbm_event_count, &rr);
+
+		local64_set(&event->count, rmid_read_value(&rr));
+	}
+
+	/*
+	 * perf_event_update_userpage() calls back into
+	 * intel_cqm_event_count(), make that return the value we just
+	 * stored.
+	 */
+	preempt_disable();
+	__this_cpu_write(cqm_userpage_update, true);
+	perf_event_update_userpage(event);
+	__this_cpu_write(cqm_userpage_update, false);
+	preempt_enable();
+}
+
+static void intel_cqm_userpage_update(struct work_struct *work)
+{
+	struct perf_event *group, *event;
+	unsigned long delay;
+
+	mutex_lock(&cache_mutex);
+	list_for_each_entry(group, &cache_groups, hw.cqm_groups_entry) {
+		intel_cqm_event_publish(group);
+		list_for_each_entry(event, &group->hw.cqm_group_entry,
+				    hw.cqm_group_entry)
+			intel_cqm_event_publish(event);
+	}
+	mutex_unlock(&cache_mutex);
+
+	/*
+	 * Keep going for as long as somebody has an event mapped.
+	 */
+	if (!atomic_read(&cqm_mapped_events))
+		return;
+
+	delay = msecs_to_jiffies(READ_ONCE(cqm_publish_interval_ms));
+	schedule_delayed_work(&intel_cqm_userpage_work, delay);
+}
+
+static void intel_cqm_event_mapped(struct perf_event *event)
+{
+	if (atomic_inc_return(&cqm_mapped_events) == 1)
+		schedule_delayed_work(&intel_cqm_userpage_work, 0);
+}
+
+static void intel_cqm_event_unmapped(struct perf_event *event)
+{
+	atomic_dec(&cqm_mapped_events);
+}
+
 static void mbm_start_hrtimer(struct mbm_pmu *pmu)
 {
 	hrtimer_start_range_ns(&(pmu->hrtimer),
@@ -1458,6 +2728,8 @@ static enum hrtimer_restart mbm_hrtimer_handle(struct hrtimer *hrtimer)
 	struct mbm_pmu *pmu = __this_cpu_read(mbm_pmu);
 	struct perf_event *event;
 
+	cqm_stat_inc(CQM_STAT_HRTIMER);
+
 	if (!pmu->n_active)
 		return HRTIMER_NORESTART;
 	list_for_each_entry(event, &pmu->active_list, active_entry)
@@ -1477,8 +2749,7 @@ static void mbm_hrtimer_init(struct mbm_pmu *pmu)
 static void intel_mbm_event_start(struct perf_event *event, int mode)
 {
 
-	if (((event->attr.config >= QOS_MBM_TOTAL_EVENT_ID) &&
-	     (event->attr.config <= QOS_MBM_LOCAL_EVENT_ID))  && (is_mbm)) {
+	if (cqm_mbm_timed_event(event) && is_mbm) {
 		struct mbm_pmu *pmu = __this_cpu_read(mbm_pmu);
 
 		if (pmu) {
@@ -1492,395 +2763,1822 @@ static void intel_mbm_event_start(struct perf_event *event, int mode)
 
 }
 
-static void intel_cqm_event_start(struct perf_event *event, int mode)
-{
-	struct intel_pqr_state *state = this_cpu_ptr(&pqr_state);
-	u32 rmid = event->hw.cqm_rmid;
+/*
+ * L3 Cache Allocation Technology (CAT).
+ *
+ * Each Class Of Service ID (CLOSID) has a capacity bitmask (CBM) of the
+ * L3 ways its tasks may allocate into, programmed per package in
+ * MSR_IA32_L3_CBM_BASE + closid. CLOSID 0 is what every unassigned task
+ * runs with and always keeps the full mask.
+ *
+ * Tasks and cgroups are assigned to a CLOSID by opening an intel_cqm
+ * event for them with attr.config1 closid=N. The CLOSID travels in
+ * intel_pqr_state next to the RMID, so monitoring and allocation share
+ * the one PQR_ASSOC write done when the event (or, for sched_assoc
+ * events, the task) is scheduled in.
+ *
+ * The masks are set through the "cat/l3_cbm" attribute and protected by
+ * cache_mutex.
+ */
+#define MSR_IA32_L3_CBM_BASE	0x0c90
 
-	if (!(event->hw.cqm_state & PERF_HES_STOPPED))
-		return;
+/* attr.config1 bits, see below for sched_assoc */
+#define CQM_SCHED_ASSOC		BIT_ULL(0)
 
-	event->hw.cqm_state &= ~PERF_HES_STOPPED;
+#define CQM_CLOSID_SHIFT	16
+#define CQM_CLOSID_MASK		0xffff
 
-	if (state->rmid_usecnt++) {
-		if (!WARN_ON_ONCE(state->rmid != rmid))
-			return;
-	} else {
-		WARN_ON_ONCE(state->rmid);
-	}
+#define CQM_CONFIG1_MASK	(CQM_SCHED_ASSOC | CQM_NODE_FILTER | CQM_PRIO | \
+				 CQM_PIN | \
+				 ((u64)CQM_CLOSID_MASK << CQM_CLOSID_SHIFT) | \
+				 ((u64)CQM_NODE_MASK << CQM_NODE_SHIFT) | \
+				 ((u64)CQM_WEIGHT_MASK << CQM_WEIGHT_SHIFT))
 
-	state->rmid = rmid;
-	wrmsr(MSR_IA32_PQR_ASSOC, rmid, state->closid);
-	intel_mbm_event_start(event, mode);
+static bool is_cat;
+static u32 cat_max_closid;
+static u32 cat_cbm_len;
+static u32 *cat_cbm;
 
+static inline u32 cqm_event_closid(struct perf_event *event)
+{
+	return (event->attr.config1 >> CQM_CLOSID_SHIFT) & CQM_CLOSID_MASK;
 }
 
-static void intel_mbm_event_stop(struct perf_event *event, int mode)
+/*
+ * A valid CBM is non-empty, fits in cat_cbm_len bits and, as required
+ * by the hardware, has all its bits set contiguously.
+ */
+static bool cat_cbm_valid(unsigned long cbm)
 {
-	struct mbm_pmu *pmu = __this_cpu_read(mbm_pmu);
+	unsigned long first, zero;
 
-	if (pmu) {
-		intel_mbm_event_update(event);
-		if ((pmu->n_active >  0) && (event->cpu != -1))
-			pmu->n_active--;
-			if (pmu->n_active == 0)
-				mbm_stop_hrtimer(pmu);
-		if (!list_empty(&event->active_entry))
-			list_del(&event->active_entry);
-	}
+	if (!cbm || cbm >= BIT(cat_cbm_len))
+		return false;
+
+	first = find_first_bit(&cbm, cat_cbm_len);
+	zero = find_next_zero_bit(&cbm, cat_cbm_len, first);
 
+	return find_next_bit(&cbm, cat_cbm_len, zero) == cat_cbm_len;
 }
 
-static void intel_cqm_event_stop(struct perf_event *event, int mode)
-{
-	struct intel_pqr_state *state = this_cpu_ptr(&pqr_state);
+/*
+ * One per-CLOSID control MSR value (CBM or MBA delay) to program on
+ * every package.
+ */
+struct rdt_ctrl_update {
+	u32 closid;
+	u32 val;
+};
 
-	if (event->hw.cqm_state & PERF_HES_STOPPED)
-		return;
+static void __intel_cat_update_cbm(void *info)
+{
+	struct rdt_ctrl_update *cu = info;
 
-	event->hw.cqm_state |= PERF_HES_STOPPED;
+	cqm_wrmsrl(MSR_IA32_L3_CBM_BASE + cu->closid, cu->val);
+}
 
-	if (event->attr.config == QOS_L3_OCCUP_EVENT_ID)
-		intel_cqm_event_read(event);
-	printk(KERN_WARNING "event_stop rmid %d config %d cpu %d pid %d \n",event->hw.cqm_rmid,event->attr.config,smp_processor_id(),current->pid);
-	if ((event->attr.config >= QOS_MBM_TOTAL_EVENT_ID) &&
-	    (event->attr.config <= QOS_MBM_LOCAL_EVENT_ID))
-		intel_mbm_event_update(event);
+/*
+ * We expect to be called with cache_mutex held.
+ */
+static int intel_cat_set_cbm(u32 closid, u32 cbm)
+{
+	struct rdt_ctrl_update cu = {
+		.closid = closid,
+		.val = cbm,
+	};
 
-	if (!--state->rmid_usecnt) {
-		state->rmid = 0;
-		wrmsr(MSR_IA32_PQR_ASSOC, 0, state->closid);
-	} else {
-		WARN_ON_ONCE(!state->rmid);
-	}
+	lockdep_assert_held(&cache_mutex);
 
-	intel_mbm_event_stop(event, mode);
+	if (!closid || closid >= cat_max_closid || !cat_cbm_valid(cbm))
+		return -EINVAL;
+
+	if (cat_cbm[closid] == cbm)
+		return 0;
+
+	cat_cbm[closid] = cbm;
+	cqm_on_each_reader(__intel_cat_update_cbm, &cu);
+
+	return 0;
 }
 
-static int intel_cqm_event_add(struct perf_event *event, int mode)
+/*
+ * Program all CBMs on this cpu's package; for packages coming online.
+ */
+static void intel_cat_cpu_starting(void)
 {
-	unsigned long flags;
-	u32 rmid;
+	u32 closid;
 
-	raw_spin_lock_irqsave(&cache_lock, flags);
+	if (!is_cat)
+		return;
 
-	event->hw.cqm_state = PERF_HES_STOPPED;
-	rmid = event->hw.cqm_rmid;
+	for (closid = 0; closid < cat_max_closid; closid++)
+		cqm_wrmsrl(MSR_IA32_L3_CBM_BASE + closid, cat_cbm[closid]);
+}
 
-	if (__rmid_valid(rmid) && (mode & PERF_EF_START))
-		intel_cqm_event_start(event, mode);
+static void __intel_cat_reset(void *info)
+{
+	intel_cat_cpu_starting();
+}
 
-	raw_spin_unlock_irqrestore(&cache_lock, flags);
+/*
+ * Memory Bandwidth Allocation (MBA) and the bandwidth controller.
+ *
+ * MBA throttles the memory requests of a CLOSID with a delay value
+ * (percent, in steps of MBA_DELAY_STEP) programmed per package in
+ * MSR_IA32_MBA_THRTL_BASE + closid.
+ *
+ * The controller holds each CLOSID with a target (mba/target_mbps) to
+ * its bandwidth budget: every MBA_CTRL_INTERVAL_MS it reads the MBM
+ * counters of all groups running under that CLOSID, sums their total
+ * bandwidth over the interval and moves the delay one step up or down
+ * when the sum leaves the [target - hysteresis, target + hysteresis]
+ * band. After a change the CLOSID is left alone for MBA_CTRL_HOLDOFF
+ * intervals so the bandwidth can settle at the new throttle level.
+ *
+ * The controller keeps its own samples of the counters (mbm_pkg::mba),
+ * apart from those of the MBM events: it must see the bandwidth whether
+ * or not anybody reads the events, and must not move their baselines.
+ *
+ * The decision itself, mba_ctrl_step(), is a pure function of the
+ * current and maximum delay, the measured bandwidth and the target;
+ * mba_ctrl_adjust() applies it to all CLOSIDs with the holdoff.
+ */
+#define MSR_IA32_MBA_THRTL_BASE	0x0d50
+
+#define MBA_DELAY_STEP		10
+#define MBA_CTRL_INTERVAL_MS	MBM_TIME_DELTA_EXP
+#define MBA_CTRL_HOLDOFF	3
+#define MBA_CTRL_HYST_PCT	10
+
+static bool is_mba;
+static u32 mba_max_closid;
+static u32 mba_max_delay;
+
+/**
+ * struct mba_ctrl - bandwidth controller state of one CLOSID
+ * @target:	bandwidth budget in MB/sec, 0 if uncontrolled
+ * @delay:	currently programmed throttle delay
+ * @holdoff:	intervals to wait before the next adjustment
+ * @bw:		last measured bandwidth in MB/sec
+ */
+struct mba_ctrl {
+	u32 target;
+	u32 delay;
+	u32 holdoff;
+	u64 bw;
+};
+
+static struct mba_ctrl *mba_ctrl;
+
+/**
+ * struct mba_sample - the controller's sample of one RMID on one package
+ * @total:	total counter value at @time
+ * @local:	local counter value at @time
+ * @time:	when the counters were read
+ * @total_bw:	total bandwidth since the previous read, counts/sec
+ * @local_bw:	local bandwidth since the previous read, counts/sec
+ */
+struct mba_sample {
+	u64 total;
+	u64 local;
+	ktime_t time;
+	u64 total_bw;
+	u64 local_bw;
+};
+
+static void intel_mba_ctrl_update(struct work_struct *work);
+
+static DECLARE_DELAYED_WORK(intel_mba_ctrl_work, intel_mba_ctrl_update);
+
+/*
+ * Return the new delay, at most @max_delay, for a CLOSID currently at
+ * @delay that consumes @bw MB/sec against a budget of @target MB/sec.
+ */
+static u32 mba_ctrl_step(u32 delay, u32 max_delay, u64 bw, u32 target)
+{
+	u64 hyst = div_u64((u64)target * MBA_CTRL_HYST_PCT, 100);
+
+	if (bw > target + hyst && delay + MBA_DELAY_STEP <= max_delay)
+		return delay + MBA_DELAY_STEP;
+
+	if (bw + hyst < target && delay >= MBA_DELAY_STEP)
+		return delay - MBA_DELAY_STEP;
+
+	return delay;
+}
+
+/*
+ * The number of CLOSIDs usable with all allocation features present.
+ */
+static u32 intel_rdt_max_closid(void)
+{
+	if (is_cat && is_mba)
+		return min(cat_max_closid, mba_max_closid);
+
+	return is_cat ? cat_max_closid : (is_mba ? mba_max_closid : 0);
+}
+
+/*
+ * -EINVAL if @event asks for a CLOSID the hardware doesn't have, -EBUSY
+ * if it would join @group (if any) under another CLOSID: all tasks of a
+ * group share one PQR_ASSOC value.
+ */
+static int intel_rdt_check_closid(struct perf_event *event,
+				  struct perf_event *group)
+{
+	if (cqm_event_closid(event) >= max(intel_rdt_max_closid(), 1U))
+		return -EINVAL;
+
+	if (group && cqm_event_closid(group) != cqm_event_closid(event))
+		return -EBUSY;
 
 	return 0;
 }
 
-static void intel_cqm_event_destroy(struct perf_event *event)
+static void __intel_mba_update_delay(void *info)
 {
-	struct perf_event *group_other = NULL;
+	struct rdt_ctrl_update *cu = info;
 
-	mutex_lock(&cache_mutex);
+	cqm_wrmsrl(MSR_IA32_MBA_THRTL_BASE + cu->closid, cu->val);
+}
 
-	/*
-	 * If there's another event in this group...
-	 */
-	if (!list_empty(&event->hw.cqm_group_entry)) {
-		group_other = list_first_entry(&event->hw.cqm_group_entry,
-					       struct perf_event,
-					       hw.cqm_group_entry);
-		list_del(&event->hw.cqm_group_entry);
-	}
+/*
+ * We expect to be called with cache_mutex held.
+ */
+static void intel_mba_set_delay(u32 closid, u32 delay)
+{
+	struct rdt_ctrl_update cu = {
+		.closid = closid,
+		.val = delay,
+	};
 
-	/*
-	 * And we're the group leader..
-	 */
-	if (cqm_group_leader(event)) {
-		/*
-		 * If there was a group_other, make that leader, otherwise
-		 * destroy the group and return the RMID.
-		 */
-		if (group_other) {
-			list_replace(&event->hw.cqm_groups_entry,
-				     &group_other->hw.cqm_groups_entry);
-		} else {
-			u32 rmid = event->hw.cqm_rmid;
+	lockdep_assert_held(&cache_mutex);
 
-			if (__rmid_valid(rmid))
-				__put_rmid(rmid);
-			list_del(&event->hw.cqm_groups_entry);
+	if (mba_ctrl[closid].delay == delay)
+		return;
+
+	mba_ctrl[closid].delay = delay;
+	cqm_on_each_reader(__intel_mba_update_delay, &cu);
+}
+
+/*
+ * Move every CLOSID with a target a step towards it, going by the
+ * bandwidth in mba_ctrl[].bw. Returns whether any CLOSID has a target.
+ *
+ * We expect to be called with cache_mutex held.
+ */
+static bool mba_ctrl_adjust(void)
+{
+	bool active = false;
+	u32 closid;
+
+	lockdep_assert_held(&cache_mutex);
+
+	for (closid = 1; closid < mba_max_closid; closid++) {
+		struct mba_ctrl *mc = &mba_ctrl[closid];
+		u32 delay;
+
+		if (!mc->target)
+			continue;
+
+		active = true;
+
+		if (mc->holdoff) {
+			mc->holdoff--;
+			continue;
+		}
+
+		delay = mba_ctrl_step(mc->delay, mba_max_delay, mc->bw,
+				      mc->target);
+		if (delay != mc->delay) {
+			intel_mba_set_delay(closid, delay);
+			mc->holdoff = MBA_CTRL_HOLDOFF;
 		}
 	}
 
-	mutex_unlock(&cache_mutex);
+	return active;
 }
 
-static int intel_cqm_event_init(struct perf_event *event)
+/*
+ * Read both MBM counters of @rmid on this package into @ms at @now.
+ * Returns whether the bandwidth in @ms covers a whole interval. If the
+ * previous read is too old for the 24-bit counters to have wrapped at
+ * most once since, as for an RMID the controller hasn't read before,
+ * @ms only takes new baselines; if a counter can't be read, it keeps
+ * the old ones. Either way it reports no bandwidth.
+ */
+static bool mba_sample_rmid(struct mba_sample *ms, u32 rmid, ktime_t now)
 {
-	struct perf_event *group = NULL;
-	bool rotate = false;
+	u64 total, local;
+	bool whole;
+	s64 dt;
 
-	if (event->attr.type != intel_cqm_pmu.type)
-		return -ENOENT;
+	total = cqm_read_counter(QOS_MBM_TOTAL_EVENT_ID, rmid);
+	local = cqm_read_counter(QOS_MBM_LOCAL_EVENT_ID, rmid);
 
-	if ((event->attr.config < QOS_L3_OCCUP_EVENT_ID) ||
-	     (event->attr.config > QOS_MBM_LOCAL_AVG_EVENT_ID))
-		return -EINVAL;
+	if ((total | local) & (RMID_VAL_ERROR | RMID_VAL_UNAVAIL)) {
+		ms->total_bw = ms->local_bw = 0;
+		return false;
+	}
 
-	/* unsupported modes and filters */
-	if (event->attr.exclude_user   ||
-	    event->attr.exclude_kernel ||
-	    event->attr.exclude_hv     ||
-	    event->attr.exclude_idle   ||
-	    event->attr.exclude_host   ||
-	    event->attr.exclude_guest  ||
-	    event->attr.sample_period) /* no sampling */
-		return -EINVAL;
+	dt = ktime_ms_delta(now, ms->time);
+	whole = dt > 0 && dt <= MBA_CTRL_INTERVAL_MS + MBM_TIME_DELTA_MIN;
+	if (whole) {
+		ms->total_bw = div64_u64(((total - ms->total) & MBM_CNTR_MAX) *
+					 MSEC_PER_SEC, dt);
+		ms->local_bw = div64_u64(((local - ms->local) & MBM_CNTR_MAX) *
+					 MSEC_PER_SEC, dt);
+	} else {
+		ms->total_bw = ms->local_bw = 0;
+	}
 
-	INIT_LIST_HEAD(&event->hw.cqm_group_entry);
-	INIT_LIST_HEAD(&event->hw.cqm_groups_entry);
+	ms->total = total;
+	ms->local = local;
+	ms->time = now;
 
-	event->destroy = intel_cqm_event_destroy;
+	return whole;
+}
+
+static void intel_mba_cpu_starting(void)
+{
+	u32 closid;
+
+	if (!is_mba)
+		return;
+
+	for (closid = 0; closid < mba_max_closid; closid++)
+		cqm_wrmsrl(MSR_IA32_MBA_THRTL_BASE + closid,
+			   mba_ctrl[closid].delay);
+}
+
+static void __intel_mba_reset(void *info)
+{
+	intel_mba_cpu_starting();
+}
+
+struct mba_group_read {
+	u32 rmid;
+	atomic64_t bw;
+	atomic_t nr_missed;
+};
+
+static void __intel_mba_sample(void *info)
+{
+	struct mba_group_read *gr = info;
+	struct mba_sample *ms = &this_mbm_pkg()->mba[gr->rmid];
+
+	if (!mba_sample_rmid(ms, gr->rmid, ktime_get()))
+		atomic_inc(&gr->nr_missed);
+
+	atomic64_add(ms->total_bw, &gr->bw);
+}
+
+/*
+ * Sample a group's RMID on all packages into @bw, its total bandwidth
+ * over the last interval in MB/sec. Returns false if a package had no
+ * whole interval to go by.
+ */
+static bool mba_group_bw(struct perf_event *group, u64 *bw)
+{
+	struct mba_group_read gr = {
+		.rmid = group->hw.cqm_rmid,
+		.bw = ATOMIC64_INIT(0),
+		.nr_missed = ATOMIC_INIT(0),
+	};
+
+	cqm_on_each_reader(__intel_mba_sample, &gr);
+	*bw = div_u64(atomic64_read(&gr.bw) * cqm_l3_scale, 1000000);
+
+	return !atomic_read(&gr.nr_missed);
+}
+
+static void intel_mba_ctrl_update(struct work_struct *work)
+{
+	struct perf_event *group;
+	bool active;
+	u64 bw;
+	u32 closid;
 
 	mutex_lock(&cache_mutex);
 
-	/* Will also set rmid */
-	intel_cqm_setup_event(event, &group);
+	for (closid = 0; closid < mba_max_closid; closid++)
+		mba_ctrl[closid].bw = 0;
 
-	if (group) {
-		list_add_tail(&event->hw.cqm_group_entry,
-			      &group->hw.cqm_group_entry);
-	} else {
-		list_add_tail(&event->hw.cqm_groups_entry,
-			      &cache_groups);
+	list_for_each_entry(group, &cache_groups, hw.cqm_groups_entry) {
+		closid = cqm_event_closid(group);
+
+		if (closid >= mba_max_closid || !mba_ctrl[closid].target)
+			continue;
+
+		if (!__rmid_valid(group->hw.cqm_rmid))
+			continue;
 
 		/*
-		 * All RMIDs are either in use or have recently been
-		 * used. Kick the rotation worker to clean/free some.
-		 *
-		 * We only do this for the group leader, rather than for
-		 * every event in a group to save on needless work.
+		 * A new RMID, or one the controller didn't read last
+		 * interval, only gets its baseline now; hold its CLOSID
+		 * rather than act on a partial sum.
 		 */
-		if (!__rmid_valid(event->hw.cqm_rmid))
-			rotate = true;
+		if (!mba_group_bw(group, &bw) && !mba_ctrl[closid].holdoff)
+			mba_ctrl[closid].holdoff = 1;
+
+		mba_ctrl[closid].bw += bw;
 	}
 
+	active = mba_ctrl_adjust();
+
 	mutex_unlock(&cache_mutex);
 
-	if (rotate)
-		schedule_delayed_work(&intel_cqm_rmid_work, 0);
+	if (active)
+		schedule_delayed_work(&intel_mba_ctrl_work,
+				      msecs_to_jiffies(MBA_CTRL_INTERVAL_MS));
+}
+
+/*
+ * We expect to be called with cache_mutex held.
+ */
+static int intel_mba_set_target(u32 closid, u32 target)
+{
+	lockdep_assert_held(&cache_mutex);
+
+	if (!closid || closid >= mba_max_closid)
+		return -EINVAL;
+
+	mba_ctrl[closid].target = target;
+	mba_ctrl[closid].holdoff = 0;
+
+	/*
+	 * Uncontrolled CLOSIDs run unthrottled.
+	 */
+	if (!target)
+		intel_mba_set_delay(closid, 0);
+	else
+		schedule_delayed_work(&intel_mba_ctrl_work, 0);
 
 	return 0;
 }
 
-EVENT_ATTR_STR(llc_occupancy, intel_cqm_llc, "event=0x01");
-EVENT_ATTR_STR(llc_occupancy.per-pkg, intel_cqm_llc_pkg, "1");
-EVENT_ATTR_STR(llc_occupancy.unit, intel_cqm_llc_unit, "Bytes");
-EVENT_ATTR_STR(llc_occupancy.scale, intel_cqm_llc_scale, NULL);
-EVENT_ATTR_STR(llc_occupancy.snapshot, intel_cqm_llc_snapshot, "1");
+/*
+ * Scheduler-integrated RMID association (attr.config1 sched_assoc=1).
+ *
+ * Regular task events own PQR_ASSOC while perf has them scheduled in,
+ * which costs cache_lock, the rmid_usecnt accounting and two PQR_ASSOC
+ * writes on every context switch of a monitored task.
+ *
+ * For sched_assoc events the RMID is instead looked up by task in
+ * cqm_task_hash from the pmu::sched_task hook, i.e. once per context
+ * switch for all tasks, and written only if it differs from the one
+ * cached in intel_pqr_state. Switching between threads of the same
+ * monitored process then costs no MSR write at all, and the events'
+ * add/start/stop callbacks only deal with counter reads.
+ *
+ * Regular events that are scheduled in on a cpu (rmid_usecnt != 0)
+ * take precedence.
+ */
+struct cqm_task_entry {
+	struct hlist_node	node;
+	struct task_struct	*task;
+	struct perf_event	*event;
+	struct rcu_head		rcu;
+};
 
-EVENT_ATTR_STR(total_bw, intel_cqm_total_bw, "event=0x02");
-EVENT_ATTR_STR(total_bw.per-pkg, intel_cqm_total_bw_pkg, "1");
-EVENT_ATTR_STR(total_bw.unit, intel_cqm_total_bw_unit, "MB/sec");
-EVENT_ATTR_STR(total_bw.scale, intel_cqm_total_bw_scale, NULL);
-EVENT_ATTR_STR(total_bw.snapshot, intel_cqm_total_bw_snapshot, "1");
-EVENT_ATTR_STR(total_bw.runavg_nosamples,
-				intel_cqm_total_bw_runavg_nosamples, "10");
-EVENT_ATTR_STR(local_bw.runavg_nosamples,
-				intel_cqm_local_bw_runavg_nosamples, "10");
+#define CQM_TASK_HASH_BITS	8
 
+/*
+ * Writers hold cache_mutex, readers are the context switch path under
+ * RCU. Entries are removed in intel_cqm_event_destroy(), before perf
+ * RCU-frees the event they point to.
+ */
+static DEFINE_HASHTABLE(cqm_task_hash, CQM_TASK_HASH_BITS);
 
-EVENT_ATTR_STR(local_bw, intel_cqm_local_bw, "event=0x03");
-EVENT_ATTR_STR(local_bw.per-pkg, intel_cqm_local_bw_pkg, "1");
-EVENT_ATTR_STR(local_bw.unit, intel_cqm_local_bw_unit, "MB/sec");
-EVENT_ATTR_STR(local_bw.scale, intel_cqm_local_bw_scale, NULL);
-EVENT_ATTR_STR(local_bw.snapshot, intel_cqm_local_bw_snapshot, "1");
+static DEFINE_STATIC_KEY_FALSE(cqm_sched_key);
+static DEFINE_MUTEX(cqm_sched_mutex);
+static unsigned int cqm_sched_users;
 
-EVENT_ATTR_STR(avg_total_bw, intel_cqm_avg_total_bw, "event=0x04");
-EVENT_ATTR_STR(avg_total_bw.per-pkg, intel_cqm_avg_total_bw_pkg, "1");
-EVENT_ATTR_STR(avg_total_bw.unit, intel_cqm_avg_total_bw_unit, "MB/sec");
-EVENT_ATTR_STR(avg_total_bw.scale, intel_cqm_avg_total_bw_scale, NULL);
-EVENT_ATTR_STR(avg_total_bw.snapshot, intel_cqm_avg_total_bw_snapshot, "1");
+/* Whether this cpu holds a perf_sched_cb_inc() reference */
+static DEFINE_PER_CPU(bool, cqm_sched_cb);
 
-EVENT_ATTR_STR(avg_local_bw, intel_cqm_avg_local_bw, "event=0x05");
-EVENT_ATTR_STR(avg_local_bw.per-pkg, intel_cqm_avg_local_bw_pkg, "1");
-EVENT_ATTR_STR(avg_local_bw.unit, intel_cqm_avg_local_bw_unit, "MB/sec");
-EVENT_ATTR_STR(avg_local_bw.scale, intel_cqm_avg_local_bw_scale, NULL);
-EVENT_ATTR_STR(avg_local_bw.snapshot, intel_cqm_avg_local_bw_snapshot, "1");
+static inline bool cqm_sched_assoc(struct perf_event *event)
+{
+	return event->attr.config1 & CQM_SCHED_ASSOC;
+}
 
-static struct attribute *intel_cqm_events_attr[] = {
-	EVENT_PTR(intel_cqm_llc),
+/*
+ * Look up the RMID and CLOSID associated with @task, 0 for both if it
+ * has none.
+ */
+static void cqm_task_assoc(struct task_struct *task, u32 *rmid, u32 *closid)
+{
+	struct cqm_task_entry *te;
+
+	*rmid = 0;
+	*closid = 0;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(cqm_task_hash, te, node,
+				   (unsigned long)task) {
+		if (te->task == task) {
+			*rmid = READ_ONCE(te->event->hw.cqm_rmid);
+			*closid = cqm_event_closid(te->event);
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	if (!__rmid_valid(*rmid))
+		*rmid = 0;
+}
+
+static void intel_cqm_sched_task(struct perf_event_context *ctx,
+				 bool sched_in)
+{
+	struct intel_pqr_state *state = this_cpu_ptr(&pqr_state);
+	u32 rmid, closid;
+
+	if (!sched_in || !static_branch_unlikely(&cqm_sched_key))
+		return;
+
+	if (state->rmid_usecnt)
+		return;
+
+	cqm_task_assoc(current, &rmid, &closid);
+	if (state->rmid == rmid && state->closid == closid)
+		return;
+
+	state->rmid = rmid;
+	state->closid = closid;
+	cqm_wrmsr(MSR_IA32_PQR_ASSOC, rmid, closid);
+}
+
+static void cqm_sched_cb_sync(void *info)
+{
+	struct intel_pqr_state *state = this_cpu_ptr(&pqr_state);
+	bool want = READ_ONCE(cqm_sched_users);
+
+	if (want == __this_cpu_read(cqm_sched_cb))
+		return;
+
+	if (want) {
+		perf_sched_cb_inc(&intel_cqm_pmu);
+	} else {
+		perf_sched_cb_dec(&intel_cqm_pmu);
+
+		/*
+		 * Nothing updates PQR_ASSOC on context switch anymore; drop
+		 * the RMID the hook left behind so that other tasks don't
+		 * get tagged with it once it is freed and reused.
+		 */
+		if (!state->rmid_usecnt && state->rmid) {
+			state->rmid = 0;
+			cqm_wrmsr(MSR_IA32_PQR_ASSOC, 0, state->closid);
+		}
+	}
+
+	__this_cpu_write(cqm_sched_cb, want);
+}
+
+static void cqm_sched_get(void)
+{
+	mutex_lock(&cqm_sched_mutex);
+	if (!cqm_sched_users++) {
+		static_branch_enable(&cqm_sched_key);
+		get_online_cpus();
+		on_each_cpu(cqm_sched_cb_sync, NULL, 1);
+		put_online_cpus();
+	}
+	mutex_unlock(&cqm_sched_mutex);
+}
+
+static void cqm_sched_put(void)
+{
+	mutex_lock(&cqm_sched_mutex);
+	if (!--cqm_sched_users) {
+		get_online_cpus();
+		on_each_cpu(cqm_sched_cb_sync, NULL, 1);
+		put_online_cpus();
+		static_branch_disable(&cqm_sched_key);
+	}
+	mutex_unlock(&cqm_sched_mutex);
+}
+
+/*
+ * We expect to be called with cache_mutex held.
+ */
+static void cqm_task_hash_add(struct cqm_task_entry *te,
+			      struct perf_event *event)
+{
+	lockdep_assert_held(&cache_mutex);
+
+	te->task = event->hw.target;
+	te->event = event;
+	hash_add_rcu(cqm_task_hash, &te->node, (unsigned long)te->task);
+}
+
+static void cqm_task_hash_del(struct perf_event *event)
+{
+	struct task_struct *task = event->hw.target;
+	struct cqm_task_entry *te;
+
+	lockdep_assert_held(&cache_mutex);
+
+	hash_for_each_possible(cqm_task_hash, te, node, (unsigned long)task) {
+		if (te->event == event) {
+			hash_del_rcu(&te->node);
+			kfree_rcu(te, rcu);
+			return;
+		}
+	}
+}
+
+static void intel_cqm_event_start(struct perf_event *event, int mode)
+{
+	struct intel_pqr_state *state = this_cpu_ptr(&pqr_state);
+	u32 rmid = event->hw.cqm_rmid;
+
+	if (!(event->hw.cqm_state & PERF_HES_STOPPED))
+		return;
+
+	event->hw.cqm_state &= ~PERF_HES_STOPPED;
+
+	/*
+	 * PQR_ASSOC is taken care of by intel_cqm_sched_task().
+	 */
+	if (cqm_sched_assoc(event)) {
+		intel_mbm_event_start(event, mode);
+		return;
+	}
+
+	/*
+	 * With rmid_usecnt == 0, state->rmid is either 0 or the RMID
+	 * intel_cqm_sched_task() associated with the current task.
+	 */
+	if (state->rmid_usecnt++) {
+		if (!WARN_ON_ONCE(state->rmid != rmid))
+			return;
+	}
+
+	state->rmid = rmid;
+	state->closid = cqm_event_closid(event);
+	cqm_wrmsr(MSR_IA32_PQR_ASSOC, rmid, state->closid);
+	intel_mbm_event_start(event, mode);
+
+}
+
+static void intel_mbm_event_stop(struct perf_event *event, int mode)
+{
+	struct mbm_pmu *pmu = __this_cpu_read(mbm_pmu);
+
+	if (pmu) {
+		intel_mbm_event_update(event);
+		if ((pmu->n_active >  0) && (event->cpu != -1))
+			pmu->n_active--;
+			if (pmu->n_active == 0)
+				mbm_stop_hrtimer(pmu);
+		if (!list_empty(&event->active_entry))
+			list_del(&event->active_entry);
+	}
+
+}
+
+static void intel_cqm_event_stop(struct perf_event *event, int mode)
+{
+	struct intel_pqr_state *state = this_cpu_ptr(&pqr_state);
+
+	if (event->hw.cqm_state & PERF_HES_STOPPED)
+		return;
+
+	event->hw.cqm_state |= PERF_HES_STOPPED;
+
+	if (event->attr.config == QOS_L3_OCCUP_EVENT_ID)
+		intel_cqm_event_read(event);
+	if (cqm_mbm_timed_event(event))
+		intel_mbm_event_update(event);
+
+	if (cqm_sched_assoc(event)) {
+		intel_mbm_event_stop(event, mode);
+		return;
+	}
+
+	if (!--state->rmid_usecnt) {
+		/*
+		 * Hand PQR_ASSOC back to the scheduler-associated RMID and
+		 * CLOSID of the current task, if any.
+		 */
+		state->rmid = 0;
+		state->closid = 0;
+		if (static_branch_unlikely(&cqm_sched_key))
+			cqm_task_assoc(current, &state->rmid, &state->closid);
+		cqm_wrmsr(MSR_IA32_PQR_ASSOC, state->rmid, state->closid);
+	} else {
+		WARN_ON_ONCE(!state->rmid);
+	}
+
+	intel_mbm_event_stop(event, mode);
+}
+
+static int intel_cqm_event_add(struct perf_event *event, int mode)
+{
+	unsigned long flags;
+	u32 rmid;
+
+	/*
+	 * Nothing to program, don't bother with cache_lock.
+	 */
+	if (cqm_sched_assoc(event)) {
+		event->hw.cqm_state = PERF_HES_STOPPED;
+		if (mode & PERF_EF_START)
+			intel_cqm_event_start(event, mode);
+		return 0;
+	}
+
+	raw_spin_lock_irqsave(&cache_lock, flags);
+
+	event->hw.cqm_state = PERF_HES_STOPPED;
+	rmid = event->hw.cqm_rmid;
+
+	if (__rmid_valid(rmid) && (mode & PERF_EF_START))
+		intel_cqm_event_start(event, mode);
+
+	raw_spin_unlock_irqrestore(&cache_lock, flags);
+
+	return 0;
+}
+
+static void intel_cqm_event_destroy(struct perf_event *event)
+{
+	struct perf_event *group_other = NULL;
+
+	mutex_lock(&cache_mutex);
+
+	if (cqm_sched_assoc(event))
+		cqm_task_hash_del(event);
+
+	cqm_group_link_del(event);
+
+	/*
+	 * If there's another event in this group...
+	 */
+	if (!list_empty(&event->hw.cqm_group_entry)) {
+		group_other = list_first_entry(&event->hw.cqm_group_entry,
+					       struct perf_event,
+					       hw.cqm_group_entry);
+		list_del(&event->hw.cqm_group_entry);
+	}
+
+	/*
+	 * And we're the group leader..
+	 */
+	if (cqm_group_leader(event)) {
+		/*
+		 * If there was a group_other, make that leader, otherwise
+		 * destroy the group and return the RMID.
+		 */
+		if (group_other) {
+			list_replace(&event->hw.cqm_groups_entry,
+				     &group_other->hw.cqm_groups_entry);
+			cqm_event_group(group_other)->leader = group_other;
+		} else {
+			u32 rmid = event->hw.cqm_rmid;
+
+			if (__rmid_valid(rmid))
+				__put_rmid(rmid);
+			list_del(&event->hw.cqm_groups_entry);
+		}
+	}
+
+	mutex_unlock(&cache_mutex);
+
+	if (cqm_sched_assoc(event))
+		cqm_sched_put();
+}
+
+static int intel_cqm_event_init(struct perf_event *event)
+{
+	struct cqm_task_entry *te = NULL;
+	struct cqm_group_link *link;
+	struct perf_event *group = NULL;
+	bool rotate = false;
+	int ret;
+
+	if (event->attr.type != intel_cqm_pmu.type)
+		return -ENOENT;
+
+	if (((event->attr.config < QOS_L3_OCCUP_EVENT_ID) ||
+	     (event->attr.config > QOS_MBM_MISS_RATE_EVENT_ID)) &&
+	    !cqm_mux_event(event))
+		return -EINVAL;
+
+	if (event->attr.config == QOS_MBM_BW_PER_OCCUP_EVENT_ID && !cqm_llc_occ)
+		return -EINVAL;
+
+	/* unsupported modes and filters */
+	if (event->attr.exclude_user   ||
+	    event->attr.exclude_kernel ||
+	    event->attr.exclude_hv     ||
+	    event->attr.exclude_idle   ||
+	    event->attr.exclude_host   ||
+	    event->attr.exclude_guest  ||
+	    event->attr.sample_period) /* no sampling */
+		return -EINVAL;
+
+	if (event->attr.config1 & ~CQM_CONFIG1_MASK)
+		return -EINVAL;
+
+	ret = intel_rdt_check_closid(event, NULL);
+	if (ret)
+		return ret;
+
+	/*
+	 * System-wide and cgroup events already count the domain of
+	 * their cpu.
+	 */
+	if (cqm_event_node_filter(event)) {
+		if (!(event->attach_state & PERF_ATTACH_TASK))
+			return -EINVAL;
+
+		if (cqm_event_node(event) >= nr_node_ids ||
+		    !node_online(cqm_event_node(event)))
+			return -EINVAL;
+	}
+
+	/*
+	 * System-wide and cgroup events are read per package, and a
+	 * ratio per package doesn't add up to one over the machine.
+	 */
+	if (mbm_ratio_event(event->attr.config) &&
+	    !(event->attach_state & PERF_ATTACH_TASK))
+		return -EINVAL;
+
+	/*
+	 * Scheduler association only makes sense for task events.
+	 */
+	if (cqm_sched_assoc(event)) {
+		if (!(event->attach_state & PERF_ATTACH_TASK))
+			return -EINVAL;
+
+		te = kzalloc(sizeof(*te), GFP_KERNEL);
+		if (!te)
+			return -ENOMEM;
+	}
+
+	link = kzalloc(sizeof(*link), GFP_KERNEL);
+	if (link)
+		link->group = kzalloc(sizeof(*link->group), GFP_KERNEL);
+	if (!link || !link->group) {
+		kfree(link);
+		kfree(te);
+		return -ENOMEM;
+	}
+	link->event = event;
+
+	INIT_LIST_HEAD(&event->hw.cqm_group_entry);
+	INIT_LIST_HEAD(&event->hw.cqm_groups_entry);
+
+	event->destroy = intel_cqm_event_destroy;
+
+	mutex_lock(&cache_mutex);
+
+	/* Will also set rmid */
+	ret = intel_cqm_setup_event(event, &group, link);
+	if (ret) {
+		mutex_unlock(&cache_mutex);
+		kfree(link->group);
+		kfree(link);
+		kfree(te);
+		return ret;
+	}
+
+	hash_add_rcu(cqm_group_hash, &link->node, (unsigned long)event);
+
+	if (group) {
+		list_add_tail(&event->hw.cqm_group_entry,
+			      &group->hw.cqm_group_entry);
+	} else {
+		list_add_tail(&event->hw.cqm_groups_entry,
+			      &cache_groups);
+
+		/*
+		 * All RMIDs are either in use or have recently been
+		 * used. Kick the rotation worker to clean/free some.
+		 *
+		 * We only do this for the group leader, rather than for
+		 * every event in a group to save on needless work.
+		 */
+		if (!__rmid_valid(event->hw.cqm_rmid))
+			rotate = true;
+	}
+
+	if (te)
+		cqm_task_hash_add(te, event);
+
+	mutex_unlock(&cache_mutex);
+
+	if (te)
+		cqm_sched_get();
+
+	if (rotate)
+		schedule_delayed_work(&intel_cqm_rmid_work, 0);
+
+	return 0;
+}
+
+EVENT_ATTR_STR(llc_occupancy, intel_cqm_llc, "event=0x01");
+EVENT_ATTR_STR(llc_occupancy.per-pkg, intel_cqm_llc_pkg, "1");
+EVENT_ATTR_STR(llc_occupancy.unit, intel_cqm_llc_unit, "Bytes");
+EVENT_ATTR_STR(llc_occupancy.scale, intel_cqm_llc_scale, NULL);
+EVENT_ATTR_STR(llc_occupancy.snapshot, intel_cqm_llc_snapshot, "1");
+
+EVENT_ATTR_STR(rmid_time_enabled, intel_cqm_rmid_enabled, "event=0x10");
+EVENT_ATTR_STR(rmid_time_enabled.unit, intel_cqm_rmid_enabled_unit, "ns");
+EVENT_ATTR_STR(rmid_time_running, intel_cqm_rmid_running, "event=0x11");
+EVENT_ATTR_STR(rmid_time_running.unit, intel_cqm_rmid_running_unit, "ns");
+
+EVENT_ATTR_STR(total_bw, intel_cqm_total_bw, "event=0x02");
+EVENT_ATTR_STR(total_bw.per-pkg, intel_cqm_total_bw_pkg, "1");
+EVENT_ATTR_STR(total_bw.unit, intel_cqm_total_bw_unit, "MB/sec");
+EVENT_ATTR_STR(total_bw.scale, intel_cqm_total_bw_scale, NULL);
+EVENT_ATTR_STR(total_bw.snapshot, intel_cqm_total_bw_snapshot, "1");
+EVENT_ATTR_STR(total_bw.runavg_nosamples,
+				intel_cqm_total_bw_runavg_nosamples, "10");
+EVENT_ATTR_STR(local_bw.runavg_nosamples,
+				intel_cqm_local_bw_runavg_nosamples, "10");
+
+
+EVENT_ATTR_STR(local_bw, intel_cqm_local_bw, "event=0x03");
+EVENT_ATTR_STR(local_bw.per-pkg, intel_cqm_local_bw_pkg, "1");
+EVENT_ATTR_STR(local_bw.unit, intel_cqm_local_bw_unit, "MB/sec");
+EVENT_ATTR_STR(local_bw.scale, intel_cqm_local_bw_scale, NULL);
+EVENT_ATTR_STR(local_bw.snapshot, intel_cqm_local_bw_snapshot, "1");
+
+EVENT_ATTR_STR(avg_total_bw, intel_cqm_avg_total_bw, "event=0x04");
+EVENT_ATTR_STR(avg_total_bw.per-pkg, intel_cqm_avg_total_bw_pkg, "1");
+EVENT_ATTR_STR(avg_total_bw.unit, intel_cqm_avg_total_bw_unit, "MB/sec");
+EVENT_ATTR_STR(avg_total_bw.scale, intel_cqm_avg_total_bw_scale, NULL);
+EVENT_ATTR_STR(avg_total_bw.snapshot, intel_cqm_avg_total_bw_snapshot, "1");
+
+EVENT_ATTR_STR(avg_local_bw, intel_cqm_avg_local_bw, "event=0x05");
+EVENT_ATTR_STR(avg_local_bw.per-pkg, intel_cqm_avg_local_bw_pkg, "1");
+EVENT_ATTR_STR(avg_local_bw.unit, intel_cqm_avg_local_bw_unit, "MB/sec");
+EVENT_ATTR_STR(avg_local_bw.scale, intel_cqm_avg_local_bw_scale, NULL);
+EVENT_ATTR_STR(avg_local_bw.snapshot, intel_cqm_avg_local_bw_snapshot, "1");
+
+EVENT_ATTR_STR(remote_bw, intel_cqm_remote_bw, "event=0x06");
+EVENT_ATTR_STR(remote_bw.per-pkg, intel_cqm_remote_bw_pkg, "1");
+EVENT_ATTR_STR(remote_bw.unit, intel_cqm_remote_bw_unit, "MB/sec");
+EVENT_ATTR_STR(remote_bw.scale, intel_cqm_remote_bw_scale, NULL);
+EVENT_ATTR_STR(remote_bw.snapshot, intel_cqm_remote_bw_snapshot, "1");
+
+EVENT_ATTR_STR(avg_remote_bw, intel_cqm_avg_remote_bw, "event=0x07");
+EVENT_ATTR_STR(avg_remote_bw.per-pkg, intel_cqm_avg_remote_bw_pkg, "1");
+EVENT_ATTR_STR(avg_remote_bw.unit, intel_cqm_avg_remote_bw_unit, "MB/sec");
+EVENT_ATTR_STR(avg_remote_bw.scale, intel_cqm_avg_remote_bw_scale, NULL);
+EVENT_ATTR_STR(avg_remote_bw.snapshot, intel_cqm_avg_remote_bw_snapshot, "1");
+
+/*
+ * Task events only, over all packages; see mbm_ratio_event().
+ */
+EVENT_ATTR_STR(local_ratio, intel_cqm_local_ratio, "event=0x08");
+EVENT_ATTR_STR(local_ratio.unit, intel_cqm_local_ratio_unit, "%");
+EVENT_ATTR_STR(local_ratio.scale, intel_cqm_local_ratio_scale, "0.01");
+EVENT_ATTR_STR(local_ratio.snapshot, intel_cqm_local_ratio_snapshot, "1");
+
+/*
+ * Task events only, like local_ratio. A high value means the group
+ * streams through the cache, a low one that its footprint stays
+ * resident.
+ */
+EVENT_ATTR_STR(bw_per_occupancy, intel_cqm_bw_occ, "event=0x09");
+EVENT_ATTR_STR(bw_per_occupancy.unit, intel_cqm_bw_occ_unit, "/sec");
+EVENT_ATTR_STR(bw_per_occupancy.scale, intel_cqm_bw_occ_scale, "1e-3");
+EVENT_ATTR_STR(bw_per_occupancy.snapshot, intel_cqm_bw_occ_snapshot, "1");
+
+/*
+ * An estimate: memory traffic includes writebacks and prefetches, not
+ * just demand misses.
+ */
+EVENT_ATTR_STR(llc_miss_rate, intel_cqm_miss_rate, "event=0x0a");
+EVENT_ATTR_STR(llc_miss_rate.per-pkg, intel_cqm_miss_rate_pkg, "1");
+EVENT_ATTR_STR(llc_miss_rate.unit, intel_cqm_miss_rate_unit, "misses/sec");
+EVENT_ATTR_STR(llc_miss_rate.scale, intel_cqm_miss_rate_scale, NULL);
+EVENT_ATTR_STR(llc_miss_rate.snapshot, intel_cqm_miss_rate_snapshot, "1");
+
+static struct attribute *intel_cqm_events_attr[] = {
+	EVENT_PTR(intel_cqm_llc),
 	EVENT_PTR(intel_cqm_llc_pkg),
 	EVENT_PTR(intel_cqm_llc_unit),
 	EVENT_PTR(intel_cqm_llc_scale),
 	EVENT_PTR(intel_cqm_llc_snapshot),
+	EVENT_PTR(intel_cqm_rmid_enabled),
+	EVENT_PTR(intel_cqm_rmid_enabled_unit),
+	EVENT_PTR(intel_cqm_rmid_running),
+	EVENT_PTR(intel_cqm_rmid_running_unit),
+	NULL,
+};
+
+static struct attribute *intel_mbm_events_attr[] = {
+	EVENT_PTR(intel_cqm_total_bw),
+	EVENT_PTR(intel_cqm_local_bw),
+	EVENT_PTR(intel_cqm_avg_total_bw),
+	EVENT_PTR(intel_cqm_avg_local_bw),
+	EVENT_PTR(intel_cqm_remote_bw),
+	EVENT_PTR(intel_cqm_avg_remote_bw),
+	EVENT_PTR(intel_cqm_local_ratio),
+	EVENT_PTR(intel_cqm_miss_rate),
+	EVENT_PTR(intel_cqm_total_bw_pkg),
+	EVENT_PTR(intel_cqm_local_bw_pkg),
+	EVENT_PTR(intel_cqm_avg_total_bw_pkg),
+	EVENT_PTR(intel_cqm_avg_local_bw_pkg),
+	EVENT_PTR(intel_cqm_remote_bw_pkg),
+	EVENT_PTR(intel_cqm_avg_remote_bw_pkg),
+	EVENT_PTR(intel_cqm_miss_rate_pkg),
+	EVENT_PTR(intel_cqm_total_bw_unit),
+	EVENT_PTR(intel_cqm_local_bw_unit),
+	EVENT_PTR(intel_cqm_avg_total_bw_unit),
+	EVENT_PTR(intel_cqm_avg_local_bw_unit),
+	EVENT_PTR(intel_cqm_remote_bw_unit),
+	EVENT_PTR(intel_cqm_avg_remote_bw_unit),
+	EVENT_PTR(intel_cqm_local_ratio_unit),
+	EVENT_PTR(intel_cqm_miss_rate_unit),
+	EVENT_PTR(intel_cqm_total_bw_scale),
+	EVENT_PTR(intel_cqm_local_bw_scale),
+	EVENT_PTR(intel_cqm_avg_total_bw_scale),
+	EVENT_PTR(intel_cqm_avg_local_bw_scale),
+	EVENT_PTR(intel_cqm_remote_bw_scale),
+	EVENT_PTR(intel_cqm_avg_remote_bw_scale),
+	EVENT_PTR(intel_cqm_local_ratio_scale),
+	EVENT_PTR(intel_cqm_miss_rate_scale),
+	EVENT_PTR(intel_cqm_total_bw_snapshot),
+	EVENT_PTR(intel_cqm_local_bw_snapshot),
+	EVENT_PTR(intel_cqm_avg_total_bw_snapshot),
+	EVENT_PTR(intel_cqm_avg_local_bw_snapshot),
+	EVENT_PTR(intel_cqm_remote_bw_snapshot),
+	EVENT_PTR(intel_cqm_avg_remote_bw_snapshot),
+	EVENT_PTR(intel_cqm_local_ratio_snapshot),
+	EVENT_PTR(intel_cqm_miss_rate_snapshot),
+	EVENT_PTR(intel_cqm_total_bw_runavg_nosamples),
+	EVENT_PTR(intel_cqm_local_bw_runavg_nosamples),
+	EVENT_PTR(intel_cqm_rmid_enabled),
+	EVENT_PTR(intel_cqm_rmid_enabled_unit),
+	EVENT_PTR(intel_cqm_rmid_running),
+	EVENT_PTR(intel_cqm_rmid_running_unit),
+	NULL,
+};
+
+static struct attribute *intel_cmt_mbm_events_attr[] = {
+	EVENT_PTR(intel_cqm_llc),
+	EVENT_PTR(intel_cqm_total_bw),
+	EVENT_PTR(intel_cqm_local_bw),
+	EVENT_PTR(intel_cqm_avg_total_bw),
+	EVENT_PTR(intel_cqm_avg_local_bw),
+	EVENT_PTR(intel_cqm_remote_bw),
+	EVENT_PTR(intel_cqm_avg_remote_bw),
+	EVENT_PTR(intel_cqm_local_ratio),
+	EVENT_PTR(intel_cqm_bw_occ),
+	EVENT_PTR(intel_cqm_miss_rate),
+	EVENT_PTR(intel_cqm_llc_pkg),
+	EVENT_PTR(intel_cqm_total_bw_pkg),
+	EVENT_PTR(intel_cqm_local_bw_pkg),
+	EVENT_PTR(intel_cqm_avg_total_bw_pkg),
+	EVENT_PTR(intel_cqm_avg_local_bw_pkg),
+	EVENT_PTR(intel_cqm_remote_bw_pkg),
+	EVENT_PTR(intel_cqm_avg_remote_bw_pkg),
+	EVENT_PTR(intel_cqm_miss_rate_pkg),
+	EVENT_PTR(intel_cqm_llc_unit),
+	EVENT_PTR(intel_cqm_total_bw_unit),
+	EVENT_PTR(intel_cqm_local_bw_unit),
+	EVENT_PTR(intel_cqm_avg_total_bw_unit),
+	EVENT_PTR(intel_cqm_avg_local_bw_unit),
+	EVENT_PTR(intel_cqm_remote_bw_unit),
+	EVENT_PTR(intel_cqm_avg_remote_bw_unit),
+	EVENT_PTR(intel_cqm_local_ratio_unit),
+	EVENT_PTR(intel_cqm_bw_occ_unit),
+	EVENT_PTR(intel_cqm_miss_rate_unit),
+	EVENT_PTR(intel_cqm_llc_scale),
+	EVENT_PTR(intel_cqm_total_bw_scale),
+	EVENT_PTR(intel_cqm_local_bw_scale),
+	EVENT_PTR(intel_cqm_avg_total_bw_scale),
+	EVENT_PTR(intel_cqm_avg_local_bw_scale),
+	EVENT_PTR(intel_cqm_remote_bw_scale),
+	EVENT_PTR(intel_cqm_avg_remote_bw_scale),
+	EVENT_PTR(intel_cqm_local_ratio_scale),
+	EVENT_PTR(intel_cqm_bw_occ_scale),
+	EVENT_PTR(intel_cqm_miss_rate_scale),
+	EVENT_PTR(intel_cqm_llc_snapshot),
+	EVENT_PTR(intel_cqm_total_bw_snapshot),
+	EVENT_PTR(intel_cqm_local_bw_snapshot),
+	EVENT_PTR(intel_cqm_avg_total_bw_snapshot),
+	EVENT_PTR(intel_cqm_avg_local_bw_snapshot),
+	EVENT_PTR(intel_cqm_remote_bw_snapshot),
+	EVENT_PTR(intel_cqm_avg_remote_bw_snapshot),
+	EVENT_PTR(intel_cqm_local_ratio_snapshot),
+	EVENT_PTR(intel_cqm_bw_occ_snapshot),
+	EVENT_PTR(intel_cqm_miss_rate_snapshot),
+	EVENT_PTR(intel_cqm_total_bw_runavg_nosamples),
+	EVENT_PTR(intel_cqm_local_bw_runavg_nosamples),
+	EVENT_PTR(intel_cqm_rmid_enabled),
+	EVENT_PTR(intel_cqm_rmid_enabled_unit),
+	EVENT_PTR(intel_cqm_rmid_running),
+	EVENT_PTR(intel_cqm_rmid_running_unit),
+	NULL,
+};
+
+static struct attribute_group intel_cqm_events_group = {
+	.name = "events",
+	.attrs = NULL,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+PMU_FORMAT_ATTR(sched_assoc, "config1:0");
+PMU_FORMAT_ATTR(closid, "config1:16-31");
+PMU_FORMAT_ATTR(node_filter, "config1:1");
+PMU_FORMAT_ATTR(node, "config1:32-47");
+PMU_FORMAT_ATTR(prio, "config1:2");
+PMU_FORMAT_ATTR(weight, "config1:48-55");
+PMU_FORMAT_ATTR(pin, "config1:3");
+static struct attribute *intel_cqm_formats_attr[] = {
+	&format_attr_event.attr,
+	&format_attr_sched_assoc.attr,
+	&format_attr_closid.attr,
+	&format_attr_node_filter.attr,
+	&format_attr_node.attr,
+	&format_attr_prio.attr,
+	&format_attr_weight.attr,
+	&format_attr_pin.attr,
+	NULL,
+};
+
+static struct attribute_group intel_cqm_format_group = {
+	.name = "format",
+	.attrs = intel_cqm_formats_attr,
+};
+
+static ssize_t
+max_recycle_threshold_show(struct device *dev, struct device_attribute *attr,
+			   char *page)
+{
+	ssize_t rv;
+
+	mutex_lock(&cache_mutex);
+	rv = snprintf(page, PAGE_SIZE-1, "%u\n", __intel_cqm_max_threshold);
+	mutex_unlock(&cache_mutex);
+
+	return rv;
+}
+
+static ssize_t
+sliding_window_size_show(struct device *dev, struct device_attribute *attr,
+		char *page)
+{
+	ssize_t rv;
+
+	rv = snprintf(page, PAGE_SIZE-1, "%u\n", mbm_window_size);
+	return rv;
+}
+
+static ssize_t
+max_recycle_threshold_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	unsigned int bytes, cachelines;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &bytes);
+	if (ret)
+		return ret;
+
+	mutex_lock(&cache_mutex);
+
+	__intel_cqm_max_threshold = bytes;
+	cachelines = bytes / cqm_l3_scale;
+
+	/*
+	 * The new maximum takes effect immediately.
+	 */
+	if (__intel_cqm_threshold > cachelines)
+		__intel_cqm_threshold = cachelines;
+
+	mutex_unlock(&cache_mutex);
+
+	return count;
+}
+
+static ssize_t
+sliding_window_size_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	unsigned int bytes;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &bytes);
+	if (ret)
+		return ret;
+
+	mutex_lock(&cache_mutex);
+	if (bytes >= MBM_FIFO_SIZE_MIN && bytes <= MBM_FIFO_SIZE_MAX)
+		mbm_window_size = bytes;
+	else {
+		mutex_unlock(&cache_mutex);
+		return -EINVAL;
+	}
+	mutex_unlock(&cache_mutex);
+
+	return count;
+}
+
+static ssize_t
+publish_interval_ms_show(struct device *dev, struct device_attribute *attr,
+			 char *page)
+{
+	return snprintf(page, PAGE_SIZE-1, "%u\n",
+			READ_ONCE(cqm_publish_interval_ms));
+}
+
+static ssize_t
+publish_interval_ms_store(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	unsigned int ms;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &ms);
+	if (ret)
+		return ret;
+
+	if (!ms || ms > CQM_PUBLISH_MS_MAX)
+		return -EINVAL;
+
+	/* Takes effect with the next refresh. */
+	WRITE_ONCE(cqm_publish_interval_ms, ms);
+
+	return count;
+}
+
+/*
+ * Every IPI and reader-side sweep lands on the reader cpus in
+ * cqm_cpumask, one per domain (package, or node with SNC), so rather
+ * than the first cpu of a domain we want one that does not run
+ * latency-critical work. In order of preference a reader is:
+ *
+ *   1. in cqm_reader_pref, if the admin set one through reader_cpus
+ *   2. a housekeeping cpu, i.e. neither nohz_full nor isolcpus
+ *   3. any online cpu of the domain
+ *
+ * A domain whose online cpus are all isolated still needs a reader.
+ */
+static cpumask_t cqm_reader_pref;
+
+static int cqm_reader_score(int cpu)
+{
+	int score = 0;
+
+	if (cpumask_test_cpu(cpu, &cqm_reader_pref))
+		score += 2;
+
+	if (is_housekeeping_cpu(cpu) &&
+	    !cpumask_test_cpu(cpu, cpu_isolated_map))
+		score += 1;
+
+	return score;
+}
+
+/*
+ * Find the best reader for @domain among the online cpus, other than
+ * @exclude; -1 if there is none.
+ */
+static int cqm_pick_domain_reader(int domain, int exclude)
+{
+	int i, best = -1, best_score = -1;
+
+	for_each_online_cpu(i) {
+		if (i == exclude || domain != cqm_domain_id(i))
+			continue;
+
+		if (cqm_reader_score(i) > best_score) {
+			best = i;
+			best_score = cqm_reader_score(i);
+		}
+	}
+
+	return best;
+}
+
+static inline void cqm_pick_event_reader(int cpu)
+{
+	int domain = cqm_domain_id(cpu);
+	int i;
+
+	for_each_cpu(i, &cqm_cpumask) {
+		if (domain != cqm_domain_id(i))
+			continue;
+
+		/* already got reader for this domain, is @cpu better? */
+		if (cqm_reader_score(cpu) > cqm_reader_score(i)) {
+			cpumask_clear_cpu(i, &cqm_cpumask);
+			cpumask_set_cpu(cpu, &cqm_cpumask);
+		}
+		return;
+	}
+
+	cpumask_set_cpu(cpu, &cqm_cpumask);
+}
+
+/*
+ * Re-evaluate the reader of every domain, e.g. after reader_cpus
+ * changed. The caller must keep the set of online cpus stable.
+ *
+ * The new set is built in a static mask, too big for the stack with
+ * large NR_CPUS, which cache_mutex protects.
+ */
+static cpumask_t cqm_new_readers;
+
+static void cqm_reselect_readers(void)
+{
+	int i, reader;
+
+	lockdep_assert_held(&cache_mutex);
+
+	cpumask_clear(&cqm_new_readers);
+
+	for_each_online_cpu(i) {
+		reader = cqm_pick_domain_reader(cqm_domain_id(i), -1);
+		cpumask_set_cpu(reader, &cqm_new_readers);
+	}
+
+	/*
+	 * Readers racing with this may see a domain with no or two
+	 * readers for one sweep. Like a concurrent RMID rotation, that
+	 * only skews a single speculative read.
+	 */
+	cpumask_copy(&cqm_cpumask, &cqm_new_readers);
+}
+
+/*
+ * reader_cpus reads as the current per-package reader cpus. Writing a
+ * cpu list makes those cpus preferred readers of their packages, an
+ * empty list goes back to automatic (housekeeping) selection.
+ */
+static ssize_t
+reader_cpus_show(struct device *dev, struct device_attribute *attr,
+		 char *page)
+{
+	return snprintf(page, PAGE_SIZE-1, "%*pbl\n",
+			cpumask_pr_args(&cqm_cpumask));
+}
+
+static ssize_t
+reader_cpus_store(struct device *dev, struct device_attribute *attr,
+		  const char *buf, size_t count)
+{
+	cpumask_var_t pref;
+	int ret;
+
+	if (!alloc_cpumask_var(&pref, GFP_KERNEL))
+		return -ENOMEM;
+
+	ret = cpulist_parse(buf, pref);
+	if (ret)
+		goto out;
+
+	get_online_cpus();
+	mutex_lock(&cache_mutex);
+	cpumask_copy(&cqm_reader_pref, pref);
+	cqm_reselect_readers();
+	mutex_unlock(&cache_mutex);
+	put_online_cpus();
+out:
+	free_cpumask_var(pref);
+	return ret ? ret : count;
+}
+
+/*
+ * Move RMIDs between the free pool and the reserved pool until @nr are
+ * reserved. Only free RMIDs move, -EBUSY if there aren't enough; what
+ * moved stays moved.
+ *
+ * We expect to be called with cache_mutex held.
+ */
+static int intel_cqm_set_reserved(unsigned int nr)
+{
+	struct cqm_rmid_entry *entry;
+
+	lockdep_assert_held(&cache_mutex);
+
+	/*
+	 * Leave RMID 0, the rotation RMID and one more for everybody
+	 * else.
+	 */
+	if (nr + 3 > cqm_max_rmid + 1)
+		return -EINVAL;
+
+	while (cqm_nr_reserved < nr) {
+		if (list_empty(&cqm_rmid_free_lru))
+			return -EBUSY;
+
+		entry = list_first_entry(&cqm_rmid_free_lru,
+					 struct cqm_rmid_entry, list);
+		entry->reserved = true;
+		list_move_tail(&entry->list, &cqm_rmid_reserved_lru);
+		cqm_nr_reserved++;
+	}
+
+	while (cqm_nr_reserved > nr) {
+		if (list_empty(&cqm_rmid_reserved_lru))
+			return -EBUSY;
+
+		entry = list_first_entry(&cqm_rmid_reserved_lru,
+					 struct cqm_rmid_entry, list);
+		list_del(&entry->list);
+		entry->reserved = false;
+		cqm_nr_reserved--;
+		intel_cqm_free_rmid(entry);
+	}
+
+	return 0;
+}
+
+static ssize_t
+reserved_rmids_show(struct device *dev, struct device_attribute *attr,
+		    char *page)
+{
+	ssize_t rv;
+
+	mutex_lock(&cache_mutex);
+	rv = snprintf(page, PAGE_SIZE-1, "%u\n", cqm_nr_reserved);
+	mutex_unlock(&cache_mutex);
+
+	return rv;
+}
+
+static ssize_t
+reserved_rmids_store(struct device *dev, struct device_attribute *attr,
+		     const char *buf, size_t count)
+{
+	unsigned int nr;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &nr);
+	if (ret)
+		return ret;
+
+	mutex_lock(&cache_mutex);
+	ret = intel_cqm_set_reserved(nr);
+	mutex_unlock(&cache_mutex);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR_RW(max_recycle_threshold);
+static DEVICE_ATTR_RW(sliding_window_size);
+static DEVICE_ATTR_RW(publish_interval_ms);
+static DEVICE_ATTR_RW(reader_cpus);
+static DEVICE_ATTR_RW(reserved_rmids);
+
+static struct attribute *intel_cqm_attrs[] = {
+	&dev_attr_max_recycle_threshold.attr,
+	&dev_attr_sliding_window_size.attr,
+	&dev_attr_publish_interval_ms.attr,
+	&dev_attr_reader_cpus.attr,
+	&dev_attr_reserved_rmids.attr,
 	NULL,
 };
 
-static struct attribute *intel_mbm_events_attr[] = {
-	EVENT_PTR(intel_cqm_total_bw),
-	EVENT_PTR(intel_cqm_local_bw),
-	EVENT_PTR(intel_cqm_avg_total_bw),
-	EVENT_PTR(intel_cqm_avg_local_bw),
-	EVENT_PTR(intel_cqm_total_bw_pkg),
-	EVENT_PTR(intel_cqm_local_bw_pkg),
-	EVENT_PTR(intel_cqm_avg_total_bw_pkg),
-	EVENT_PTR(intel_cqm_avg_local_bw_pkg),
-	EVENT_PTR(intel_cqm_total_bw_unit),
-	EVENT_PTR(intel_cqm_local_bw_unit),
-	EVENT_PTR(intel_cqm_avg_total_bw_unit),
-	EVENT_PTR(intel_cqm_avg_local_bw_unit),
-	EVENT_PTR(intel_cqm_total_bw_scale),
-	EVENT_PTR(intel_cqm_local_bw_scale),
-	EVENT_PTR(intel_cqm_avg_total_bw_scale),
-	EVENT_PTR(intel_cqm_avg_local_bw_scale),
-	EVENT_PTR(intel_cqm_total_bw_snapshot),
-	EVENT_PTR(intel_cqm_local_bw_snapshot),
-	EVENT_PTR(intel_cqm_avg_total_bw_snapshot),
-	EVENT_PTR(intel_cqm_avg_local_bw_snapshot),
-	EVENT_PTR(intel_cqm_total_bw_runavg_nosamples),
-	EVENT_PTR(intel_cqm_local_bw_runavg_nosamples),
-	NULL,
+static const struct attribute_group intel_cqm_group = {
+	.attrs = intel_cqm_attrs,
 };
 
-static struct attribute *intel_cmt_mbm_events_attr[] = {
-	EVENT_PTR(intel_cqm_llc),
-	EVENT_PTR(intel_cqm_total_bw),
-	EVENT_PTR(intel_cqm_local_bw),
-	EVENT_PTR(intel_cqm_avg_total_bw),
-	EVENT_PTR(intel_cqm_avg_local_bw),
-	EVENT_PTR(intel_cqm_llc_pkg),
-	EVENT_PTR(intel_cqm_total_bw_pkg),
-	EVENT_PTR(intel_cqm_local_bw_pkg),
-	EVENT_PTR(intel_cqm_avg_total_bw_pkg),
-	EVENT_PTR(intel_cqm_avg_local_bw_pkg),
-	EVENT_PTR(intel_cqm_llc_unit),
-	EVENT_PTR(intel_cqm_total_bw_unit),
-	EVENT_PTR(intel_cqm_local_bw_unit),
-	EVENT_PTR(intel_cqm_avg_total_bw_unit),
-	EVENT_PTR(intel_cqm_avg_local_bw_unit),
-	EVENT_PTR(intel_cqm_llc_scale),
-	EVENT_PTR(intel_cqm_total_bw_scale),
-	EVENT_PTR(intel_cqm_local_bw_scale),
-	EVENT_PTR(intel_cqm_avg_total_bw_scale),
-	EVENT_PTR(intel_cqm_avg_local_bw_scale),
-	EVENT_PTR(intel_cqm_llc_snapshot),
-	EVENT_PTR(intel_cqm_total_bw_snapshot),
-	EVENT_PTR(intel_cqm_local_bw_snapshot),
-	EVENT_PTR(intel_cqm_avg_total_bw_snapshot),
-	EVENT_PTR(intel_cqm_avg_local_bw_snapshot),
-	EVENT_PTR(intel_cqm_total_bw_runavg_nosamples),
-	EVENT_PTR(intel_cqm_local_bw_runavg_nosamples),
+#define CQM_STAT_ATTR(_name, _item)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *page)	\
+{									\
+	return snprintf(page, PAGE_SIZE-1, "%lu\n", cqm_stat_sum(_item));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+CQM_STAT_ATTR(msr_reads, CQM_STAT_MSR_READ);
+CQM_STAT_ATTR(msr_writes, CQM_STAT_MSR_WRITE);
+CQM_STAT_ATTR(ipi_sweeps, CQM_STAT_IPI_SWEEP);
+CQM_STAT_ATTR(hrtimer_fires, CQM_STAT_HRTIMER);
+CQM_STAT_ATTR(mbm_overflows, CQM_STAT_MBM_OVERFLOW);
+CQM_STAT_ATTR(mbm_samples_throttled, CQM_STAT_MBM_THROTTLED);
+CQM_STAT_ATTR(mbm_samples_late, CQM_STAT_MBM_LATE);
+CQM_STAT_ATTR(rotations, CQM_STAT_ROTATE);
+CQM_STAT_ATTR(rmid_exhausted, CQM_STAT_RMID_EXHAUSTED);
+
+static ssize_t
+limbo_rmids_show(struct device *dev, struct device_attribute *attr,
+		 char *page)
+{
+	unsigned int nr;
+
+	mutex_lock(&cache_mutex);
+	nr = cqm_nr_limbo;
+	mutex_unlock(&cache_mutex);
+
+	return snprintf(page, PAGE_SIZE-1, "%u\n", nr);
+}
+
+static ssize_t
+free_rmids_show(struct device *dev, struct device_attribute *attr,
+		char *page)
+{
+	struct cqm_rmid_entry *entry;
+	unsigned int nr = 0;
+
+	mutex_lock(&cache_mutex);
+	list_for_each_entry(entry, &cqm_rmid_free_lru, list)
+		nr++;
+	mutex_unlock(&cache_mutex);
+
+	return snprintf(page, PAGE_SIZE-1, "%u\n", nr);
+}
+
+/*
+ * Current recycle threshold in bytes, bounded by max_recycle_threshold.
+ */
+static ssize_t
+recycle_threshold_show(struct device *dev, struct device_attribute *attr,
+		       char *page)
+{
+	ssize_t rv;
+
+	mutex_lock(&cache_mutex);
+	rv = snprintf(page, PAGE_SIZE-1, "%u\n",
+		      __intel_cqm_threshold * cqm_l3_scale);
+	mutex_unlock(&cache_mutex);
+
+	return rv;
+}
+
+static DEVICE_ATTR_RO(limbo_rmids);
+static DEVICE_ATTR_RO(free_rmids);
+static DEVICE_ATTR_RO(recycle_threshold);
+
+static struct attribute *intel_cqm_stats_attrs[] = {
+	&dev_attr_msr_reads.attr,
+	&dev_attr_msr_writes.attr,
+	&dev_attr_ipi_sweeps.attr,
+	&dev_attr_hrtimer_fires.attr,
+	&dev_attr_mbm_overflows.attr,
+	&dev_attr_mbm_samples_throttled.attr,
+	&dev_attr_mbm_samples_late.attr,
+	&dev_attr_rotations.attr,
+	&dev_attr_rmid_exhausted.attr,
+	&dev_attr_limbo_rmids.attr,
+	&dev_attr_free_rmids.attr,
+	&dev_attr_recycle_threshold.attr,
 	NULL,
 };
 
-static struct attribute_group intel_cqm_events_group = {
-	.name = "events",
-	.attrs = NULL,
-};
+static const struct attribute_group intel_cqm_stats_group = {
+	.name = "stats",
+	.attrs = intel_cqm_stats_attrs,
+};
+
+static ssize_t cqm_lat_show(enum cqm_lat_item item, char *page)
+{
+	unsigned long sum;
+	ssize_t rv = 0;
+	int i, cpu;
+
+	for (i = 0; i < CQM_LAT_BUCKETS; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu(cqm_lat_hist, cpu).bucket[item][i];
+
+		rv += snprintf(page + rv, PAGE_SIZE - 1 - rv, "%lu%c", sum,
+			       i == CQM_LAT_BUCKETS - 1 ? '\n' : ' ');
+	}
+
+	return rv;
+}
+
+#define CQM_LAT_ATTR(_name, _item)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *page)	\
+{									\
+	return cqm_lat_show(_item, page);				\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+CQM_LAT_ATTR(counter_read, CQM_LAT_COUNTER_READ);
+CQM_LAT_ATTR(ipi, CQM_LAT_IPI);
+CQM_LAT_ATTR(count, CQM_LAT_COUNT);
+CQM_LAT_ATTR(rotate, CQM_LAT_ROTATE);
+
+static ssize_t
+enable_show(struct device *dev, struct device_attribute *attr, char *page)
+{
+	return snprintf(page, PAGE_SIZE-1, "%d\n",
+			static_key_enabled(&cqm_lat_key));
+}
+
+static ssize_t
+enable_store(struct device *dev, struct device_attribute *attr,
+	     const char *buf, size_t count)
+{
+	bool enable;
+	int ret;
 
-PMU_FORMAT_ATTR(event, "config:0-7");
-static struct attribute *intel_cqm_formats_attr[] = {
-	&format_attr_event.attr,
+	ret = strtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&cache_mutex);
+	if (enable)
+		static_branch_enable(&cqm_lat_key);
+	else
+		static_branch_disable(&cqm_lat_key);
+	mutex_unlock(&cache_mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(enable);
+
+static struct attribute *intel_cqm_latency_attrs[] = {
+	&dev_attr_enable.attr,
+	&dev_attr_counter_read.attr,
+	&dev_attr_ipi.attr,
+	&dev_attr_count.attr,
+	&dev_attr_rotate.attr,
 	NULL,
 };
 
-static struct attribute_group intel_cqm_format_group = {
-	.name = "format",
-	.attrs = intel_cqm_formats_attr,
+static const struct attribute_group intel_cqm_latency_group = {
+	.name = "latency",
+	.attrs = intel_cqm_latency_attrs,
 };
 
+/*
+ * cat/l3_cbm reads as the hex CBM of every CLOSID, in CLOSID order.
+ * Writing "<closid>=<cbm>" sets the CBM of one CLOSID on all packages.
+ */
 static ssize_t
-max_recycle_threshold_show(struct device *dev, struct device_attribute *attr,
-			   char *page)
+l3_cbm_show(struct device *dev, struct device_attribute *attr, char *page)
 {
-	ssize_t rv;
+	ssize_t rv = 0;
+	u32 closid;
 
 	mutex_lock(&cache_mutex);
-	rv = snprintf(page, PAGE_SIZE-1, "%u\n", __intel_cqm_max_threshold);
+	for (closid = 0; closid < cat_max_closid; closid++)
+		rv += snprintf(page + rv, PAGE_SIZE - 1 - rv, "%x%c",
+			       cat_cbm[closid],
+			       closid == cat_max_closid - 1 ? '\n' : ' ');
 	mutex_unlock(&cache_mutex);
 
 	return rv;
 }
 
 static ssize_t
-sliding_window_size_show(struct device *dev, struct device_attribute *attr,
-		char *page)
+l3_cbm_store(struct device *dev, struct device_attribute *attr,
+	     const char *buf, size_t count)
 {
-	ssize_t rv;
+	unsigned int closid, cbm;
+	int ret;
 
-	rv = snprintf(page, PAGE_SIZE-1, "%u\n", mbm_window_size);
-	return rv;
+	if (sscanf(buf, "%u=%x", &closid, &cbm) != 2)
+		return -EINVAL;
+
+	mutex_lock(&cache_mutex);
+	ret = intel_cat_set_cbm(closid, cbm);
+	mutex_unlock(&cache_mutex);
+
+	return ret ? ret : count;
 }
 
 static ssize_t
-max_recycle_threshold_store(struct device *dev,
-			    struct device_attribute *attr,
-			    const char *buf, size_t count)
+num_closids_show(struct device *dev, struct device_attribute *attr,
+		 char *page)
 {
-	unsigned int bytes, cachelines;
-	int ret;
+	return snprintf(page, PAGE_SIZE-1, "%u\n", cat_max_closid);
+}
 
-	ret = kstrtouint(buf, 0, &bytes);
-	if (ret)
-		return ret;
+static ssize_t
+cbm_len_show(struct device *dev, struct device_attribute *attr, char *page)
+{
+	return snprintf(page, PAGE_SIZE-1, "%u\n", cat_cbm_len);
+}
 
-	mutex_lock(&cache_mutex);
+static DEVICE_ATTR_RW(l3_cbm);
+static DEVICE_ATTR_RO(num_closids);
+static DEVICE_ATTR_RO(cbm_len);
 
-	__intel_cqm_max_threshold = bytes;
-	cachelines = bytes / cqm_l3_scale;
+static struct attribute *intel_cqm_cat_attrs[] = {
+	&dev_attr_l3_cbm.attr,
+	&dev_attr_num_closids.attr,
+	&dev_attr_cbm_len.attr,
+	NULL,
+};
 
-	/*
-	 * The new maximum takes effect immediately.
-	 */
-	if (__intel_cqm_threshold > cachelines)
-		__intel_cqm_threshold = cachelines;
+static umode_t intel_cqm_cat_visible(struct kobject *kobj,
+				     struct attribute *attr, int i)
+{
+	return is_cat ? attr->mode : 0;
+}
+
+static const struct attribute_group intel_cqm_cat_group = {
+	.name = "cat",
+	.attrs = intel_cqm_cat_attrs,
+	.is_visible = intel_cqm_cat_visible,
+};
+
+/*
+ * mba/target_mbps reads as the bandwidth budget of every CLOSID, 0 for
+ * uncontrolled ones. Writing "<closid>=<MB/sec>" sets a budget and
+ * starts the controller, a budget of 0 removes the throttling again.
+ *
+ * mba/delay reads as the throttle delay currently programmed for every
+ * CLOSID.
+ */
+static ssize_t
+target_mbps_show(struct device *dev, struct device_attribute *attr,
+		 char *page)
+{
+	ssize_t rv = 0;
+	u32 closid;
 
+	mutex_lock(&cache_mutex);
+	for (closid = 0; closid < mba_max_closid; closid++)
+		rv += snprintf(page + rv, PAGE_SIZE - 1 - rv, "%u%c",
+			       mba_ctrl[closid].target,
+			       closid == mba_max_closid - 1 ? '\n' : ' ');
 	mutex_unlock(&cache_mutex);
 
-	return count;
+	return rv;
 }
 
 static ssize_t
-sliding_window_size_store(struct device *dev,
-			  struct device_attribute *attr,
-			  const char *buf, size_t count)
+target_mbps_store(struct device *dev, struct device_attribute *attr,
+		  const char *buf, size_t count)
 {
-	unsigned int bytes;
+	unsigned int closid, target;
 	int ret;
 
-	ret = kstrtouint(buf, 0, &bytes);
-	if (ret)
-		return ret;
+	if (sscanf(buf, "%u=%u", &closid, &target) != 2)
+		return -EINVAL;
 
 	mutex_lock(&cache_mutex);
-	if (bytes >= MBM_FIFO_SIZE_MIN && bytes <= MBM_FIFO_SIZE_MAX)
-		mbm_window_size = bytes;
-	else {
-		mutex_unlock(&cache_mutex);
-		return -EINVAL;
-	}
+	ret = intel_mba_set_target(closid, target);
 	mutex_unlock(&cache_mutex);
 
-	return count;
+	return ret ? ret : count;
 }
 
-static DEVICE_ATTR_RW(max_recycle_threshold);
-static DEVICE_ATTR_RW(sliding_window_size);
+static ssize_t
+delay_show(struct device *dev, struct device_attribute *attr, char *page)
+{
+	ssize_t rv = 0;
+	u32 closid;
 
-static struct attribute *intel_cqm_attrs[] = {
-	&dev_attr_max_recycle_threshold.attr,
-	&dev_attr_sliding_window_size.attr,
+	mutex_lock(&cache_mutex);
+	for (closid = 0; closid < mba_max_closid; closid++)
+		rv += snprintf(page + rv, PAGE_SIZE - 1 - rv, "%u%c",
+			       mba_ctrl[closid].delay,
+			       closid == mba_max_closid - 1 ? '\n' : ' ');
+	mutex_unlock(&cache_mutex);
+
+	return rv;
+}
+
+static ssize_t
+max_delay_show(struct device *dev, struct device_attribute *attr,
+	       char *page)
+{
+	return snprintf(page, PAGE_SIZE-1, "%u\n", mba_max_delay);
+}
+
+static DEVICE_ATTR_RW(target_mbps);
+static DEVICE_ATTR_RO(delay);
+static DEVICE_ATTR_RO(max_delay);
+
+static struct attribute *intel_cqm_mba_attrs[] = {
+	&dev_attr_target_mbps.attr,
+	&dev_attr_delay.attr,
+	&dev_attr_max_delay.attr,
 	NULL,
 };
 
-static const struct attribute_group intel_cqm_group = {
-	.attrs = intel_cqm_attrs,
+static umode_t intel_cqm_mba_visible(struct kobject *kobj,
+				     struct attribute *attr, int i)
+{
+	return is_mba ? attr->mode : 0;
+}
+
+static const struct attribute_group intel_cqm_mba_group = {
+	.name = "mba",
+	.attrs = intel_cqm_mba_attrs,
+	.is_visible = intel_cqm_mba_visible,
 };
 
 static const struct attribute_group *intel_cqm_attr_groups[] = {
 	&intel_cqm_events_group,
 	&intel_cqm_format_group,
 	&intel_cqm_group,
+	&intel_cqm_stats_group,
+	&intel_cqm_latency_group,
+	&intel_cqm_cat_group,
+	&intel_cqm_mba_group,
 	NULL,
 };
 
@@ -1895,19 +4593,97 @@ static struct pmu intel_cqm_pmu = {
 	.stop		     = intel_cqm_event_stop,
 	.read		     = intel_cqm_event_read,
 	.count		     = intel_cqm_event_count,
+	.event_mapped	     = intel_cqm_event_mapped,
+	.event_unmapped	     = intel_cqm_event_unmapped,
+	.sched_task	     = intel_cqm_sched_task,
 };
 
-static inline void cqm_pick_event_reader(int cpu)
+static void mbm_pkg_free(struct mbm_pkg *pkg)
 {
-	int phys_id = topology_physical_package_id(cpu);
-	int i;
+	if (!pkg)
+		return;
 
-	for_each_cpu(i, &cqm_cpumask) {
-		if (phys_id == topology_physical_package_id(i))
-			return;	/* already got reader for this socket */
+	kfree(pkg->local);
+	kfree(pkg->total);
+	kfree(pkg->mba);
+	kfree(pkg);
+}
+
+static struct mbm_pkg *mbm_pkg_alloc(void)
+{
+	struct mbm_pkg *pkg;
+
+	pkg = kzalloc(sizeof(*pkg), GFP_KERNEL);
+	if (!pkg)
+		return NULL;
+
+	pkg->local = kcalloc(cqm_max_rmid + 1, sizeof(struct sample),
+			     GFP_KERNEL);
+	pkg->total = kcalloc(cqm_max_rmid + 1, sizeof(struct sample),
+			     GFP_KERNEL);
+	pkg->mba = kcalloc(cqm_max_rmid + 1, sizeof(struct mba_sample),
+			   GFP_KERNEL);
+	if (!pkg->local || !pkg->total || !pkg->mba) {
+		mbm_pkg_free(pkg);
+		return NULL;
 	}
 
-	cpumask_set_cpu(cpu, &cqm_cpumask);
+	return pkg;
+}
+
+/*
+ * Called before a cpu comes up; we don't know its package yet.
+ */
+static int mbm_pkg_prepare(void)
+{
+	if (!is_mbm || mbm_pkg_spare)
+		return 0;
+
+	mbm_pkg_spare = mbm_pkg_alloc();
+
+	return mbm_pkg_spare ? 0 : -ENOMEM;
+}
+
+/*
+ * The cpu came up in a package we already had.
+ */
+static void mbm_pkg_release_spare(void)
+{
+	mbm_pkg_free(mbm_pkg_spare);
+	mbm_pkg_spare = NULL;
+}
+
+/*
+ * Set the logical package index of @cpu, adding its package if @cpu is
+ * the first of it we see.
+ */
+static int cqm_pkg_assign(unsigned int cpu)
+{
+	int domain = cqm_domain_id(cpu);
+	unsigned int i;
+
+	for (i = 0; i < cqm_nr_pkgs; i++) {
+		if (cqm_pkg_domain[i] == domain)
+			goto found;
+	}
+
+	if (is_mbm) {
+		if (WARN_ON_ONCE(!mbm_pkg_spare))
+			return -ENOMEM;
+		mbm_pkgs[i] = mbm_pkg_spare;
+		mbm_pkg_spare = NULL;
+	}
+	cqm_pkg_domain[i] = domain;
+
+	/*
+	 * Publish the samples before the count that covers them,
+	 * mbm_reset_stats() may walk the packages concurrently.
+	 */
+	smp_wmb();
+	WRITE_ONCE(cqm_nr_pkgs, i + 1);
+found:
+	per_cpu(cqm_pkg_idx, cpu) = i;
+	return 0;
 }
 
 static int intel_mbm_cpu_prepare(unsigned int cpu)
@@ -1931,38 +4707,76 @@ static int intel_cqm_cpu_starting(unsigned int cpu)
 {
 	struct intel_pqr_state *state = &per_cpu(pqr_state, cpu);
 	struct cpuinfo_x86 *c = &cpu_data(cpu);
+	int ret;
 
 	state->rmid = 0;
 	state->closid = 0;
 	state->rmid_usecnt = 0;
 
-	WARN_ON(c->x86_cache_max_rmid != cqm_max_rmid);
+	WARN_ON(c->x86_cache_max_rmid + 1 != (cqm_max_rmid + 1) * cqm_snc_ways);
 	WARN_ON(c->x86_cache_occ_scale != cqm_l3_scale);
 
+	per_cpu(cqm_rmid_offset, cpu) =
+		(cpu_to_node(cpu) % cqm_snc_ways) * (cqm_max_rmid + 1);
+
+	ret = cqm_pkg_assign(cpu);
+	if (ret)
+		return ret;
+
 	return intel_mbm_cpu_prepare(cpu);
 }
 
+/*
+ * Take an MBM sample of every monitored group in the local domain, so
+ * that its bytes and prev_time baseline is current. Both counters are
+ * sampled whatever the leader counts: an llc_occupancy leader may have
+ * total_bw and local_bw members, and all MBM events of a group share
+ * its RMID's samples.
+ *
+ * We expect to be called with cache_mutex held.
+ */
+static void __intel_mbm_sweep(void *info)
+{
+	struct perf_event *group;
+	u32 rmid;
+
+	list_for_each_entry(group, &cache_groups, hw.cqm_groups_entry) {
+		rmid = group->hw.cqm_rmid;
+		if (!__rmid_valid(rmid))
+			continue;
+
+		rmid_read_mbm(rmid, QOS_MBM_TOTAL_EVENT_ID);
+		rmid_read_mbm(rmid, QOS_MBM_LOCAL_EVENT_ID);
+	}
+}
+
 static void intel_cqm_cpu_exit(unsigned int cpu)
 {
-	int phys_id = topology_physical_package_id(cpu);
+	int domain = cqm_domain_id(cpu);
 	int i;
 	struct mbm_pmu *pmu = per_cpu(mbm_pmu, cpu);
 
 	/*
 	 * Is @cpu a designated cqm reader?
 	 */
-	if (!cpumask_test_and_clear_cpu(cpu, &cqm_cpumask))
+	if (!cpumask_test_cpu(cpu, &cqm_cpumask))
 		return;
 
-	for_each_online_cpu(i) {
-		if (i == cpu)
-			continue;
+	/*
+	 * The MBM samples are per domain, not per reader, so the next
+	 * reader carries on from the same state. Take a final sample on
+	 * the way out so that it starts from a fresh baseline instead of
+	 * one that may be a second old by the time it is first read.
+	 */
+	mutex_lock(&cache_mutex);
+	if (is_mbm)
+		smp_call_function_single(cpu, __intel_mbm_sweep, NULL, 1);
 
-		if (phys_id == topology_physical_package_id(i)) {
-			cpumask_set_cpu(i, &cqm_cpumask);
-			break;
-		}
-	}
+	cpumask_clear_cpu(cpu, &cqm_cpumask);
+	i = cqm_pick_domain_reader(domain, cpu);
+	if (i >= 0)
+		cpumask_set_cpu(i, &cqm_cpumask);
+	mutex_unlock(&cache_mutex);
 
 	/* cancel overflow polling timer for CPU */
 	if (pmu)
@@ -1970,12 +4784,61 @@ static void intel_cqm_cpu_exit(unsigned int cpu)
 
 }
 
+/*
+ * Clearing bit 0 of MSR_RMID_SNC_CONFIG turns on RMID sharing: the
+ * logical RMID in PQR_ASSOC then counts into the hardware RMID of the
+ * node the cache or memory belongs to.
+ */
+static void __intel_snc_remap(void *info)
+{
+	if (cqm_snc_ways <= 1)
+		return;
+
+	cqm_wrmsrl(MSR_RMID_SNC_CONFIG,
+		   cqm_rdmsrl(MSR_RMID_SNC_CONFIG) & ~BIT_ULL(0));
+}
+
+/*
+ * Count the nodes sharing the boot cpu's package. The MSR only exists
+ * on parts that can do SNC, which keeps Cluster-on-Die, whose RMIDs
+ * are not split, out of this.
+ */
+static void intel_snc_init(void)
+{
+	const struct cpumask *pkg = topology_core_cpumask(0);
+	unsigned int ways = 0;
+	u64 val;
+	int node;
+
+	if (rdmsrl_safe(MSR_RMID_SNC_CONFIG, &val))
+		return;
+
+	for_each_online_node(node) {
+		if (cpumask_intersects(cpumask_of_node(node), pkg))
+			ways++;
+	}
+
+	if (ways <= 1)
+		return;
+
+	cqm_snc_ways = ways;
+	cqm_max_rmid = (cqm_max_rmid + 1) / ways - 1;
+
+	pr_info("Sub-NUMA Clustering, %u nodes per package\n", ways);
+}
+
 static int intel_cqm_cpu_notifier(struct notifier_block *nb,
 				  unsigned long action, void *hcpu)
 {
 	unsigned int cpu  = (unsigned long)hcpu;
 	int ret;
 	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		return notifier_from_errno(mbm_pkg_prepare());
+	case CPU_UP_CANCELED:
+	case CPU_ONLINE:
+		mbm_pkg_release_spare();
+		break;
 	case CPU_DOWN_PREPARE:
 		intel_cqm_cpu_exit(cpu);
 		break;
@@ -1983,7 +4846,11 @@ static int intel_cqm_cpu_notifier(struct notifier_block *nb,
 		ret = intel_cqm_cpu_starting(cpu);
 		if (ret)
 			return ret;
+		__intel_snc_remap(NULL);
 		cqm_pick_event_reader(cpu);
+		cqm_sched_cb_sync(NULL);
+		intel_cat_cpu_starting();
+		intel_mba_cpu_starting();
 		break;
 	}
 
@@ -2000,11 +4867,70 @@ static const struct x86_cpu_id intel_mbm_match[] = {
 	{}
 };
 
+static int intel_cat_init(void)
+{
+	u32 eax, ebx, ecx, edx, closid;
+
+	if (!boot_cpu_has(X86_FEATURE_RDT_A))
+		return -ENODEV;
+
+	/* Resource type sub-leaf, EAX=10h, ECX=0. Bit 1 is L3 CAT */
+	cpuid_count(0x00000010, 0, &eax, &ebx, &ecx, &edx);
+	if (!(ebx & BIT(1)))
+		return -ENODEV;
+
+	/* L3 CAT sub-leaf, EAX=10h, ECX=1 */
+	cpuid_count(0x00000010, 1, &eax, &ebx, &ecx, &edx);
+	cat_cbm_len = (eax & 0x1f) + 1;
+	cat_max_closid = (edx & 0xffff) + 1;
+
+	cat_cbm = kcalloc(cat_max_closid, sizeof(*cat_cbm), GFP_KERNEL);
+	if (!cat_cbm)
+		return -ENOMEM;
+
+	for (closid = 0; closid < cat_max_closid; closid++)
+		cat_cbm[closid] = BIT_ULL(cat_cbm_len) - 1;
+
+	is_cat = true;
+
+	return 0;
+}
+
+static int intel_mba_init(void)
+{
+	u32 eax, ebx, ecx, edx;
+
+	/* MBA needs MBM to measure what it throttles */
+	if (!is_mbm || !boot_cpu_has(X86_FEATURE_RDT_A))
+		return -ENODEV;
+
+	/* Resource type sub-leaf, EAX=10h, ECX=0. Bit 3 is MBA */
+	cpuid_count(0x00000010, 0, &eax, &ebx, &ecx, &edx);
+	if (!(ebx & BIT(3)))
+		return -ENODEV;
+
+	/* MBA sub-leaf, EAX=10h, ECX=3. Only linear throttling is used */
+	cpuid_count(0x00000010, 3, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & BIT(2)))
+		return -ENODEV;
+
+	mba_max_delay = rounddown((eax & 0xfff) + 1, MBA_DELAY_STEP);
+	mba_max_closid = (edx & 0xffff) + 1;
+
+	mba_ctrl = kcalloc(mba_max_closid, sizeof(*mba_ctrl), GFP_KERNEL);
+	if (!mba_ctrl)
+		return -ENOMEM;
+
+	is_mba = true;
+
+	return 0;
+}
+
 static int  intel_mbm_init(void)
 {
-	u32 i;
-	int ret, array_size;
-	char scale[20], *str = NULL;
+	int ret;
+	char scale[20], *str = NULL, *miss_str = NULL;
+	unsigned int line = boot_cpu_data.x86_clflush_size;
 
 	if (!x86_match_cpu(intel_mbm_match))
 		return -ENODEV;
@@ -2022,40 +4948,44 @@ static int  intel_mbm_init(void)
 		is_mbm = false;
 		return -ENOMEM;
 	}
+
+	/*
+	 * One LLC miss brings in a cacheline: llc_miss_rate is the total
+	 * bandwidth in lines/sec.
+	 */
+	snprintf(scale, sizeof(scale), "%u.%06u", cqm_l3_scale / line,
+		 (cqm_l3_scale % line) * 1000000 / line);
+	miss_str = kstrdup(scale, GFP_KERNEL);
+	if (!miss_str) {
+		ret = -ENOMEM;
+		goto free_str;
+	}
+
 	if (cqm_llc_occ)
 		intel_cqm_events_group.attrs =
 			  intel_cmt_mbm_events_attr;
 	else
 		intel_cqm_events_group.attrs = intel_mbm_events_attr;
 
-	for_each_possible_cpu(i) {
-		mbm_socket_max = max(mbm_socket_max,
-				     topology_physical_package_id(i));
-	}
-	mbm_socket_max++;
-
-	array_size = (cqm_max_rmid + 1) * mbm_socket_max;
-	mbm_local = kzalloc_node(sizeof(struct sample) * array_size,
-				 GFP_KERNEL, NUMA_NO_NODE);
-	if (!mbm_local) {
+	/*
+	 * Only the package pointers are sized for the worst case, the
+	 * samples themselves are allocated per package as it shows up.
+	 */
+	mbm_pkgs = kcalloc(nr_cpu_ids, sizeof(*mbm_pkgs), GFP_KERNEL);
+	if (!mbm_pkgs) {
 		ret = -ENOMEM;
 		goto free_str;
 	}
-
-	mbm_total = kzalloc_node(sizeof(struct sample) * array_size,
-				 GFP_KERNEL, NUMA_NO_NODE);
-	if (!mbm_total) {
-		ret = -ENOMEM;
-		goto free_local;
-	}
 	event_attr_intel_cqm_local_bw_scale.event_str = str;
 	event_attr_intel_cqm_total_bw_scale.event_str = str;
 	event_attr_intel_cqm_avg_local_bw_scale.event_str = str;
 	event_attr_intel_cqm_avg_total_bw_scale.event_str = str;
+	event_attr_intel_cqm_remote_bw_scale.event_str = str;
+	event_attr_intel_cqm_avg_remote_bw_scale.event_str = str;
+	event_attr_intel_cqm_miss_rate_scale.event_str = miss_str;
 	return 0;
-free_local:
-	kfree(mbm_local);
 free_str:
+	kfree(miss_str);
 	kfree(str);
 	is_mbm = false;
 	return ret;
@@ -2095,6 +5025,9 @@ static int __init intel_cqm_init(void)
 			goto out;
 		}
 	}
+
+	intel_snc_init();
+
 	if (x86_match_cpu(intel_cqm_match)) {
 		cqm_llc_occ = true;
 		intel_cqm_events_group.attrs = intel_cqm_events_attr;
@@ -2104,10 +5037,12 @@ static int __init intel_cqm_init(void)
 	 * of lines tagged per RMID if all RMIDs have the same number of
 	 * lines tagged in the LLC.
 	 *
-	 * For a 35MB LLC and 56 RMIDs, this is ~1.8% of the LLC.
+	 * For a 35MB LLC and 56 RMIDs, this is ~1.8% of the LLC. With SNC
+	 * every node has its own share of both.
 	 */
 	__intel_cqm_max_threshold =
-		boot_cpu_data.x86_cache_size * 1024 / (cqm_max_rmid + 1);
+		boot_cpu_data.x86_cache_size * 1024 / (cqm_max_rmid + 1) /
+		cqm_snc_ways;
 
 	snprintf(scale, sizeof(scale), "%u", cqm_l3_scale);
 	str = kstrdup(scale, GFP_KERNEL);
@@ -2125,12 +5060,35 @@ static int __init intel_cqm_init(void)
 	if (ret)
 		goto out;
 
+	cqm_pkg_domain = kcalloc(nr_cpu_ids, sizeof(*cqm_pkg_domain), GFP_KERNEL);
+	if (!cqm_pkg_domain) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	for_each_online_cpu(i) {
+		ret = mbm_pkg_prepare();
+		if (ret)
+			goto out;
 		ret = intel_cqm_cpu_starting(i);
 		if (ret)
 			goto out;
 		cqm_pick_event_reader(i);
 	}
+	mbm_pkg_release_spare();
+	on_each_cpu(__intel_snc_remap, NULL, 1);
+
+	/*
+	 * Start every package off with the full mask for all CLOSIDs.
+	 */
+	if (!intel_cat_init())
+		cqm_on_each_reader(__intel_cat_reset, NULL);
+
+	/*
+	 * And unthrottled.
+	 */
+	if (!intel_mba_init())
+		cqm_on_each_reader(__intel_mba_reset, NULL);
 
 	__perf_cpu_notifier(intel_cqm_cpu_notifier);
 
@@ -2146,9 +5104,14 @@ out:
 	if (ret) {
 		kfree(str);
 		if (is_mbm) {
-			kfree(mbm_local);
-			kfree(mbm_total);
+			for (i = 0; i < cqm_nr_pkgs; i++)
+				mbm_pkg_free(mbm_pkgs[i]);
+			mbm_pkg_release_spare();
+			kfree(mbm_pkgs);
 		}
+		kfree(cqm_pkg_domain);
+		kfree(cat_cbm);
+		kfree(mba_ctrl);
 	}
 	return ret;
 }